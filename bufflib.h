@@ -0,0 +1,99 @@
+/*
+** C API for lua_bufflib, so other C modules can add to Buffers directly instead of pushing strings and calling buff:add.
+** Copyright (c) 2013 Choonster
+** See lua_bufflib.c for the license.
+**
+** The functions are reached through a versioned table of function pointers that the bufflib module stores in the registry when it's loaded,
+** so a module using this API doesn't need to link against bufflib. Each C file that uses it must call bufflib_loadapi once (e.g. in its luaopen_ function)
+** before using any of the other functions:
+**
+**     #include "bufflib.h"
+**
+**     static int addrow(lua_State *L) {
+**         bufflib_Buffer *B = bufflib_check(L, 1);
+**         char *p = bufflib_prep(B, 64);
+**         if (p == NULL)
+**             return luaL_error(L, "not enough memory");
+**         bufflib_commit(B, (size_t)sprintf(p, "%d,%d\n", 1, 2));
+**         lua_settop(L, 1);
+**         return 1;
+**     }
+**
+**     int luaopen_mymodule(lua_State *L) {
+**         bufflib_loadapi(L);
+**         ...
+**     }
+**
+** None of the functions except bufflib_check and bufflib_test call into the Lua state.
+** A Buffer must be kept alive (e.g. on the stack) while it's being used.
+*/
+
+#ifndef BUFFLIB_H
+#define BUFFLIB_H
+
+#include <stddef.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+/* The version of the API described by this header. New functions are only ever appended to bufflib_Api, with a new version */
+#define BUFFLIB_API_VERSION 3
+
+/* The registry key of the lightuserdata pointing to the bufflib_Api */
+#define BUFFLIB_API_KEY "bufflib_api"
+
+/* A Buffer. Its layout isn't part of the API */
+typedef struct Buffer bufflib_Buffer;
+
+typedef struct bufflib_Api {
+	int version;
+	/* Returns a pointer to at least sz bytes of free space at the end of the Buffer, or NULL if it can't be grown (out of memory or over a limit) */
+	char *(*reserve)(bufflib_Buffer *B, size_t sz);
+	/* Adds sz bytes written to the space returned by reserve to the Buffer's contents */
+	void (*commit)(bufflib_Buffer *B, size_t sz);
+	/* Appends len bytes from s to the Buffer. Returns 1 on success, 0 if it can't be grown */
+	int (*append)(bufflib_Buffer *B, const char *s, size_t len);
+	/* Returns a pointer to the Buffer's contents and stores their length in len. The pointer is only valid until the Buffer is next modified */
+	const char *(*data)(bufflib_Buffer *B, size_t *len);
+	/* Makes the contents of a gap Buffer contiguous. bufflib_check and bufflib_test already do this (version 2) */
+	void (*contiguous)(bufflib_Buffer *B);
+	/* Returns the Buffer at index idx, raising an error if the value isn't a Buffer (version 3) */
+	bufflib_Buffer *(*check)(lua_State *L, int idx);
+	/* Returns the Buffer at index idx, or NULL if the value isn't a Buffer (version 3) */
+	bufflib_Buffer *(*test)(lua_State *L, int idx);
+} bufflib_Api;
+
+/* lua_bufflib.c defines BUFFLIB_CORE to only get the declarations above */
+#ifndef BUFFLIB_CORE
+
+static const bufflib_Api *bufflib_api = NULL;
+
+/* Loads the API, requiring the bufflib module first if it isn't loaded. Raises an error if the loaded bufflib is too old */
+static void bufflib_loadapi(lua_State *L) {
+	lua_getfield(L, LUA_REGISTRYINDEX, BUFFLIB_API_KEY);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_getglobal(L, "require");
+		lua_pushliteral(L, "bufflib");
+		lua_call(L, 1, 0);
+		lua_getfield(L, LUA_REGISTRYINDEX, BUFFLIB_API_KEY);
+	}
+	bufflib_api = (const bufflib_Api *)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	if (bufflib_api == NULL || bufflib_api->version < BUFFLIB_API_VERSION) {
+		int version = bufflib_api != NULL ? bufflib_api->version : 0;
+		bufflib_api = NULL;
+		luaL_error(L, "bufflib C API version %d required, but the loaded bufflib provides version %d", BUFFLIB_API_VERSION, version);
+	}
+}
+
+#define bufflib_check(L, idx) (bufflib_api->check((L), (idx)))
+#define bufflib_test(L, idx) (bufflib_api->test((L), (idx)))
+#define bufflib_prep(B, n) (bufflib_api->reserve((B), (n)))
+#define bufflib_commit(B, n) (bufflib_api->commit((B), (n)))
+#define bufflib_addlstring(B, s, len) (bufflib_api->append((B), (s), (len)))
+#define bufflib_data(B, len) (bufflib_api->data((B), (len)))
+
+#endif
+
+#endif
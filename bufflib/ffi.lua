@@ -0,0 +1,130 @@
+--[[
+	LuaJIT FFI backend for lua_bufflib.
+	Copyright (c) 2013 Choonster
+
+	Released under the same MIT/X11 licence as lua_bufflib.c.
+]]
+
+--- LuaJIT FFI backend for lua_bufflib.
+--
+-- Every method in the `bufflib` module is a regular C function, which LuaJIT can't compile into traces.
+-- This module declares the start of the Buffer struct and a small table of C functions with `ffi.cdef` so that hot loops can append to a @{bufflib.Buffer|Buffer} without leaving the JIT compiler.
+--
+-- None of the C functions used here call back into Lua, so it's safe to call them from compiled code.
+--
+-- Loading this module also adds the @{ptr}, @{reserve} and @{commit} functions to the Buffer metatable, so they can be called as `buff:ptr()`, etc.
+--
+-- This module is only available on LuaJIT.
+--
+-- @module bufflib.ffi
+
+local ffi = require("ffi")
+local bufflib = require("bufflib")
+
+local type = type
+local error = error
+local ffi_cast, ffi_copy = ffi.cast, ffi.copy
+local isbuffer = bufflib.isbuffer
+
+ffi.cdef[[
+typedef struct bufflib_Buffer {
+	char *b;
+	size_t size;
+	size_t n;
+} bufflib_Buffer;
+
+typedef struct bufflib_FFIApi {
+	int version;
+	char *(*reserve)(bufflib_Buffer *B, size_t sz);
+	void (*commit)(bufflib_Buffer *B, size_t sz);
+	int (*append)(bufflib_Buffer *B, const char *s, size_t len);
+	const char *(*data)(bufflib_Buffer *B, size_t *len);
+	void (*contiguous)(bufflib_Buffer *B);
+} bufflib_FFIApi;
+]]
+
+local FFIAPI_VERSION = 2
+
+local api = ffi_cast("const bufflib_FFIApi *", bufflib._ffiapi)
+if api.version < FFIAPI_VERSION then
+	error(("bufflib.ffi requires FFI API version %d, but the loaded bufflib provides version %d"):format(FFIAPI_VERSION, api.version), 2)
+end
+
+local BufferPtr = ffi.typeof("bufflib_Buffer *")
+
+local M = {}
+
+-- Casts a Buffer userdata to a pointer to its struct, raising an error for any other value.
+-- The contents of a gap Buffer are made contiguous, since the functions below assume they are.
+local function tobuffer(buff, fname)
+	if not isbuffer(buff) then
+		error(("bad argument #1 to '%s' (Buffer expected, got %s)"):format(fname, type(buff)), 3)
+	end
+	local B = ffi_cast(BufferPtr, buff)
+	api.contiguous(B)
+	return B
+end
+
+--- Returns a pointer to the @{bufflib.Buffer|Buffer}'s contents and their length.
+-- The pointer is only valid until the Buffer is next modified or collected, so keep a reference to the Buffer while the pointer is in use.
+-- @tparam Buffer buff The Buffer.
+-- @return A `const char *` cdata pointing to the first byte of the contents.
+-- @treturn int The length of the contents in bytes.
+function M.ptr(buff)
+	local B = tobuffer(buff, "ptr")
+	return ffi_cast("const char *", B.b), tonumber(B.n)
+end
+
+--- Makes room for at least `n` more bytes at the end of the @{bufflib.Buffer|Buffer}.
+-- Write up to `n` bytes to the returned pointer and then call @{commit} with the number of bytes written to add them to the Buffer.
+-- @tparam Buffer buff The Buffer.
+-- @int n The number of bytes to reserve.
+-- @return A `char *` cdata pointing to the reserved space.
+function M.reserve(buff, n)
+	local B = tobuffer(buff, "reserve")
+	if B.size - B.n >= n then
+		return B.b + B.n
+	end
+	local p = api.reserve(B, n)
+	if p == nil then
+		error("not enough memory", 2)
+	end
+	return p
+end
+
+--- Adds `n` bytes written to the space returned by @{reserve} to the @{bufflib.Buffer|Buffer}'s contents.
+-- @tparam Buffer buff The Buffer.
+-- @int n The number of bytes written, which must not be greater than the number reserved.
+-- @treturn Buffer The Buffer object.
+function M.commit(buff, n)
+	local B = tobuffer(buff, "commit")
+	if n > B.size - B.n then
+		error("bad argument #2 to 'commit' (more bytes committed than reserved)", 2)
+	end
+	B.n = B.n + n
+	return buff
+end
+
+--- Appends some bytes to the @{bufflib.Buffer|Buffer}.
+-- Unlike @{bufflib.Buffer:add|`buff:add`}, this can be compiled by the JIT.
+-- @tparam Buffer buff The Buffer.
+-- @param s A string or a pointer cdata to copy the bytes from.
+-- @int[opt] len The number of bytes to copy. Required if `s` is a pointer, defaults to `#s` for strings.
+-- @treturn Buffer The Buffer object.
+function M.add(buff, s, len)
+	local B = tobuffer(buff, "add")
+	len = len or #s
+	if B.size - B.n < len and api.reserve(B, len) == nil then
+		error("not enough memory", 2)
+	end
+	ffi_copy(B.b + B.n, s, len)
+	B.n = B.n + len
+	return buff
+end
+
+local mt = getmetatable(bufflib.new())
+mt.ptr = M.ptr
+mt.reserve = M.reserve
+mt.commit = M.commit
+
+return M
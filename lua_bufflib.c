@@ -29,8 +29,8 @@
 A library for string buffers in Lua.
 
 The buffer code in this library is largely adapted from Lua 5.2's luaL\_Buffer code.
-The main difference is that Buffers store their contents in the registry instead of the stack when their length exceeds LUAL\_BUFFERSIZE.
-This prevents the C char array holding the current contents from being garbage collected until a larger array is required or the Buffer is reset or garbage collected.
+The main difference is that Buffers store their contents in a block obtained from the Lua state's allocator instead of the stack when their length exceeds LUAL\_BUFFERSIZE.
+This block is owned by the Buffer and is only released when a larger block is required or the Buffer is reset or garbage collected.
 You don't need to know any of this to use the library, it's just extra information for people curious about the implementation.
 
 
@@ -47,25 +47,282 @@ When you call a Buffer method with the `s_` prefix, it calls the equivalent `str
 
 For example, `bufflib.s_gsub(buff, ...)` and `buff:s_gsub(...)` are both equivalent to `str:gsub(...)` (where `buff` is a Buffer and `str` is the Buffer's contents as a string).
 
-Buffers define metamethods for equality (==), length (#), concatenation (..) and tostring(). See the documentation of each metamethod for details.
+Buffers define metamethods for equality (==), length (#), concatenation (..), tostring() and to-be-closed variables (Lua 5.4). See the documentation of each metamethod for details.
 
 @module bufflib
 */
 
+/*
+	Expose POSIX functions (write, writev, fileno, sched_yield, mmap) when compiling in strict ANSI mode.
+	mremap is a GNU extension.
+*/
+#if !defined(_WIN32)
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+#if !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#include <errno.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "lua.h"
 #include "lauxlib.h"
 
+#define BUFFLIB_CORE
+#include "bufflib.h"
+
 #ifdef _WIN32
 #define EXPORT __declspec(dllexport)
 #else
 #define EXPORT extern
 #endif
 
+/*
+	Threading primitives used by the objects that can be shared between lua_States (see Shared) and the worker pool (see runparallel).
+	Windows uses slim reader/writer locks (Vista and later) because they can be statically initialised like pthread mutexes.
+*/
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <io.h>
+
+typedef SRWLOCK Mutex;
+#define MUTEX_INITIALIZER SRWLOCK_INIT
+#define mutex_init(m) InitializeSRWLock(m)
+#define mutex_destroy(m) ((void)(m))
+#define mutex_lock(m) AcquireSRWLockExclusive(m)
+#define mutex_unlock(m) ReleaseSRWLockExclusive(m)
+#define thread_yield() SwitchToThread()
+
+typedef CONDITION_VARIABLE Cond;
+#define COND_INITIALIZER CONDITION_VARIABLE_INIT
+#define cond_wait(c, m) SleepConditionVariableSRW((c), (m), INFINITE, 0)
+#define cond_broadcast(c) WakeAllConditionVariable(c)
+
+typedef HANDLE Thread;
+#define THREADPROC(name, arg) DWORD WINAPI name(LPVOID arg)
+#define thread_start(t, f, arg) ((*(t) = CreateThread(NULL, 0, (f), (arg), 0, NULL)) != NULL)
+#define thread_join(t) (WaitForSingleObject((t), INFINITE), CloseHandle(t))
+
+#define write(fd, b, n) _write((fd), (b), (unsigned int)(n))
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define MAPPED_SUPPORTED
+
+typedef pthread_mutex_t Mutex;
+#define MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#define mutex_init(m) pthread_mutex_init((m), NULL)
+#define mutex_destroy(m) pthread_mutex_destroy(m)
+#define mutex_lock(m) pthread_mutex_lock(m)
+#define mutex_unlock(m) pthread_mutex_unlock(m)
+#define thread_yield() sched_yield()
+
+typedef pthread_cond_t Cond;
+#define COND_INITIALIZER PTHREAD_COND_INITIALIZER
+#define cond_wait(c, m) pthread_cond_wait((c), (m))
+#define cond_broadcast(c) pthread_cond_broadcast(c)
+
+typedef pthread_t Thread;
+#define THREADPROC(name, arg) void *name(void *arg)
+#define thread_start(t, f, arg) (pthread_create((t), NULL, (f), (arg)) == 0)
+#define thread_join(t) pthread_join((t), NULL)
+#endif
+
+/*
+	Atomic operations on size_t values, used by the lock-free Log.
+	All of these are full memory barriers.
+*/
+#if defined(_WIN32) && defined(_WIN64)
+#define atomic_fetchadd(p, v) ((size_t)InterlockedExchangeAdd64((volatile LONG64 *)(p), (LONG64)(v)))
+#define atomic_fetchor(p, v) ((size_t)InterlockedOr64((volatile LONG64 *)(p), (LONG64)(v)))
+#define atomic_swap(p, v) ((size_t)InterlockedExchange64((volatile LONG64 *)(p), (LONG64)(v)))
+#elif defined(_WIN32)
+#define atomic_fetchadd(p, v) ((size_t)InterlockedExchangeAdd((volatile LONG *)(p), (LONG)(v)))
+#define atomic_fetchor(p, v) ((size_t)InterlockedOr((volatile LONG *)(p), (LONG)(v)))
+#define atomic_swap(p, v) ((size_t)InterlockedExchange((volatile LONG *)(p), (LONG)(v)))
+#elif defined(__GNUC__)
+#define atomic_fetchadd(p, v) __sync_fetch_and_add((p), (size_t)(v))
+#define atomic_fetchor(p, v) __sync_fetch_and_or((p), (size_t)(v))
+#define atomic_swap(p, v) (__sync_synchronize(), __sync_lock_test_and_set((p), (size_t)(v)))
+#else
+#error "lua_bufflib needs atomic operations, which aren't implemented for this compiler"
+#endif
+
+#define atomic_load(p) atomic_fetchadd((p), 0)
+
+/*
+	Worker pool.
+	Large in-place transforms and scans split the Buffer's contents into chunks and process them on worker threads, while the calling thread
+	also takes chunks and waits for the rest, so the Lua API stays synchronous. Tasks are plain C functions that never call into a Lua state.
+	The pool belongs to the process, so it's shared by every Lua state that loads the module; a task started while another is running runs
+	on the calling thread alone instead of waiting. There are no workers until bufflib.setthreads is called.
+*/
+
+/* Processes chunk k of a task */
+typedef void (*TaskFunc)(void *ctx, size_t k);
+
+/* The most threads (including the calling thread) a task can run on and the most chunks it's split into */
+#define POOL_MAXTHREADS 64
+#define POOL_MAXCHUNKS 256
+
+/* The default for the smallest contents that are split into chunks */
+#define POOL_MINSIZE (1024 * 1024)
+
+static struct {
+	Mutex lock; /* protects everything below except threads */
+	Mutex resizelock; /* held while starting or stopping workers, protects threads */
+	Cond wake; /* signalled when there's a new task or workers should exit */
+	Cond done; /* signalled when the last chunk of a task is finished */
+	size_t minsize; /* the smallest contents that are split into chunks */
+	int target; /* number of workers that should be running, workers with an index >= this exit */
+	size_t states; /* number of Lua states that have loaded the module, the workers are stopped when this reaches 0 */
+	TaskFunc func; /* the running task or NULL */
+	void *ctx;
+	size_t nchunks, next, remaining; /* chunks in the task, the next chunk to take and the chunks not finished yet */
+	Thread threads[POOL_MAXTHREADS - 1];
+} pool = {MUTEX_INITIALIZER, MUTEX_INITIALIZER, COND_INITIALIZER, COND_INITIALIZER, POOL_MINSIZE, 0, 0, NULL, NULL, 0, 0, 0, {0}};
+
+/* Takes and processes chunks of the running task until there are none left. The pool must be locked. */
+static void poolwork(void) {
+	while (pool.func != NULL && pool.next < pool.nchunks) {
+		TaskFunc func = pool.func;
+		void *ctx = pool.ctx;
+		size_t k = pool.next++;
+		mutex_unlock(&pool.lock);
+		func(ctx, k);
+		mutex_lock(&pool.lock);
+		if (--pool.remaining == 0)
+			cond_broadcast(&pool.done);
+	}
+}
+
+static THREADPROC(poolworker, arg) {
+	int index = (int)(size_t)arg;
+	mutex_lock(&pool.lock);
+	while (index < pool.target) {
+		poolwork();
+		if (index < pool.target)
+			cond_wait(&pool.wake, &pool.lock);
+	}
+	mutex_unlock(&pool.lock);
+	return 0;
+}
+
+/* Sets the number of workers, starting or stopping (and joining) them. Returns the number actually running, which is less than n if a thread couldn't be started. */
+static int poolresize(int n) {
+	int i, old;
+	mutex_lock(&pool.resizelock);
+	mutex_lock(&pool.lock);
+	old = pool.target;
+	for (i = old; i < n; i++) {
+		pool.target = i + 1; /* Set first so the new worker doesn't exit straight away */
+		if (!thread_start(&pool.threads[i], poolworker, (void *)(size_t)i)) {
+			pool.target = i;
+			break;
+		}
+	}
+	if (n < old) {
+		pool.target = n;
+		cond_broadcast(&pool.wake);
+	}
+	n = pool.target;
+	mutex_unlock(&pool.lock);
+	for (i = n; i < old; i++) /* These exit once they've finished any chunks they've taken */
+		thread_join(pool.threads[i]);
+	mutex_unlock(&pool.resizelock);
+	return n;
+}
+
+/*
+	Returns the number of chunks to split len bytes into for runparallel (1 if they should be processed on the calling thread) and stores the size
+	of each chunk (except the last, which may be shorter) in chunksize.
+*/
+static size_t poolchunks(size_t len, size_t *chunksize) {
+	size_t nchunks = 1;
+	mutex_lock(&pool.lock);
+	if (pool.target > 0 && len >= pool.minsize && pool.func == NULL) {
+		nchunks = (size_t)(pool.target + 1) * 4; /* A few chunks per thread to even out their speeds */
+		if (nchunks > POOL_MAXCHUNKS)
+			nchunks = POOL_MAXCHUNKS;
+	}
+	mutex_unlock(&pool.lock);
+	*chunksize = (len + nchunks - 1) / nchunks;
+	if (nchunks > 1) /* Keep chunks that are written to in separate cache lines */
+		*chunksize = (*chunksize + 63) & ~(size_t)63;
+	if (*chunksize == 0)
+		*chunksize = 1;
+	return (len + *chunksize - 1) / *chunksize;
+}
+
+/* Returns the length of chunk k of len bytes split into chunks of chunksize bytes */
+#define chunklen(len, chunksize, k) ((len) - (k) * (chunksize) < (chunksize) ? (len) - (k) * (chunksize) : (chunksize))
+
+/* Runs func on chunks 0 to nchunks - 1, on the pool's workers and the calling thread, and returns once they're all finished */
+static void runparallel(TaskFunc func, void *ctx, size_t nchunks) {
+	size_t k;
+	if (nchunks > 1) {
+		mutex_lock(&pool.lock);
+		if (pool.func == NULL && pool.target > 0) {
+			pool.func = func;
+			pool.ctx = ctx;
+			pool.nchunks = pool.remaining = nchunks;
+			pool.next = 0;
+			cond_broadcast(&pool.wake);
+			poolwork();
+			while (pool.remaining > 0)
+				cond_wait(&pool.done, &pool.lock);
+			pool.func = NULL;
+			mutex_unlock(&pool.lock);
+			return;
+		}
+		mutex_unlock(&pool.lock); /* Another task is running, do this one here */
+	}
+	for (k = 0; k < nchunks; k++)
+		func(ctx, k);
+}
+
 /* The registry key used to store the Buffer metatable */
 #define BUFFERTYPE "bufflib_buffer"
 
+/* The registry key used to store the Shared metatable */
+#define SHAREDTYPE "bufflib_shared"
+
+/* The registry key used to store the Log metatable */
+#define LOGTYPE "bufflib_log"
+
+/* The registry key used to store the Matcher metatable */
+#define MATCHERTYPE "bufflib_matcher"
+
+/* The registry key used to store the Template metatable */
+#define TEMPLATETYPE "bufflib_template"
+
+/* The registry key used to store the BitWriter metatable */
+#define BITWRITERTYPE "bufflib_bitwriter"
+
+/* The registry key used to store the state's Budget */
+#define BUDGETKEY "bufflib_budget"
+
+/* The registry key used to store the userdata that stops the worker pool when the last state using it is closed */
+#define POOLKEY "bufflib_pool"
+
 /* The prefix used to access string library methods on Buffers */
 #define STRINGPREFIX "s_"
 #define STRINGPREFIXLEN 2
@@ -79,6 +336,7 @@ Buffers define metamethods for equality (==), length (#), concatenation (..) and
 
 #define luaL_setfuncs(L, l, n) luaL_register(L, NULL, (l))
 #define luaL_newlib(L, l) luaL_register(L, LIBNAME, (l))
+#define lua_rawlen(L, i) lua_objlen(L, (i))
 
 static void luaL_setmetatable (lua_State *L, const char *tname) {
   luaL_getmetatable(L, tname);
@@ -123,61 +381,445 @@ static const char *luaL_tolstring (lua_State *L, int idx, size_t *len) {
 
 #endif
 
+/*
+	Compatibility with 5.4.
+	Buffers don't use any user values, so don't allocate one for them.
+*/
+#if LUA_VERSION_NUM >= 504
+#define newudata(L, sz) lua_newuserdatauv(L, (sz), 0)
+#else
+#define newudata(L, sz) lua_newuserdata(L, (sz))
+#endif
+
+/*
+	Userdata with a single user value, which must be a table (as required by 5.1's environments).
+*/
+#if LUA_VERSION_NUM >= 504
+#define newudatauv(L, sz, n) lua_newuserdatauv(L, (sz), (n))
+#define setuservalue(L, i) lua_setiuservalue(L, (i), 1)
+#define getuservalue(L, i) lua_getiuservalue(L, (i), 1)
+#elif LUA_VERSION_NUM >= 502
+#define newudatauv(L, sz, n) lua_newuserdata(L, (sz))
+#define setuservalue(L, i) lua_setuservalue(L, (i))
+#define getuservalue(L, i) lua_getuservalue(L, (i))
+#else
+#define newudatauv(L, sz, n) lua_newuserdata(L, (sz))
+#define setuservalue(L, i) lua_setfenv(L, (i))
+#define getuservalue(L, i) lua_getfenv(L, (i))
+#endif
+
+/*
+	Pushes t[i] without invoking metamethods, for any integer i.
+	lua_rawgeti only takes an int before 5.3, so larger indices go through lua_rawget.
+*/
+#if LUA_VERSION_NUM >= 503
+#define rawgetinteger(L, t, i) lua_rawgeti(L, (t), (lua_Integer)(i))
+#else
+static void rawgetinteger(lua_State *L, int t, lua_Integer i) {
+	if (i >= INT_MIN && i <= INT_MAX) {
+		lua_rawgeti(L, t, (int)i);
+	} else {
+		if (t < 0 && t > LUA_REGISTRYINDEX) /* Convert a relative index before pushing the key */
+			t = lua_gettop(L) + t + 1;
+		lua_pushinteger(L, i);
+		lua_rawget(L, t);
+	}
+}
+#endif
+
+/*
+	Pushes an integer converted to a string and returns the string, for error messages: luaL_error's %d only takes an int,
+	and LUA_INTEGER_FMT doesn't exist before 5.3.
+*/
+static const char *pushintstring(lua_State *L, lua_Integer i) {
+	lua_pushinteger(L, i);
+	return lua_tostring(L, -1);
+}
+
 /**
 A class representing a string buffer.
 @type Buffer
 */
 typedef struct Buffer {
-	int ref; /* position of the buffer's userdata in the registry */
+	/* b, size and n must remain the first members of this struct, bufflib/ffi.lua declares them as a stable prefix */
 	char *b;  /* buffer address */
 	size_t size;  /* buffer size */
 	size_t n;  /* number of characters in buffer */
 	lua_State *L;
+	lua_Alloc allocf; /* allocator used for the buffer's contents once they outgrow initb */
+	void *allocud; /* opaque pointer passed to allocf */
+	int store; /* where the contents are stored once they outgrow initb (STORE_*) */
+	int fd; /* file descriptor of a mapped Buffer's file */
+	int flags; /* BUFFER_* option flags */
+	size_t gap; /* start of the gap in a gap Buffer, only valid while BUFFER_GAPOPEN is set */
+	size_t version; /* incremented by every change to the contents, so cached information about them can be invalidated */
+	struct Utf8Index *utf8; /* cached UTF-8 index (see getutf8index), allocated with allocf */
+	struct SharedBlock *block; /* the reference count of b while it's shared with clones (see bufflib_clone), otherwise NULL */
+	size_t initsize; /* length of initb, which may be shorter than declared (see the inline option of bufflib.new) */
+	size_t maxsize; /* the most the char array may grow to (see the maxsize option of bufflib.new) */
+	struct Budget *budget; /* the state's memory accounting, see Budget */
 	char initb[LUAL_BUFFERSIZE];  /* initial buffer */
 } Buffer;
 
+/* The size of a Buffer userdata with initsize bytes of initb */
+#define buffudatasize(initsize) (offsetof(Buffer, initb) + (initsize))
+
+/* The number of codepoints between each offset recorded in a Utf8Index */
+#define UTF8STRIDE 64
+
+/* Information about a Buffer's contents as UTF-8, valid while version and n match the Buffer's */
+typedef struct Utf8Index {
+	size_t version; /* the Buffer's version when the index was built */
+	size_t n; /* the Buffer's length when the index was built */
+	int valid; /* are the contents valid UTF-8? */
+	size_t len; /* the number of codepoints if valid, otherwise the position of the first invalid sequence */
+	size_t size; /* the number of elements allocated for offsets */
+	size_t offsets[1]; /* offsets[k] is the byte offset of codepoint k * UTF8STRIDE */
+} Utf8Index;
+
+#define utf8indexsize(n) (sizeof(Utf8Index) + ((n) - 1) * sizeof(size_t))
+
+/*
+	The allocated storage of all of a state's Buffers (not including initb or mapped files, but including their UTF-8 indexes) and the limit set by bufflib.setlimit.
+	There's one per state, in the registry. It doesn't have a __gc metamethod, so it outlives every Buffer when the state is closed.
+*/
+typedef struct Budget {
+	size_t used; /* bytes allocated */
+	size_t limit; /* the most that may be allocated, 0 for no limit */
+} Budget;
+
+/*
+	Accounts for a Buffer's allocated storage changing from oldsize to newsize bytes.
+	Returns 0 if growing it would exceed the limit, in which case nothing is changed.
+*/
+static int budgetresize(Budget *budget, size_t oldsize, size_t newsize) {
+	if (newsize > oldsize) {
+		size_t grow = newsize - oldsize;
+		if (budget->limit != 0 && (budget->used + grow < budget->used || budget->used + grow > budget->limit))
+			return 0;
+		budget->used += grow;
+	} else {
+		budget->used -= oldsize - newsize;
+	}
+	return 1;
+}
+
+/* Returns the state's Budget, creating it the first time it's needed */
+static Budget *getbudget(lua_State *L) {
+	Budget *budget;
+	lua_getfield(L, LUA_REGISTRYINDEX, BUDGETKEY);
+	budget = (Budget *)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	if (budget == NULL) {
+		budget = (Budget *)newudata(L, sizeof(Budget));
+		budget->used = 0;
+		budget->limit = 0;
+		lua_setfield(L, LUA_REGISTRYINDEX, BUDGETKEY);
+	}
+	return budget;
+}
+
+/*
+	A block of contents shared by a Buffer and its clones, allocated with their allocf.
+	While a Buffer shares its block, its size is set to n so that it has no free space: anything that adds to it has to call growbuffer,
+	which gives it its own copy first. Everything that changes the contents in place calls ownbuffer.
+*/
+typedef struct SharedBlock {
+	size_t refs; /* number of Buffers sharing the block */
+	size_t size; /* the block's real size */
+} SharedBlock;
+
+/* Kinds of storage used by Buffers */
+#define STORE_ALLOC 0 /* initb, then a block from allocf */
+#define STORE_MAPPED 1 /* a memory mapped file (see bufflib.mapped), initb is only used while the file is empty */
+
+/* Option flags set by the options table passed to bufflib.new */
+#define BUFFER_INPLACE 1 /* buff1 .. buff2 appends buff2 to buff1 instead of creating a new Buffer */
+#define BUFFER_GAP 2 /* insert and remove move a gap instead of the contents after the edit (mode = "gap") */
+#define BUFFER_GAPOPEN 4 /* the free space of a gap Buffer is at gap instead of after the contents (see movegap) */
+
 /* Add s to the Buffer's character count */
-#define addsize(B,s)       ((B)->n += (s))
+#define addsize(B,s)       ((B)->n += (s), (B)->version++)
+
+/* Frees the Buffer's UTF-8 index, if it has one */
+static void freeutf8index(Buffer *B) {
+	if (B->utf8 != NULL) {
+		budgetresize(B->budget, utf8indexsize(B->utf8->size), 0);
+		B->allocf(B->allocud, B->utf8, utf8indexsize(B->utf8->size), 0);
+		B->utf8 = NULL;
+	}
+}
+
+/*
+	Calculates the new size of a char array of the given size holding n characters that needs room for sz more.
+	Returns 0 if the new size would overflow a size_t.
+*/
+static size_t nextbuffsize (size_t size, size_t n, size_t sz) {
+	size_t newsize = size * 2;  /* double buffer size */
+	if (newsize - n < sz)  /* not big enough? */
+		newsize = n + sz;
+	if (newsize < n || newsize - n < sz)
+		return 0;
+	return newsize;
+}
+
+#ifdef MAPPED_SUPPORTED
+/*
+	Resizes a mapped Buffer's file and mapping to newsize bytes. The contents are never copied, since they live in the file.
+	A size of 0 unmaps the file and points the Buffer at initb.
+	Returns NULL on success or an error message on failure, leaving the Buffer unchanged.
+*/
+static const char *remapbuffer (Buffer *B, size_t newsize) {
+	char *newb;
+	if (newsize == 0) {
+		if (B->size > 0)
+			munmap(B->b, B->size);
+		B->b = B->initb;
+		B->size = 0;
+		return ftruncate(B->fd, 0) == 0 ? NULL : strerror(errno);
+	}
+	if (ftruncate(B->fd, (off_t)newsize) != 0)
+		return strerror(errno);
+	if (B->size == 0) {
+		newb = (char *)mmap(NULL, newsize, PROT_READ | PROT_WRITE, MAP_SHARED, B->fd, 0);
+	} else {
+#ifdef MREMAP_MAYMOVE
+		newb = (char *)mremap(B->b, B->size, newsize, MREMAP_MAYMOVE);
+#else
+		munmap(B->b, B->size);
+		newb = (char *)mmap(NULL, newsize, PROT_READ | PROT_WRITE, MAP_SHARED, B->fd, 0);
+		if (newb == (char *)MAP_FAILED) /* Try to restore the old mapping */
+			B->b = (char *)mmap(NULL, B->size, PROT_READ | PROT_WRITE, MAP_SHARED, B->fd, 0);
+#endif
+	}
+	if (newb == (char *)MAP_FAILED) {
+		int err = errno;
+		ftruncate(B->fd, (off_t)B->size);
+		return strerror(err);
+	}
+	B->b = newb;
+	B->size = newsize;
+	return NULL;
+}
+
+/* Grows a mapped Buffer's file to make room for sz more characters, in whole pages */
+static const char *growmapped (Buffer *B, size_t sz) {
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t newsize = nextbuffsize(B->size < LUAL_BUFFERSIZE ? LUAL_BUFFERSIZE : B->size, B->n, sz);
+	if (newsize == 0 || newsize + page < newsize)
+		return "buffer too large";
+	return remapbuffer(B, (newsize + page - 1) / page * page);
+}
+
+/* Writes a mapped Buffer's contents to disk and truncates the file to their length */
+static const char *flushmapped (Buffer *B) {
+	const char *err = remapbuffer(B, B->n);
+	if (err == NULL && B->n > 0 && msync(B->b, B->n, MS_SYNC) != 0)
+		err = strerror(errno);
+	if (err == NULL && fsync(B->fd) != 0)
+		err = strerror(errno);
+	return err;
+}
+#endif
+
+/*
+	Stops the Buffer sharing its contents with its clones, copying them to a new block with room for at least sz more characters
+	(unless it's the last Buffer sharing them, which takes the block back).
+	Returns NULL on success or an error message on failure, leaving the Buffer unchanged.
+	This never calls into the Lua state, so it can be used from FFI calls.
+*/
+static const char *unsharebuffer (Buffer *B, size_t sz) {
+	SharedBlock *block = B->block;
+	char *newbuff;
+	size_t newsize;
+	if (block == NULL)
+		return NULL;
+	if (block->refs == 1) {
+		B->size = block->size;
+		B->allocf(B->allocud, block, sizeof(SharedBlock), 0);
+		B->block = NULL;
+		return NULL;
+	}
+	newsize = block->size;
+	if (newsize - B->n < sz && (newsize = nextbuffsize(newsize, B->n, sz)) == 0)
+		return "buffer too large";
+	if (newsize > B->maxsize) {
+		if (B->maxsize - B->n < sz)
+			return "buffer size limit exceeded";
+		newsize = B->maxsize;
+	}
+	if (!budgetresize(B->budget, 0, newsize))
+		return "memory limit exceeded";
+	newbuff = (char *)B->allocf(B->allocud, NULL, 0, newsize * sizeof(char));
+	if (newbuff == NULL) {
+		budgetresize(B->budget, newsize, 0);
+		return "not enough memory";
+	}
+	memcpy(newbuff, B->b, B->n * sizeof(char));
+	block->refs--;
+	B->b = newbuff;
+	B->size = newsize;
+	B->block = NULL;
+	return NULL;
+}
+
+/* Makes sure the Buffer's contents aren't shared with a clone before they're changed in place, raising an error if they can't be copied */
+static void ownbuffer (Buffer *B) {
+	const char *err = unsharebuffer(B, 0);
+	if (err != NULL)
+		luaL_error(B->L, "%s", err);
+}
 
-/* If the Buffer is storing its contents as a userdata in the registry, unreference it and allow it to be collected */
-#define buff_unref(L, B) if ((B)->ref != LUA_NOREF) luaL_unref(L, LUA_REGISTRYINDEX, (B)->ref)
+/*
+	Makes room in the Buffer for at least sz more characters.
+	If there isn't enough space in the current char array, (re)allocates a larger one with the Buffer's allocator (or grows the file of a mapped Buffer).
+	Returns NULL on success or an error message on failure, leaving the Buffer unchanged.
+	This never calls into the Lua state, so it can be used from FFI calls.
+*/
+static const char *growbuffer (Buffer *B, size_t sz) {
+	char *newbuff;
+	size_t newsize, oldsize;
+#ifdef MAPPED_SUPPORTED
+	if (B->store == STORE_MAPPED)
+		return growmapped(B, sz);
+#endif
+	if (B->block != NULL) {
+		const char *err = unsharebuffer(B, sz);
+		if (err != NULL || B->size - B->n >= sz)
+			return err;
+	}
+	newsize = nextbuffsize(B->size, B->n, sz);
+	if (newsize == 0)
+		return "buffer too large";
+	if (newsize > B->maxsize) { /* Grow to the limit if that's enough */
+		if (B->maxsize - B->n < sz)
+			return "buffer size limit exceeded";
+		newsize = B->maxsize;
+	}
+	oldsize = B->b == B->initb ? 0 : B->size;
+	if (!budgetresize(B->budget, oldsize, newsize))
+		return "memory limit exceeded";
+	if (B->b == B->initb) { /* move content out of the initial buffer */
+		newbuff = (char *)B->allocf(B->allocud, NULL, 0, newsize * sizeof(char));
+		if (newbuff != NULL)
+			memcpy(newbuff, B->b, B->n * sizeof(char));
+	} else {
+		newbuff = (char *)B->allocf(B->allocud, B->b, B->size * sizeof(char), newsize * sizeof(char));
+	}
+	if (newbuff == NULL) {
+		budgetresize(B->budget, newsize, oldsize);
+		return "not enough memory";
+	}
+	B->b = newbuff;
+	B->size = newsize;
+	return NULL;
+}
 
 /*
 	Prepares the Buffer for a string of length sz to be added and returns a pointer that the string can be copied into with memcpy().
-	If there isn't enough space in the current char array, creates a new one as a userdata and stores it in the registry.
-	Releases the previously stored userdata (if any), allowing it be garbage collected.
+	Raises an error if the Buffer can't be grown.
 */
 static char *prepbuffsize (Buffer *B, size_t sz) {
-	lua_State *L = B->L;
 	if (B->size - B->n < sz) {  /* not enough space? */
-		char *newbuff;
-		size_t newsize = B->size * 2;  /* double buffer size */
-		if (newsize - B->n < sz)  /* not big enough? */
-			newsize = B->n + sz;
-		if (newsize < B->n || newsize - B->n < sz)
-			luaL_error(L, "buffer too large");
-		/* create larger buffer */
-		newbuff = (char *)lua_newuserdata(L, newsize * sizeof(char));
-		/* move content to new buffer */
-		memcpy(newbuff, B->b, B->n * sizeof(char));
-		buff_unref(L, B);  /* remove old buffer */
-		B->ref = luaL_ref(L, LUA_REGISTRYINDEX);
-		B->b = newbuff;
-		B->size = newsize;
+		const char *err = growbuffer(B, sz);
+		if (err != NULL)
+			luaL_error(B->L, "%s", err);
 	}
 	return &B->b[B->n];
 }
 
+/*
+	Gap Buffers.
+	A gap Buffer's free space (size - n bytes) can be moved into the middle of its contents, so a series of edits close to each other only move the bytes between them.
+	While the gap is open, the contents are split: b[0, gap) holds the first part and the rest is at the end of the char array.
+	Everything except the functions that understand the gap (see getrawbuffer) closes the gap first, so they see contiguous contents.
+*/
+
+/* Moves the gap of a gap Buffer back to the end of its contents. This never calls into the Lua state, so it can be used from FFI calls. */
+static void closegap(Buffer *B) {
+	if (B->flags & BUFFER_GAPOPEN) {
+		size_t gaplen = B->size - B->n;
+		memmove(B->b + B->gap, B->b + B->gap + gaplen, (B->n - B->gap) * sizeof(char));
+		B->flags &= ~BUFFER_GAPOPEN;
+	}
+}
+
+/* Opens the gap of a gap Buffer at (0-based) offset pos of its contents, moving the contents between the old and new positions */
+static void movegap(Buffer *B, size_t pos) {
+	size_t gaplen = B->size - B->n;
+	if (!(B->flags & BUFFER_GAPOPEN)) {
+		B->gap = B->n;
+		B->flags |= BUFFER_GAPOPEN;
+	}
+	if (pos < B->gap)
+		memmove(B->b + pos + gaplen, B->b + pos, (B->gap - pos) * sizeof(char));
+	else if (pos > B->gap)
+		memmove(B->b + B->gap, B->b + B->gap + gaplen, (pos - B->gap) * sizeof(char));
+	B->gap = pos;
+}
+
+/* The byte at (0-based) offset i of the Buffer's contents, taking the gap into account */
+#define byteat(B, i) (*((B)->flags & BUFFER_GAPOPEN && (i) >= (B)->gap ? &(B)->b[(i) + (B)->size - (B)->n] : &(B)->b[i]))
+
 /*
 	Initialise a Buffer for use with the given lua_State.
-	The Buffer must only be used with the lua_State it was initialised with.
+	The Buffer can be used from any thread (coroutine) of that state, but B->L must be updated to the running thread before each use (getbuffer does this).
 */
-static void buffinit(lua_State *L, Buffer *B) {
+static void buffinit(lua_State *L, Buffer *B, size_t initsize) {
 	B->L = L;
 	B->b = B->initb;
 	B->n = 0;
-	B->size = LUAL_BUFFERSIZE;
-	B->ref = LUA_NOREF;
+	B->size = initsize;
+	B->initsize = initsize;
+	B->maxsize = (size_t)-1;
+	B->budget = getbudget(L);
+	B->allocf = lua_getallocf(L, &B->allocud);
+	B->store = STORE_ALLOC;
+	B->fd = -1;
+	B->flags = 0;
+	B->gap = 0;
+	B->version = 0;
+	B->utf8 = NULL;
+	B->block = NULL;
+}
+
+/*
+	Releases the Buffer's storage, leaving it empty and using initb.
+	A mapped Buffer's contents are written to its file, which is then closed and the Buffer goes back to using allocated storage.
+	Returns NULL on success or an error message if the mapped file couldn't be written (the storage is still released).
+	This may be called on a Buffer that has already been released.
+*/
+static const char *freebuffer(Buffer *B) {
+	const char *err = NULL;
+#ifdef MAPPED_SUPPORTED
+	if (B->store == STORE_MAPPED) {
+		err = flushmapped(B);
+		if (B->size > 0)
+			munmap(B->b, B->size);
+		if (close(B->fd) != 0 && err == NULL)
+			err = strerror(errno);
+		B->store = STORE_ALLOC;
+		B->fd = -1;
+	} else
+#endif
+	if (B->block != NULL) { /* Only free the contents once the last Buffer sharing them lets go */
+		if (--B->block->refs == 0) {
+			budgetresize(B->budget, B->block->size, 0);
+			B->allocf(B->allocud, B->b, B->block->size, 0);
+			B->allocf(B->allocud, B->block, sizeof(SharedBlock), 0);
+		}
+		B->block = NULL;
+	} else if (B->b != B->initb) {
+		budgetresize(B->budget, B->size, 0);
+		B->allocf(B->allocud, B->b, B->size, 0);
+	}
+	freeutf8index(B);
+	B->flags &= ~BUFFER_GAPOPEN;
+	B->b = B->initb;
+	B->size = B->initsize;
+	B->n = 0;
+	B->version++;
+	return err;
 }
 
 /*
@@ -185,14 +827,97 @@ static void buffinit(lua_State *L, Buffer *B) {
 	The new Buffer will be left on the top of the stack.
 */
 static Buffer *newbuffer(lua_State *L) {
-	Buffer *B = (Buffer *)lua_newuserdata(L, sizeof(Buffer));
+	Buffer *B = (Buffer *)newudata(L, sizeof(Buffer));
 	luaL_setmetatable(L, BUFFERTYPE);
-	buffinit(L, B);
+	buffinit(L, B, LUAL_BUFFERSIZE);
+	return B;
+}
+
+/* Creates a new Buffer like newbuffer, but with only initsize (at most LUAL_BUFFERSIZE) bytes of initb */
+static Buffer *newcompactbuffer(lua_State *L, size_t initsize) {
+	Buffer *B = (Buffer *)newudata(L, buffudatasize(initsize));
+	luaL_setmetatable(L, BUFFERTYPE);
+	buffinit(L, B, initsize);
+	return B;
+}
+
+/*
+	Functions exported to bufflib/ffi.lua (the LuaJIT FFI backend) through the FFIAPI lightuserdata in the library table,
+	and to other C modules through the same table in the registry (see bufflib.h, which declares FFIApi as bufflib_Api).
+	None of these call into the Lua state, so they're safe to call from FFI code (including JIT-compiled traces).
+	The layout of FFIApi is part of the FFI ABI and the C API: new members must only be appended and version incremented.
+*/
+#define FFIAPI "_ffiapi"
+#define FFIAPI_VERSION BUFFLIB_API_VERSION
+
+typedef bufflib_Api FFIApi;
+
+/* Returns a pointer to at least sz bytes of free space at the end of the Buffer, or NULL if it can't be grown */
+static char *ffi_reserve(Buffer *B, size_t sz) {
+	if (B->size - B->n < sz && growbuffer(B, sz) != NULL)
+		return NULL;
+	return &B->b[B->n];
+}
+
+/* Adds sz bytes written to the space returned by ffi_reserve to the Buffer's contents */
+static void ffi_commit(Buffer *B, size_t sz) {
+	addsize(B, sz);
+}
+
+/* Appends len bytes from s to the Buffer. Returns 1 on success, 0 if the Buffer can't be grown. */
+static int ffi_append(Buffer *B, const char *s, size_t len) {
+	char *b = ffi_reserve(B, len);
+	if (b == NULL)
+		return 0;
+	memcpy(b, s, len * sizeof(char));
+	addsize(B, len);
+	return 1;
+}
+
+/* Returns a pointer to the Buffer's contents and stores their length in len. The pointer is only valid until the Buffer is next modified. */
+static const char *ffi_data(Buffer *B, size_t *len) {
+	*len = B->n;
+	return B->b;
+}
+
+/*
+	Returns a pointer to the Buffer at index i, raising an error if the value isn't a Buffer.
+	The Buffer may have been created by a different thread, so it's updated to use the calling thread.
+*/
+static Buffer *getbuffer(lua_State *L, int i) {
+	Buffer *B = (Buffer *)luaL_checkudata(L, i, BUFFERTYPE);
+	B->L = L;
+	closegap(B);
+	return B;
+}
+
+/* Like getbuffer, but leaves the gap of a gap Buffer open. Only for functions that take the gap into account. */
+static Buffer *getrawbuffer(lua_State *L, int i) {
+	Buffer *B = (Buffer *)luaL_checkudata(L, i, BUFFERTYPE);
+	B->L = L;
+	return B;
+}
+
+/* Returns a pointer to the Buffer at index i (prepared like getbuffer does) or NULL if the value isn't a Buffer */
+static Buffer *testbuffer(lua_State *L, int i) {
+	Buffer *B = (Buffer *)luaL_testudata(L, i, BUFFERTYPE);
+	if (B != NULL) {
+		B->L = L;
+		closegap(B);
+	}
 	return B;
 }
 
-/* Returns a pointer to the Buffer at index i */
-#define getbuffer(L, i) ((Buffer *)luaL_checkudata(L, i, BUFFERTYPE))
+static const FFIApi ffiapi = {
+	FFIAPI_VERSION,
+	ffi_reserve,
+	ffi_commit,
+	ffi_append,
+	ffi_data,
+	closegap,
+	getbuffer, /* These two are only for the C API, since they call into the Lua state */
+	testbuffer
+};
 
 /* Is the value at index i a Buffer? */
 #define isbuffer(L, i) (luaL_testudata(L, i, BUFFERTYPE) != NULL)
@@ -200,22 +925,45 @@ static Buffer *newbuffer(lua_State *L) {
 /* Call luaL_toslstring and pop the string from the stack */
 #define tolstring(L, i, l) luaL_tolstring(L, i, l); lua_pop(L, 1)
 
-/* Add string arguments to the buffer, starting from firstarg and ending at (numargs-offset). */
-static void addstrings(Buffer *B, int firstarg, int offset) {
-	lua_State *L = B->L;
-	int numargs = lua_gettop(L) - offset;
+/*
+	Add len characters starting at position start of the src Buffer to the dest Buffer.
+	src may be the same Buffer as dest.
+*/
+static void addbufferrange(Buffer *dest, Buffer *src, size_t start, size_t len) {
+	char *b = prepbuffsize(dest, len); /* Growing dest may move src's contents if they're the same Buffer, so only take src->b after this */
+	memmove(b, src->b + start, len * sizeof(char));
+	addsize(dest, len);
+}
 
-	size_t len;
+/*
+	Add the value at index i to the Buffer.
+	Buffers are copied directly, anything else is converted to a string following the same rules as the `tostring()` function.
+*/
+static void addvalue(Buffer *B, int i) {
+	lua_State *L = B->L;
+	Buffer *src = testbuffer(L, i);
+	size_t len = -1;
 	const char *str;
 	char *b;
 
+	if (src != NULL) {
+		addbufferrange(B, src, 0, src->n);
+		return;
+	}
+
+	str = tolstring(L, i, &len);
+	b = prepbuffsize(B, len);
+	memcpy(b, str, len * sizeof(char));
+	addsize(B, len);
+}
+
+/* Add string arguments to the buffer, starting from firstarg and ending at (numargs-offset). */
+static void addstrings(Buffer *B, int firstarg, int offset) {
+	int numargs = lua_gettop(B->L) - offset;
+
 	int i;
 	for (i = firstarg; i <= numargs; i++) {
-		len = -1;
-		str = tolstring(L, i, &len);
-		b = prepbuffsize(B, len);
-		memcpy(b, str, len * sizeof(char));
-		addsize(B, len);
+		addvalue(B, i);
 	}
 }
 
@@ -229,9 +977,6 @@ static void addsepstrings(Buffer *B) {
 
 	size_t seplen = -1;
 	const char *sep;
-
-	size_t len = -1;
-	const char *str;
 	char *b;
 
 	int i;
@@ -239,23 +984,37 @@ static void addsepstrings(Buffer *B) {
 	sep = tolstring(L, 2, &seplen); /* Get the separator string */
 
 	for (i = 3; i < numargs; i++) { /* For arguments 3 to (numargs-1), add the string argument followed by the separator */
-		len = -1;
-		str = tolstring(L, i, &len);
+		addvalue(B, i);
 
-		b = prepbuffsize(B, len + seplen); /* Prepare the buffer for the length of the string plus the length of the separator */
-		memcpy(b, str, len * sizeof(char));
-		addsize(B, len);
-
-		b += len; /* Get a pointer to the position after the string */
+		b = prepbuffsize(B, seplen);
 		memcpy(b, sep, seplen * sizeof(char));
 		addsize(B, seplen);
 	}
 
-	len = -1;
-	str = tolstring(L, numargs, &len); /* Add the final string */
-	b = prepbuffsize(B, len);
-	memcpy(b, str, len * sizeof(char));
-	addsize(B, len);
+	addvalue(B, numargs); /* Add the final string */
+}
+
+/*
+	Reads optional i and j arguments at indices argi and argi+1 and converts them to a range [start, end) of a string of length len,
+	following the same rules as string.sub. Returns 0 if the range is empty.
+*/
+static int rangeargs(lua_State *L, int argi, size_t len, size_t *start, size_t *end) {
+	lua_Integer i = luaL_optinteger(L, argi, 1);
+	lua_Integer j = luaL_optinteger(L, argi + 1, -1);
+	lua_Integer l = (lua_Integer)len;
+	if (i < 0)
+		i = i < -l ? 1 : l + i + 1;
+	else if (i == 0)
+		i = 1;
+	if (j < 0)
+		j = j < -l ? 0 : l + j + 1;
+	else if (j > l)
+		j = l;
+	if (i > j)
+		return 0;
+	*start = (size_t)i - 1;
+	*end = (size_t)j;
+	return 1;
 }
 
 /* Pushes the argument at index i (which should be a Buffer userdata) onto the stack to return it. */
@@ -267,6 +1026,7 @@ static int pushbuffer(lua_State *L, int i) {
 /**
 Add some strings to the @{Buffer}.
 All non-string arguments are converted to strings following the same rules as the `tostring()` function.
+Buffers are copied directly, without creating an intermediate string.
 
 @function add
 @param ... Some values to add to the Buffer.
@@ -278,6 +1038,26 @@ static int bufflib_add(lua_State *L) {
 	return pushbuffer(L, 1);
 }
 
+/**
+Add part of another @{Buffer} to this one, copying the contents directly without creating an intermediate string.
+`i` and `j` are interpreted in the same way as the arguments of `string.sub`. The Buffer can be added to itself.
+
+@function addbuffer
+@tparam Buffer other The Buffer to copy from.
+@int[opt=1] i The position of the first character to copy.
+@int[opt=-1] j The position of the last character to copy.
+@treturn Buffer The Buffer object.
+*/
+static int bufflib_addbuffer(lua_State *L) {
+	Buffer *B = getbuffer(L, 1);
+	Buffer *src = getbuffer(L, 2);
+	size_t start, end;
+	if (!rangeargs(L, 3, src->n, &start, &end))
+		return pushbuffer(L, 1);
+	addbufferrange(B, src, start, end - start);
+	return pushbuffer(L, 1);
+}
+
 /**
 Add some strings to the @{Buffer}, each separated by the specified separator string.
 All non-string arguments are converted to strings following the same rules as the `tostring()` function.
@@ -293,18 +1073,152 @@ static int bufflib_addsep(lua_State *L) {
 	return pushbuffer(L, 1);
 }
 
+/*
+	Returns a pointer to the contents of element i of the table at index t and stores their length in len, for bufflib_addtable.
+	Numbers are converted to strings, which are left on the stack until the caller pops them; *pushed is set to 1 if this happened.
+	B is the Buffer being added to, whose length before the first element was added is origlen (used when it's an element of its own table).
+*/
+static const char *gettableelement(lua_State *L, int t, lua_Integer i, Buffer *B, size_t origlen, size_t *len, int *pushed) {
+	const char *s = NULL;
+	Buffer *src;
+	*pushed = 0;
+	rawgetinteger(L, t, i);
+	if ((src = testbuffer(L, -1)) != NULL) {
+		s = src->b;
+		*len = src == B ? origlen : src->n;
+	} else if (lua_type(L, -1) == LUA_TSTRING) {
+		s = lua_tolstring(L, -1, len); /* The table holds a reference to the string */
+	} else if (lua_type(L, -1) == LUA_TNUMBER) {
+		s = lua_tolstring(L, -1, len); /* Converts the copy on the stack, not the table's value */
+		*pushed = 1;
+		return s;
+	} else {
+		const char *tname = luaL_typename(L, -1); /* Before pushing the index's string */
+		luaL_error(L, "invalid value (at index %s) in table for 'addtable' (string, number or Buffer expected, got %s)", pushintstring(L, i), tname);
+	}
+	lua_pop(L, 1);
+	return s;
+}
+
 /**
-Reset the @{Buffer} to its initial (empty) state.
-If the Buffer was storing its contents in the registry, this is removed so it can be garbage collected.
+Add the elements of an array to the @{Buffer}, like `table.concat`.
+Unlike `buff:add(unpack(t))`, this works for arrays of any size. The total length is calculated first so the Buffer only grows once.
 
-@function reset
+@function addtable
+@tab t The array. Its elements must be strings, numbers or Buffers.
+@string[opt=""] sep The string to add between each element.
+@int[opt=1] i The index of the first element to add.
+@int[opt=#t] j The index of the last element to add.
 @treturn Buffer The Buffer object.
 */
-static int bufflib_reset(lua_State *L) {
+static int bufflib_addtable(lua_State *L) {
 	Buffer *B = getbuffer(L, 1);
-	buff_unref(L, B); /* If the buffer is storing its contents in the registry, remove it (and allow it to be garbage collected) before resetting */
-	buffinit(L, B); /* Re-initialise the Buffer */
-	return pushbuffer(L, 1);
+	size_t seplen, len, total = 0, origlen = B->n;
+	const char *sep, *s;
+	lua_Integer i, j, k;
+	int pushed;
+	char *b;
+
+	luaL_checktype(L, 2, LUA_TTABLE);
+	sep = luaL_optlstring(L, 3, "", &seplen);
+	i = luaL_optinteger(L, 4, 1);
+	j = lua_isnoneornil(L, 5) ? (lua_Integer)lua_rawlen(L, 2) : luaL_checkinteger(L, 5);
+	if (i > j)
+		return pushbuffer(L, 1);
+
+	/* First pass: calculate the total length */
+	for (k = i; k <= j; k++) {
+		gettableelement(L, 2, k, B, origlen, &len, &pushed);
+		if (pushed)
+			lua_pop(L, 1);
+		if (k < j)
+			len += seplen;
+		if (total + len < total)
+			return luaL_error(L, "resulting string too large");
+		total += len;
+	}
+
+	/* Second pass: copy the elements into the space reserved for them */
+	b = prepbuffsize(B, total);
+	for (k = i; k <= j; k++) {
+		s = gettableelement(L, 2, k, B, origlen, &len, &pushed);
+		memcpy(b, s, len * sizeof(char)); /* If B is an element, it only copies the contents before b */
+		b += len;
+		if (pushed)
+			lua_pop(L, 1);
+		if (k < j) {
+			memcpy(b, sep, seplen * sizeof(char));
+			b += seplen;
+		}
+	}
+	addsize(B, total);
+
+	return pushbuffer(L, 1);
+}
+
+/*
+	Empties the Buffer, freeing its allocated block if it has one (see bufflib_reset).
+	Raises an error if a mapped Buffer's file can't be truncated.
+*/
+static void emptybuffer(Buffer *B) {
+#ifdef MAPPED_SUPPORTED
+	if (B->store == STORE_MAPPED) { /* Mapped Buffers keep their file, but truncate it */
+		const char *err = remapbuffer(B, 0);
+		if (err != NULL)
+			luaL_error(B->L, "%s", err);
+		B->n = 0;
+		B->version++;
+		return;
+	}
+#endif
+	freebuffer(B); /* If the buffer is storing its contents in an allocated block, free it */
+}
+
+/**
+Reset the @{Buffer} to its initial (empty) state.
+If the Buffer was storing its contents in an allocated block, the block is freed.
+A mapped Buffer's file is truncated to 0 bytes, but the Buffer remains mapped to it.
+
+@function reset
+@treturn Buffer The Buffer object.
+*/
+static int bufflib_reset(lua_State *L) {
+	Buffer *B = getbuffer(L, 1);
+	emptybuffer(B);
+	return pushbuffer(L, 1);
+}
+
+/**
+Converts the @{Buffer} to a string and empties it, like `tostring(buff)` followed by @{Buffer:reset|`buff:reset()`}.
+On Lua 5.5, if the contents are in an allocated block, the new string takes over the block instead of copying it
+(using `lua_pushexternalstring`), so large results don't need twice their size in memory. Otherwise the contents are copied.
+
+@function take
+@treturn string The Buffer's contents.
+*/
+static int bufflib_take(lua_State *L) {
+	Buffer *B = getbuffer(L, 1);
+#if LUA_VERSION_NUM >= 505
+	/* Make room for the terminating NUL (this also gives a clone its own copy). If the Buffer can't grow, copy the contents instead. */
+	if (B->store == STORE_ALLOC && B->b != B->initb && (B->size - B->n >= 1 || growbuffer(B, 1) == NULL)) {
+		char *b = B->b;
+		size_t n = B->n;
+		b[n] = '\0';
+		if (B->size > n + 1) /* Lua frees the string with its length + 1 as the block's size, so the block must be exactly that size */
+			b = (char *)B->allocf(B->allocud, b, B->size, n + 1);
+		if (b != NULL) {
+			budgetresize(B->budget, B->size, 0);
+			B->b = B->initb; /* The block now belongs to the string */
+			freebuffer(B);
+			lua_pushexternalstring(L, b, n, B->allocf, B->allocud);
+			return 1;
+		}
+		/* The block couldn't be shrunk, but it's unchanged, so fall back to copying it */
+	}
+#endif
+	lua_pushlstring(L, B->b, B->n);
+	emptybuffer(B);
+	return 1;
 }
 
 /**
@@ -324,133 +1238,4706 @@ static int bufflib_tostring(lua_State *L) {
 Metamethod for the `#` (length) operation.
 Returns the length of the @{Buffer}'s current contents.
 
-@function __len
-@treturn int length
+@function __len
+@treturn int length
+*/
+static int bufflib_len(lua_State *L) {
+	Buffer *B = getrawbuffer(L, 1);
+	lua_pushinteger(L, (lua_Integer)B->n);
+	return 1;
+}
+
+/**
+Metamethod for the `..` (concatenation) operation.
+If both arguments are @{Buffer|Buffers}, creates a new Buffer from their joined contents.
+If the left Buffer was created with the `inplace` option (see @{newbuffer}), the right Buffer is added to it instead and the left Buffer is returned.
+Otherwise adds a value to the Buffer, converting it to a string following the same rules as the `tostring()` function.
+
+@function __concat
+@param B A Buffer to concatenate with this one or some value to to add to it.
+@treturn Buffer Either the new Buffer created from the two Buffer arguments or the Buffer that the other argument was added to.
+*/
+static int bufflib_concat(lua_State *L) {
+	int arg1IsBuffer = isbuffer(L, 1);
+	int arg2IsBuffer = isbuffer(L, 2);
+
+	if (arg1IsBuffer && arg2IsBuffer) { /* If both arguments are Buffers, combine them */
+		Buffer *buff1 = getbuffer(L, 1);
+		Buffer *buff2 = getbuffer(L, 2);
+		Buffer *destbuff;
+
+		if (buff1->flags & BUFFER_INPLACE) { /* Extend the left Buffer */
+			addbufferrange(buff1, buff2, 0, buff2->n);
+			return pushbuffer(L, 1);
+		}
+
+		destbuff = newbuffer(L);
+		prepbuffsize(destbuff, buff1->n + buff2->n); /* Prepare the Buffer for the combined length of the contents */
+		addbufferrange(destbuff, buff1, 0, buff1->n);
+		addbufferrange(destbuff, buff2, 0, buff2->n);
+
+		return 1; /* The new Buffer is already on the stack */
+	} else { /* If only one argument is a Buffer, add the non-Buffer argument to it */
+		size_t len = -1;
+		const char *str;
+		char *b;
+		int buffindex;
+		Buffer *destbuff;
+
+		if (arg1IsBuffer) {
+			destbuff = getbuffer(L, 1);
+			str = tolstring(L, 2, &len);
+			buffindex = 1;
+		} else {
+			destbuff = getbuffer(L, 2);
+			str = tolstring(L, 1, &len);
+			buffindex = 2;
+		}
+
+		b = prepbuffsize(destbuff, len);
+		memcpy(b, str, len);
+		addsize(destbuff, len);
+
+		return pushbuffer(L, buffindex);
+	}
+}
+
+/**
+Metamethod for the `==` (equality) operation.
+Returns true if the @{Buffer|Buffers} hold the same contents, false if they don't.
+The contents of each Buffer are converted to Lua strings and then the two strings are compared to obtain the result.
+
+@function __eq
+@tparam Buffer buff2 The Buffer to compare with this one.
+@treturn bool equal Do the Buffers hold the same contents?
+*/
+static int bufflib_equal(lua_State *L){
+	Buffer *buff1 = getbuffer(L, 1);
+	Buffer *buff2 = getbuffer(L, 2);
+
+	lua_pushlstring(L, buff1->b, buff1->n); /* Push the contents of each Buffer onto the stack */
+	lua_pushlstring(L, buff2->b, buff2->n);
+
+	lua_pushboolean(L, lua_rawequal(L, -1, -2)); /* Return the result of a lua_rawequal comparison of the strings */
+	return 1;
+}
+
+/**
+Metamethod for to-be-closed variables (Lua 5.4 and later).
+Releases the @{Buffer}'s storage as soon as the variable goes out of scope instead of waiting for the garbage collector.
+The Buffer is left empty and can still be used afterwards. This is the same as calling @{Buffer:close|`buff:close()`}, but raises an error if a mapped Buffer's file can't be written.
+
+	do
+		local buff <close> = bufflib.new()
+		-- ...
+	end -- buff's storage is freed here
+
+@function __close
+*/
+static int bufflib_close(lua_State *L){
+	Buffer *B = getbuffer(L, 1);
+	const char *err = freebuffer(B);
+	if (err != NULL)
+		return luaL_error(L, "%s", err);
+	return 0;
+}
+
+/**
+Write a mapped @{Buffer}'s contents to its file and wait for them to reach the disk.
+The file is truncated to the length of the contents. The Buffer remains mapped, so more strings can be added to it.
+This does nothing for Buffers that aren't mapped.
+
+@function flush
+@treturn[1] Buffer The Buffer object.
+@return[2] nil
+@treturn[2] string An error message.
+*/
+static int bufflib_flush(lua_State *L){
+	Buffer *B = getbuffer(L, 1);
+#ifdef MAPPED_SUPPORTED
+	if (B->store == STORE_MAPPED) {
+		const char *err = flushmapped(B);
+		if (err != NULL) {
+			lua_pushnil(L);
+			lua_pushstring(L, err);
+			return 2;
+		}
+	}
+#endif
+	return pushbuffer(L, 1);
+}
+
+/**
+Release the @{Buffer}'s storage, leaving it empty.
+If the Buffer is mapped, its contents are flushed to its file (as with @{Buffer:flush|`buff:flush()`}) and the file is closed. The Buffer then goes back to storing its contents in memory.
+
+@function close
+@treturn[1] bool true
+@return[2] nil
+@treturn[2] string An error message. The storage is released even if writing a mapped file fails.
+*/
+static int bufflib_closebuffer(lua_State *L){
+	Buffer *B = getbuffer(L, 1);
+	const char *err = freebuffer(B);
+	if (err != NULL) {
+		lua_pushnil(L);
+		lua_pushstring(L, err);
+		return 2;
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+	LZ4 compression.
+	Buffers are compressed to the standard LZ4 frame format (https://github.com/lz4/lz4/blob/dev/doc/lz4_Frame_format.md),
+	so the output can be read by any LZ4 implementation. The frames written here use independent 4 MB blocks,
+	record the content size and end with an xxHash32 checksum of the content.
+*/
+#if UINT_MAX < 0xffffffff
+#error "lua_bufflib's LZ4 code needs an unsigned int of at least 32 bits"
+#endif
+
+typedef unsigned int U32;
+
+#define LZ4_MAGIC 0x184D2204U
+#define LZ4_SKIPPABLEMAGIC 0x184D2A50U /* The low 4 bits can be anything */
+#define LZ4_MINMATCH 4
+#define LZ4_LASTLITERALS 5 /* The last 5 bytes of a block are always literals */
+#define LZ4_MFLIMIT 12 /* The last match must start at least 12 bytes before the end of a block */
+#define LZ4_MAXDISTANCE 65535
+#define LZ4_HASHLOG 12
+#define LZ4_BLOCKMAX (4 << 20) /* Block maximum size written to frames (BD byte 0x70) */
+#define LZ4_HEADERMAX 19 /* Magic, FLG, BD, content size, dictionary ID, header checksum */
+#define LZ4_WORKSPACE "bufflib_lz4workspace" /* Registry key of the state's compression hash table */
+
+/* The maximum compressed size of a block of n bytes */
+#define lz4_bound(n) ((n) + (n) / 255 + 16)
+
+#define PRIME32_1 2654435761U
+#define PRIME32_2 2246822519U
+#define PRIME32_3 3266489917U
+#define PRIME32_4 668265263U
+#define PRIME32_5 374761393U
+
+#define rotl32(x, r) ((((x) << (r)) | ((x) >> (32 - (r)))) & 0xffffffffU)
+
+/* Reads a little-endian 32-bit value */
+static U32 readle32(const unsigned char *p) {
+	return (U32)p[0] | ((U32)p[1] << 8) | ((U32)p[2] << 16) | ((U32)p[3] << 24);
+}
+
+/* Writes a little-endian 32-bit value */
+static void writele32(unsigned char *p, U32 v) {
+	p[0] = (unsigned char)v;
+	p[1] = (unsigned char)(v >> 8);
+	p[2] = (unsigned char)(v >> 16);
+	p[3] = (unsigned char)(v >> 24);
+}
+
+/* Reads 4 bytes in native byte order, used to compare and hash sequences */
+static U32 read32(const unsigned char *p) {
+	U32 v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+#define xxh32round(acc, v) (rotl32(((acc) + (v) * PRIME32_2) & 0xffffffffU, 13) * PRIME32_1 & 0xffffffffU)
+
+/* Calculates the xxHash32 checksum of len bytes at p */
+static U32 xxh32(const unsigned char *p, size_t len, U32 seed) {
+	const unsigned char *end = p + len;
+	U32 h;
+
+	if (len >= 16) {
+		const unsigned char *limit = end - 16;
+		U32 v1 = (seed + PRIME32_1 + PRIME32_2) & 0xffffffffU;
+		U32 v2 = (seed + PRIME32_2) & 0xffffffffU;
+		U32 v3 = seed;
+		U32 v4 = (seed - PRIME32_1) & 0xffffffffU;
+		do {
+			v1 = xxh32round(v1, readle32(p));
+			v2 = xxh32round(v2, readle32(p + 4));
+			v3 = xxh32round(v3, readle32(p + 8));
+			v4 = xxh32round(v4, readle32(p + 12));
+			p += 16;
+		} while (p <= limit);
+		h = (rotl32(v1, 1) + rotl32(v2, 7) + rotl32(v3, 12) + rotl32(v4, 18)) & 0xffffffffU;
+	} else {
+		h = (seed + PRIME32_5) & 0xffffffffU;
+	}
+
+	h = (h + (U32)len) & 0xffffffffU;
+	while (p + 4 <= end) {
+		h = (h + readle32(p) * PRIME32_3) & 0xffffffffU;
+		h = rotl32(h, 17) * PRIME32_4 & 0xffffffffU;
+		p += 4;
+	}
+	while (p < end) {
+		h = (h + *p * PRIME32_5) & 0xffffffffU;
+		h = rotl32(h, 11) * PRIME32_1 & 0xffffffffU;
+		p++;
+	}
+
+	h ^= h >> 15;
+	h = h * PRIME32_2 & 0xffffffffU;
+	h ^= h >> 13;
+	h = h * PRIME32_3 & 0xffffffffU;
+	h ^= h >> 16;
+	return h;
+}
+
+#define lz4_hash(p) ((read32(p) * PRIME32_1 & 0xffffffffU) >> (32 - LZ4_HASHLOG))
+
+/* Writes a length of at least 15 as the continuation bytes following a token nibble of 15 */
+static unsigned char *lz4_writelength(unsigned char *op, size_t len) {
+	len -= 15;
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = (unsigned char)len;
+	return op;
+}
+
+/*
+	Compresses len bytes from src to an LZ4 block at dst, which must have room for lz4_bound(len) bytes.
+	table is the hash table of (1 << LZ4_HASHLOG) positions, it doesn't need to be cleared.
+	Higher accelerations skip through incompressible data faster, at the cost of compression ratio.
+	Returns the compressed size.
+*/
+static size_t lz4_compressblock(const unsigned char *src, size_t len, unsigned char *dst, U32 *table, unsigned accel) {
+	const unsigned char *ip = src, *anchor = src;
+	const unsigned char *iend = src + len;
+	const unsigned char *mflimit = iend - LZ4_MFLIMIT;
+	const unsigned char *matchlimit = iend - LZ4_LASTLITERALS;
+	unsigned char *op = dst;
+	size_t litlen;
+
+	if (len > LZ4_MFLIMIT) {
+		memset(table, 0, sizeof(U32) << LZ4_HASHLOG);
+		ip++; /* The first byte can't be a match, it's already in the table as position 0 */
+
+		for (;;) {
+			const unsigned char *ref, *matchstart;
+			unsigned char *token;
+			size_t matchlen;
+			unsigned step = 1, searches = accel << 6;
+			U32 h;
+
+			/* Find a match, skipping faster the longer we go without finding one */
+			for (;;) {
+				if (ip > mflimit)
+					goto lastliterals;
+				h = lz4_hash(ip);
+				ref = src + table[h];
+				table[h] = (U32)(ip - src);
+				if (ref < ip && ip - ref <= LZ4_MAXDISTANCE && read32(ref) == read32(ip))
+					break;
+				ip += step;
+				step = searches++ >> 6;
+			}
+
+			/* Extend the match backwards */
+			while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+				ip--;
+				ref--;
+			}
+
+			/* Literals */
+			litlen = (size_t)(ip - anchor);
+			token = op++;
+			if (litlen >= 15) {
+				*token = 15 << 4;
+				op = lz4_writelength(op, litlen);
+			} else {
+				*token = (unsigned char)(litlen << 4);
+			}
+			memcpy(op, anchor, litlen);
+			op += litlen;
+
+			/* Offset */
+			op[0] = (unsigned char)(ip - ref);
+			op[1] = (unsigned char)((ip - ref) >> 8);
+			op += 2;
+
+			/* Extend the match forwards, a word at a time */
+			matchstart = ip;
+			ip += LZ4_MINMATCH;
+			ref += LZ4_MINMATCH;
+			while (ip + sizeof(size_t) <= matchlimit) {
+				size_t a, b;
+				memcpy(&a, ip, sizeof(a));
+				memcpy(&b, ref, sizeof(b));
+				if (a != b)
+					break;
+				ip += sizeof(size_t);
+				ref += sizeof(size_t);
+			}
+			while (ip < matchlimit && *ip == *ref) {
+				ip++;
+				ref++;
+			}
+
+			matchlen = (size_t)(ip - matchstart) - LZ4_MINMATCH;
+			if (matchlen >= 15) {
+				*token |= 15;
+				op = lz4_writelength(op, matchlen);
+			} else {
+				*token |= (unsigned char)matchlen;
+			}
+
+			anchor = ip;
+			if (ip > mflimit)
+				break;
+			table[lz4_hash(ip - 2)] = (U32)(ip - 2 - src);
+		}
+	}
+
+lastliterals:
+	litlen = (size_t)(iend - anchor);
+	if (litlen >= 15) {
+		*op++ = 15 << 4;
+		op = lz4_writelength(op, litlen);
+	} else {
+		*op++ = (unsigned char)(litlen << 4);
+	}
+	memcpy(op, anchor, litlen);
+	op += litlen;
+	return (size_t)(op - dst);
+}
+
+/*
+	Reads a length continued in bytes of 255 from ip. Returns 0 if the input ends or the length overflows.
+*/
+static int lz4_readlength(const unsigned char **ip, const unsigned char *iend, size_t *len) {
+	unsigned b;
+	do {
+		if (*ip >= iend)
+			return 0;
+		b = *(*ip)++;
+		if (*len + b < *len)
+			return 0;
+		*len += b;
+	} while (b == 255);
+	return 1;
+}
+
+/*
+	Decompresses the LZ4 block of srclen bytes at src to dst, which has room for dstcap bytes.
+	Matches may refer back to prefix, the start of the output that dst continues (used for blocks that depend on earlier blocks).
+	Returns the decompressed size, or (size_t)-1 if the block is corrupt or doesn't fit.
+*/
+static size_t lz4_decompressblock(const unsigned char *src, size_t srclen, unsigned char *dst, size_t dstcap, const unsigned char *prefix) {
+	const unsigned char *ip = src, *iend = src + srclen;
+	unsigned char *op = dst, *oend = dst + dstcap;
+
+	for (;;) {
+		unsigned token;
+		size_t litlen, matchlen, offset;
+		const unsigned char *ref;
+
+		if (ip >= iend)
+			return (size_t)-1;
+		token = *ip++;
+
+		litlen = token >> 4;
+		if (litlen == 15 && !lz4_readlength(&ip, iend, &litlen))
+			return (size_t)-1;
+		if (litlen > (size_t)(iend - ip) || litlen > (size_t)(oend - op))
+			return (size_t)-1;
+		memcpy(op, ip, litlen);
+		op += litlen;
+		ip += litlen;
+
+		if (ip == iend) /* The last sequence only has literals */
+			break;
+
+		if (iend - ip < 2)
+			return (size_t)-1;
+		offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (size_t)(op - prefix))
+			return (size_t)-1;
+
+		matchlen = token & 15;
+		if (matchlen == 15 && !lz4_readlength(&ip, iend, &matchlen))
+			return (size_t)-1;
+		matchlen += LZ4_MINMATCH;
+		if (matchlen > (size_t)(oend - op))
+			return (size_t)-1;
+
+		ref = op - offset;
+		if (offset >= matchlen) {
+			memcpy(op, ref, matchlen);
+			op += matchlen;
+		} else { /* Overlapping match, copy byte by byte */
+			while (matchlen-- > 0)
+				*op++ = *ref++;
+		}
+	}
+
+	return (size_t)(op - dst);
+}
+
+/* Returns the state's compression hash table, creating it the first time it's needed */
+static U32 *lz4_workspace(lua_State *L) {
+	U32 *table;
+	lua_getfield(L, LUA_REGISTRYINDEX, LZ4_WORKSPACE);
+	table = (U32 *)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	if (table == NULL) {
+		table = (U32 *)newudata(L, sizeof(U32) << LZ4_HASHLOG);
+		lua_setfield(L, LUA_REGISTRYINDEX, LZ4_WORKSPACE);
+	}
+	return table;
+}
+
+/*
+	Returns a pointer to the contents of the Buffer or string at index i and stores their length in len.
+	Raises an error if the value is neither.
+*/
+static const char *checkbytes(lua_State *L, int i, size_t *len) {
+	Buffer *B = testbuffer(L, i);
+	if (B != NULL) {
+		*len = B->n;
+		return B->b;
+	}
+	return luaL_checklstring(L, i, len);
+}
+
+/* Appends an LZ4 frame holding len bytes from src to the Buffer */
+static void lz4_addframe(Buffer *B, const char *src, size_t len, unsigned accel) {
+	U32 *table = lz4_workspace(B->L);
+	size_t nblocks = len / LZ4_BLOCKMAX + 1;
+	size_t bound = LZ4_HEADERMAX + nblocks * (4 + lz4_bound(LZ4_BLOCKMAX)) + 8; /* Header, blocks, end mark and checksum */
+	unsigned char *op, *start;
+	size_t pos;
+	U32 hi;
+
+	if (len > LZ4_BLOCKMAX) /* Only reserve what the blocks can actually take */
+		bound = LZ4_HEADERMAX + nblocks * 4 + lz4_bound(len) + (nblocks - 1) * 16 + 8;
+	start = op = (unsigned char *)prepbuffsize(B, bound);
+
+	/* Header: version 01, independent blocks, content size and content checksum; 4 MB blocks */
+	writele32(op, LZ4_MAGIC);
+	op[4] = 0x40 | 0x20 | 0x08 | 0x04;
+	op[5] = 0x70;
+	hi = (U32)((len >> 16) >> 16); /* Shifted twice so this is valid for a 32-bit size_t */
+	writele32(op + 6, (U32)(len & 0xffffffffU));
+	writele32(op + 10, hi);
+	op[14] = (unsigned char)(xxh32(op + 4, 10, 0) >> 8);
+	op += 15;
+
+	for (pos = 0; pos < len; pos += LZ4_BLOCKMAX) {
+		size_t blocklen = len - pos < LZ4_BLOCKMAX ? len - pos : LZ4_BLOCKMAX;
+		const unsigned char *block = (const unsigned char *)src + pos;
+		size_t clen = lz4_compressblock(block, blocklen, op + 4, table, accel);
+		if (clen >= blocklen) { /* Incompressible, store it uncompressed */
+			memcpy(op + 4, block, blocklen);
+			writele32(op, (U32)blocklen | 0x80000000U);
+			op += 4 + blocklen;
+		} else {
+			writele32(op, (U32)clen);
+			op += 4 + clen;
+		}
+	}
+
+	writele32(op, 0); /* End mark */
+	writele32(op + 4, xxh32((const unsigned char *)src, len, 0));
+	op += 8;
+	addsize(B, (size_t)(op - start));
+}
+
+/* Discards the content added by the frame being decoded (everything after start) and raises an error */
+static void lz4_error(Buffer *B, size_t start, const char *msg) {
+	B->n = start;
+	B->version++;
+	luaL_error(B->L, "invalid LZ4 frame (%s)", msg);
+}
+
+/*
+	Decodes the frame starting at src[pos] and appends its content to the Buffer.
+	Returns the position after the frame, or 0 if the frame is incomplete. Raises an error if it's corrupt, leaving the Buffer as it was before the frame.
+	The block headers are checked before anything is decoded, so an incomplete frame costs a walk over its block headers rather than decoding its blocks.
+*/
+static size_t lz4_readframe(Buffer *B, const unsigned char *src, size_t len, size_t pos) {
+	const unsigned char *ip = src + pos, *iend = src + len, *p;
+	size_t start = B->n, hlen, declared = 0;
+	unsigned flg, bd;
+	int hascontentsize, hasblocksum, hascontentsum;
+	size_t blockmax;
+
+	if (iend - ip < 4)
+		return 0;
+
+	if ((readle32(ip) & 0xfffffff0U) == LZ4_SKIPPABLEMAGIC) {
+		size_t skip;
+		if (iend - ip < 8)
+			return 0;
+		skip = readle32(ip + 4);
+		if ((size_t)(iend - ip) - 8 < skip)
+			return 0;
+		return pos + 8 + skip;
+	}
+
+	if (readle32(ip) != LZ4_MAGIC)
+		luaL_error(B->L, "invalid LZ4 frame (bad magic number)");
+	if (iend - ip < 7)
+		return 0;
+
+	flg = ip[4];
+	bd = ip[5];
+	if ((flg >> 6) != 1 || (flg & 0x02) || (bd & 0x8f) || ((bd >> 4) & 7) < 4)
+		luaL_error(B->L, "invalid LZ4 frame (unsupported frame descriptor)");
+	if (flg & 0x01)
+		luaL_error(B->L, "invalid LZ4 frame (dictionaries aren't supported)");
+
+	hascontentsize = (flg & 0x08) != 0;
+	hasblocksum = (flg & 0x10) != 0;
+	hascontentsum = (flg & 0x04) != 0;
+	blockmax = (size_t)1 << (8 + 2 * ((bd >> 4) & 7));
+
+	hlen = 7 + (hascontentsize ? 8 : 0);
+	if ((size_t)(iend - ip) < hlen)
+		return 0;
+	if ((unsigned char)(xxh32(ip + 4, hlen - 5, 0) >> 8) != ip[hlen - 1])
+		luaL_error(B->L, "invalid LZ4 frame (bad header checksum)");
+	if (hascontentsize) {
+		declared = readle32(ip + 6);
+		if (readle32(ip + 10) != 0 && sizeof(size_t) > 4)
+			declared |= (size_t)readle32(ip + 10) << 16 << 16;
+	}
+	ip += hlen;
+
+	for (p = ip;;) { /* Find the end of the frame */
+		U32 blocksize;
+		size_t datalen;
+
+		if (iend - p < 4)
+			return 0;
+		blocksize = readle32(p);
+		p += 4;
+		if (blocksize == 0) /* End mark */
+			break;
+
+		datalen = blocksize & 0x7fffffffU;
+		if (datalen > ((blocksize & 0x80000000U) ? blockmax : blockmax + 16)) /* Only compressed blocks can expand */
+			luaL_error(B->L, "invalid LZ4 frame (block too large)");
+		if ((size_t)(iend - p) < datalen + (hasblocksum ? 4 : 0))
+			return 0;
+		p += datalen + (hasblocksum ? 4 : 0);
+	}
+	if (hascontentsum && iend - p < 4)
+		return 0;
+
+	for (;;) {
+		U32 blocksize = readle32(ip);
+		size_t datalen = blocksize & 0x7fffffffU;
+		ip += 4;
+		if (blocksize == 0) /* End mark */
+			break;
+		if (hasblocksum && xxh32(ip, datalen, 0) != readle32(ip + datalen))
+			lz4_error(B, start, "bad block checksum");
+
+		if (blocksize & 0x80000000U) { /* Uncompressed block */
+			char *b = prepbuffsize(B, datalen);
+			memcpy(b, ip, datalen);
+			addsize(B, datalen);
+		} else {
+			unsigned char *b = (unsigned char *)prepbuffsize(B, blockmax);
+			size_t n = lz4_decompressblock(ip, datalen, b, blockmax, (unsigned char *)B->b + start);
+			if (n == (size_t)-1)
+				lz4_error(B, start, "corrupt block");
+			addsize(B, n);
+		}
+		ip += datalen + (hasblocksum ? 4 : 0);
+	}
+
+	if (hascontentsum) {
+		if (xxh32((unsigned char *)B->b + start, B->n - start, 0) != readle32(ip))
+			lz4_error(B, start, "bad content checksum");
+		ip += 4;
+	}
+	if (hascontentsize && B->n - start != declared)
+		lz4_error(B, start, "content size mismatch");
+
+	return (size_t)(ip - src);
+}
+
+/*
+	Returns the optional integer argument at index i, raising an error if it's outside [min, max].
+*/
+static lua_Integer checkintrange(lua_State *L, int i, lua_Integer def, lua_Integer min, lua_Integer max) {
+	lua_Integer v = luaL_optinteger(L, i, def);
+	luaL_argcheck(L, min <= v && v <= max, i, "out of range");
+	return v;
+}
+
+/* Converts a compression level (1-9) to an LZ4 acceleration factor */
+#define checklevel(L, i) (10 - (unsigned)checkintrange(L, i, 9, 1, 9))
+
+/**
+Compress the @{Buffer}'s contents to a new Buffer holding a standard LZ4 frame.
+The original Buffer is unchanged.
+
+@function compress
+@int[opt=9] level The compression level, from 1 to 9. Lower levels are faster, but compress less.
+@treturn Buffer The new Buffer holding the compressed frame.
+*/
+static int bufflib_compress(lua_State *L) {
+	Buffer *B = getbuffer(L, 1);
+	unsigned accel = checklevel(L, 2);
+	Buffer *dest = newbuffer(L);
+	lz4_addframe(dest, B->b, B->n, accel);
+	return 1;
+}
+
+/**
+Compress a string or @{Buffer} and add the compressed LZ4 frame to this Buffer.
+Calling this repeatedly with chunks of a larger output produces a stream of concatenated frames, which is itself a valid LZ4 stream
+and can be decompressed in one go by @{Buffer:adddecompressed|`buff:adddecompressed`} or the `lz4` command-line tool.
+
+@function addcompressed
+@param src The string or Buffer to compress. This can't be the Buffer being added to.
+@int[opt=9] level The compression level, from 1 to 9. Lower levels are faster, but compress less.
+@treturn Buffer The Buffer object.
+*/
+static int bufflib_addcompressed(lua_State *L) {
+	Buffer *B = getbuffer(L, 1);
+	size_t len;
+	const char *src = checkbytes(L, 2, &len);
+	unsigned accel = checklevel(L, 3);
+	luaL_argcheck(L, !lua_rawequal(L, 1, 2), 2, "can't compress a Buffer into itself");
+	lz4_addframe(B, src, len, accel);
+	return pushbuffer(L, 1);
+}
+
+/**
+Decompress LZ4 frames from a string or @{Buffer} and add their contents to this Buffer.
+Every complete frame from `pos` onwards is decompressed. If the data ends partway through a frame, that frame is left alone and its position is returned,
+so streamed data can be decompressed as it arrives by calling this again with the same position once more data is available.
+An incomplete frame isn't decoded at all (only its block headers are read), so each frame is decompressed once however many pieces it arrives in.
+If a frame is corrupt, the content added by that frame is discarded before the error is raised.
+Skippable frames are skipped. Frames that use dictionaries aren't supported.
+
+@function adddecompressed
+@param src The string or Buffer holding the compressed frames. This can't be the Buffer being added to.
+@int[opt=1] pos The position of the first frame in `src`.
+@treturn Buffer The Buffer object.
+@treturn int The position after the last complete frame (`#src + 1` if every frame was complete).
+@error Raises an error if a frame is corrupt.
+*/
+static int bufflib_adddecompressed(lua_State *L) {
+	Buffer *B = getbuffer(L, 1);
+	size_t len, pos, next;
+	const unsigned char *src = (const unsigned char *)checkbytes(L, 2, &len);
+	lua_Integer init = luaL_optinteger(L, 3, 1);
+	luaL_argcheck(L, !lua_rawequal(L, 1, 2), 2, "can't decompress a Buffer into itself");
+	luaL_argcheck(L, init >= 1 && (size_t)init <= len + 1, 3, "out of range");
+
+	pos = (size_t)init - 1;
+	while (pos < len && (next = lz4_readframe(B, src, len, pos)) != 0)
+		pos = next;
+
+	lua_pushvalue(L, 1);
+	lua_pushinteger(L, (lua_Integer)pos + 1);
+	return 2;
+}
+
+/*
+	UTF-8.
+	Validation skips through ASCII a machine word at a time (SWAR), which covers most real text; other characters are checked one at a time
+	against the well-formed byte sequences in table 3-7 of the Unicode standard (no overlong forms, surrogates or codepoints above U+10FFFF).
+*/
+
+/* A size_t with the high bit of every byte set, used to test a whole word for ASCII at once */
+#define HIGHBITS (((size_t)-1 / 0xff) * 0x80)
+
+/*
+	Returns the length of the well-formed UTF-8 sequence at s (which has len bytes available) or 0 if it isn't one.
+*/
+static size_t utf8seqlen(const unsigned char *s, size_t len) {
+	unsigned c = s[0];
+	unsigned lo = 0x80, hi = 0xbf; /* The range of the second byte */
+	size_t need, i;
+
+	if (c < 0x80)
+		return 1;
+	else if (c >= 0xc2 && c <= 0xdf)
+		need = 2;
+	else if (c >= 0xe0 && c <= 0xef) {
+		need = 3;
+		if (c == 0xe0)
+			lo = 0xa0; /* Overlong */
+		else if (c == 0xed)
+			hi = 0x9f; /* Surrogates */
+	} else if (c >= 0xf0 && c <= 0xf4) {
+		need = 4;
+		if (c == 0xf0)
+			lo = 0x90; /* Overlong */
+		else if (c == 0xf4)
+			hi = 0x8f; /* Above U+10FFFF */
+	} else
+		return 0;
+
+	if (len < need || s[1] < lo || s[1] > hi)
+		return 0;
+	for (i = 2; i < need; i++) {
+		if ((s[i] & 0xc0) != 0x80)
+			return 0;
+	}
+	return need;
+}
+
+/*
+	Scans the UTF-8 sequences in the n bytes at s from pos up to end, where the sequence at pos is codepoint number count.
+	Stores the byte offset of every UTF8STRIDE'th codepoint in offsets, unless it's NULL.
+	Returns the number of codepoints before the position the scan stopped at, which is stored in stop: end, or the position of the first invalid sequence.
+*/
+static size_t utf8scan(const unsigned char *s, size_t n, size_t pos, size_t end, size_t count, size_t *offsets, size_t *stop) {
+	size_t nextmark = offsets != NULL ? (count + UTF8STRIDE - 1) / UTF8STRIDE * UTF8STRIDE : (size_t)-1;
+	while (pos < end) {
+		size_t seqlen;
+		if (count == nextmark) {
+			offsets[count / UTF8STRIDE] = pos;
+			nextmark += UTF8STRIDE;
+		}
+		if (end - pos >= sizeof(size_t)) {
+			size_t w;
+			memcpy(&w, s + pos, sizeof(w));
+			if ((w & HIGHBITS) == 0) { /* A word of ASCII, skip it (stopping at the next mark) */
+				size_t adv = nextmark - count < sizeof(size_t) ? nextmark - count : sizeof(size_t);
+				pos += adv;
+				count += adv;
+				continue;
+			}
+		}
+		seqlen = utf8seqlen(s + pos, n - pos);
+		if (seqlen == 0)
+			break;
+		pos += seqlen;
+		count++;
+	}
+	*stop = pos;
+	return count;
+}
+
+/*
+	A UTF-8 index build split into chunks for runparallel.
+	Chunk boundaries are moved forward past continuation bytes, so if the contents before a boundary are valid it's the start of a sequence.
+	The first pass counts the codepoints in each chunk, the second (only run if they're all valid) records the offsets starting from the counts before each chunk.
+*/
+typedef struct Utf8Task {
+	const unsigned char *s;
+	size_t n;
+	size_t *offsets; /* NULL in the first pass */
+	size_t bounds[POOL_MAXCHUNKS + 1]; /* Chunk k is from bounds[k] to bounds[k + 1] */
+	size_t counts[POOL_MAXCHUNKS]; /* The codepoints in each chunk (first pass) or before it (second pass) */
+	size_t stops[POOL_MAXCHUNKS]; /* Where each chunk's scan stopped */
+} Utf8Task;
+
+static void utf8chunk(void *ctx, size_t k) {
+	Utf8Task *t = (Utf8Task *)ctx;
+	if (t->offsets == NULL)
+		t->counts[k] = utf8scan(t->s, t->n, t->bounds[k], t->bounds[k + 1], 0, NULL, &t->stops[k]);
+	else
+		utf8scan(t->s, t->n, t->bounds[k], t->bounds[k + 1], t->counts[k], t->offsets, &t->stops[k]);
+}
+
+/* Builds the index of the Buffer's contents in idx on the worker pool. Returns 0 if the contents are too small to split into chunks. */
+static int utf8parallel(Buffer *B, Utf8Index *idx) {
+	Utf8Task t;
+	size_t chunksize, nchunks = poolchunks(B->n, &chunksize), k, count = 0;
+	if (nchunks <= 1)
+		return 0;
+	t.s = (const unsigned char *)B->b;
+	t.n = B->n;
+	t.offsets = NULL;
+	t.bounds[0] = 0;
+	for (k = 1; k < nchunks; k++) {
+		size_t pos = k * chunksize;
+		while (pos < t.n && (t.s[pos] & 0xc0) == 0x80)
+			pos++;
+		t.bounds[k] = pos;
+	}
+	t.bounds[nchunks] = t.n;
+	runparallel(utf8chunk, &t, nchunks);
+
+	idx->valid = 1;
+	for (k = 0; k < nchunks; k++) {
+		size_t chunkcount = t.counts[k];
+		if (t.stops[k] < t.bounds[k + 1]) { /* The earlier chunks are valid, so this is the first invalid sequence */
+			idx->valid = 0;
+			idx->len = t.stops[k];
+			return 1;
+		}
+		t.counts[k] = count;
+		count += chunkcount;
+	}
+	idx->len = count;
+	t.offsets = idx->offsets;
+	runparallel(utf8chunk, &t, nchunks);
+	return 1;
+}
+
+/*
+	Returns the Buffer's UTF-8 index, building it if the contents have changed since it was last built.
+	The index records whether the contents are valid UTF-8, their length in codepoints and the byte offset of every UTF8STRIDE'th codepoint.
+*/
+static Utf8Index *getutf8index(Buffer *B) {
+	Utf8Index *idx = B->utf8;
+	size_t n = B->n, needed = n / UTF8STRIDE + 1;
+
+	if (idx != NULL && idx->version == B->version && idx->n == n)
+		return idx;
+
+	if (idx == NULL || idx->size < needed) {
+		freeutf8index(B);
+		if (!budgetresize(B->budget, 0, utf8indexsize(needed)))
+			luaL_error(B->L, "memory limit exceeded");
+		idx = (Utf8Index *)B->allocf(B->allocud, NULL, 0, utf8indexsize(needed));
+		if (idx == NULL) {
+			budgetresize(B->budget, utf8indexsize(needed), 0);
+			luaL_error(B->L, "not enough memory");
+		}
+		idx->size = needed;
+		B->utf8 = idx;
+	}
+
+	if (!utf8parallel(B, idx)) {
+		size_t pos, count = utf8scan((const unsigned char *)B->b, n, 0, n, 0, idx->offsets, &pos);
+		idx->valid = pos == n;
+		idx->len = idx->valid ? count : pos; /* The position of the invalid sequence if the contents aren't valid */
+	}
+	idx->version = B->version;
+	idx->n = n;
+	return idx;
+}
+
+/* Returns the byte offset of the codepoint with (0-based) index k in a Buffer with a valid index */
+static size_t utf8offset(Buffer *B, Utf8Index *idx, size_t k) {
+	const unsigned char *s = (const unsigned char *)B->b;
+	size_t pos, i;
+	if (k >= idx->len)
+		return B->n;
+	pos = idx->offsets[k / UTF8STRIDE];
+	for (i = k % UTF8STRIDE; i > 0; i--) {
+		pos++;
+		while ((s[pos] & 0xc0) == 0x80)
+			pos++;
+	}
+	return pos;
+}
+
+/* Returns the index of a Buffer whose contents must be valid UTF-8, raising an error if they aren't */
+static Utf8Index *checkutf8(Buffer *B) {
+	Utf8Index *idx = getutf8index(B);
+	if (!idx->valid)
+		luaL_error(B->L, "invalid UTF-8 at position %s", pushintstring(B->L, (lua_Integer)idx->len + 1));
+	return idx;
+}
+
+/**
+Checks whether the @{Buffer}'s contents are valid UTF-8.
+Overlong forms, surrogates and codepoints above U+10FFFF are invalid.
+
+@function utf8valid
+@treturn bool Are the contents valid UTF-8?
+@treturn int If they aren't, the position of the first invalid byte sequence.
+*/
+static int bufflib_utf8valid(lua_State *L) {
+	Buffer *B = getbuffer(L, 1);
+	Utf8Index *idx = getutf8index(B);
+	lua_pushboolean(L, idx->valid);
+	if (idx->valid)
+		return 1;
+	lua_pushinteger(L, (lua_Integer)idx->len + 1);
+	return 2;
+}
+
+/**
+Returns the number of UTF-8 codepoints in the @{Buffer}.
+The length is cached until the Buffer is next modified.
+
+@function utf8len
+@treturn int The number of codepoints.
+@error If the contents aren't valid UTF-8, returns nil followed by the position of the first invalid byte sequence.
+*/
+static int bufflib_utf8len(lua_State *L) {
+	Buffer *B = getbuffer(L, 1);
+	Utf8Index *idx = getutf8index(B);
+	if (!idx->valid) {
+		lua_pushnil(L);
+		lua_pushinteger(L, (lua_Integer)idx->len + 1);
+		return 2;
+	}
+	lua_pushinteger(L, (lua_Integer)idx->len);
+	return 1;
+}
+
+/**
+Returns the substring of the @{Buffer}'s contents from codepoint `i` to codepoint `j`.
+`i` and `j` are codepoint positions interpreted in the same way as the arguments of `string.sub`.
+The first call after the Buffer is modified builds an index of the codepoint offsets, later calls only scan a few characters.
+
+@function utf8sub
+@int[opt=1] i The position of the first codepoint.
+@int[opt=-1] j The position of the last codepoint.
+@treturn string The substring.
+@error Raises an error if the contents aren't valid UTF-8.
+*/
+static int bufflib_utf8sub(lua_State *L) {
+	Buffer *B = getbuffer(L, 1);
+	Utf8Index *idx = checkutf8(B);
+	size_t start, end, bstart;
+	if (!rangeargs(L, 2, idx->len, &start, &end)) {
+		lua_pushliteral(L, "");
+		return 1;
+	}
+	bstart = utf8offset(B, idx, start);
+	lua_pushlstring(L, B->b + bstart, utf8offset(B, idx, end) - bstart);
+	return 1;
+}
+
+/**
+Adds some Unicode codepoints to the @{Buffer}, encoded as UTF-8.
+
+@function addcodepoint
+@int ... The codepoints, from 0 to 0x10FFFF (excluding the surrogates 0xD800 to 0xDFFF).
+@treturn Buffer The Buffer object.
+*/
+static int bufflib_addcodepoint(lua_State *L) {
+	Buffer *B = getbuffer(L, 1);
+	int i, numargs = lua_gettop(L);
+	for (i = 2; i <= numargs; i++) {
+		lua_Integer cp = luaL_checkinteger(L, i);
+		unsigned char *b = (unsigned char *)prepbuffsize(B, 4);
+		size_t len;
+		luaL_argcheck(L, cp >= 0 && cp <= 0x10ffff && (cp < 0xd800 || cp > 0xdfff), i, "value out of range");
+		if (cp < 0x80) {
+			b[0] = (unsigned char)cp;
+			len = 1;
+		} else if (cp < 0x800) {
+			b[0] = (unsigned char)(0xc0 | (cp >> 6));
+			b[1] = (unsigned char)(0x80 | (cp & 0x3f));
+			len = 2;
+		} else if (cp < 0x10000) {
+			b[0] = (unsigned char)(0xe0 | (cp >> 12));
+			b[1] = (unsigned char)(0x80 | ((cp >> 6) & 0x3f));
+			b[2] = (unsigned char)(0x80 | (cp & 0x3f));
+			len = 3;
+		} else {
+			b[0] = (unsigned char)(0xf0 | (cp >> 18));
+			b[1] = (unsigned char)(0x80 | ((cp >> 12) & 0x3f));
+			b[2] = (unsigned char)(0x80 | ((cp >> 6) & 0x3f));
+			b[3] = (unsigned char)(0x80 | (cp & 0x3f));
+			len = 4;
+		}
+		addsize(B, len);
+	}
+	return pushbuffer(L, 1);
+}
+
+/* A size_t with every byte set to 1 */
+#define ONEBYTES ((size_t)-1 / 0xff)
+
+/*
+	Flips the case of the ASCII letters from first to last in len bytes at s, a machine word at a time (SWAR).
+	Bytes outside the range (including all non-ASCII bytes) are left unchanged.
+*/
+static void flipcase(unsigned char *s, size_t len, unsigned char first, unsigned char last) {
+	size_t i = 0;
+	for (; i + sizeof(size_t) <= len; i += sizeof(size_t)) {
+		size_t w, t, ge, gt;
+		memcpy(&w, s + i, sizeof(w));
+		t = w & ~HIGHBITS; /* The low 7 bits of each byte, so the additions below can't carry into the next byte */
+		ge = t + (0x80 - first) * ONEBYTES; /* The high bit of each byte is set if it's >= first */
+		gt = t + (0x7f - last) * ONEBYTES; /* The high bit of each byte is set if it's > last */
+		w ^= ((ge & ~gt & ~w) & HIGHBITS) >> 2; /* 0x80 >> 2 is 0x20, the difference between the cases */
+		memcpy(s + i, &w, sizeof(w));
+	}
+	for (; i < len; i++) {
+		if (s[i] >= first && s[i] <= last)
+			s[i] ^= 0x20;
+	}
+}
+
+/* A byte-for-byte transform of a Buffer's contents, split into chunks for runparallel (see mapbytes) */
+typedef struct MapTask {
+	unsigned char *s;
+	size_t len, chunksize;
+	const unsigned char *map; /* The replacement for each byte, or NULL to flip the case of the letters from first to last */
+	unsigned char first, last;
+} MapTask;
+
+static void mapchunk(void *ctx, size_t k) {
+	MapTask *t = (MapTask *)ctx;
+	unsigned char *s = t->s + k * t->chunksize;
+	size_t len = chunklen(t->len, t->chunksize, k), i;
+	if (t->map == NULL) {
+		flipcase(s, len, t->first, t->last);
+	} else {
+		for (i = 0; i < len; i++)
+			s[i] = t->map[s[i]];
+	}
+}
+
+/* Replaces each of the Buffer's bytes using map (or flips their case like flipcase if it's NULL), on the worker pool if the Buffer is large enough */
+static void mapbytes(Buffer *B, const unsigned char *map, unsigned char first, unsigned char last) {
+	MapTask t;
+	size_t nchunks;
+	t.s = (unsigned char *)B->b;
+	t.len = B->n;
+	t.map = map;
+	t.first = first;
+	t.last = last;
+	nchunks = poolchunks(t.len, &t.chunksize);
+	runparallel(mapchunk, &t, nchunks);
+}
+
+/**
+Converts the ASCII lowercase letters in the @{Buffer} to uppercase, in place.
+Unlike `buff:s_upper()`, this doesn't depend on the C locale: all other bytes are left unchanged.
+
+@function upper
+@treturn Buffer The Buffer object.
+*/
+static int bufflib_upper(lua_State *L) {
+	Buffer *B = getbuffer(L, 1);
+	ownbuffer(B);
+	mapbytes(B, NULL, 'a', 'z');
+	B->version++;
+	return pushbuffer(L, 1);
+}
+
+/**
+Converts the ASCII uppercase letters in the @{Buffer} to lowercase, in place.
+Unlike `buff:s_lower()`, this doesn't depend on the C locale: all other bytes are left unchanged.
+
+@function lower
+@treturn Buffer The Buffer object.
+*/
+static int bufflib_lower(lua_State *L) {
+	Buffer *B = getbuffer(L, 1);
+	ownbuffer(B);
+	mapbytes(B, NULL, 'A', 'Z');
+	B->version++;
+	return pushbuffer(L, 1);
+}
+
+/**
+Replaces and deletes bytes in the @{Buffer}, in place, like the `tr` command.
+Each byte in `from` is replaced with the byte at the same position in `to`, and every byte in `delete` is removed.
+Deletion is decided by the original bytes, like `tr -d`: a byte that's replaced with one in `delete` is kept, and a byte in `delete` is removed even if it's also in `from`.
+If a byte appears more than once in `from`, the last replacement is used.
+
+	buff:translate("abc", "xyz")    -- "aabbcc" becomes "xxyyzz"
+	buff:translate("", "", "\r")    -- Removes carriage returns
+
+@function translate
+@string from The bytes to replace.
+@string to The replacement bytes. Must be the same length as `from`.
+@string[opt] delete The bytes to remove.
+@treturn Buffer The Buffer object.
+*/
+static int bufflib_translate(lua_State *L) {
+	Buffer *B = getbuffer(L, 1);
+	size_t fromlen, tolen, dellen, i;
+	const unsigned char *from = (const unsigned char *)luaL_checklstring(L, 2, &fromlen);
+	const unsigned char *to = (const unsigned char *)luaL_checklstring(L, 3, &tolen);
+	const unsigned char *del = (const unsigned char *)luaL_optlstring(L, 4, "", &dellen);
+	unsigned char map[256], keep[256];
+	unsigned char *s;
+
+	luaL_argcheck(L, fromlen == tolen, 3, "must be the same length as 'from'");
+	ownbuffer(B);
+	s = (unsigned char *)B->b;
+
+	for (i = 0; i < 256; i++) {
+		map[i] = (unsigned char)i;
+		keep[i] = 1;
+	}
+	for (i = 0; i < fromlen; i++)
+		map[from[i]] = to[i];
+	for (i = 0; i < dellen; i++)
+		keep[del[i]] = 0;
+
+	if (dellen == 0) {
+		mapbytes(B, map, 0, 0);
+	} else { /* Compact the kept bytes towards the start */
+		size_t out = 0;
+		for (i = 0; i < B->n; i++) {
+			unsigned char c = s[i];
+			s[out] = map[c];
+			out += keep[c];
+		}
+		B->n = out;
+	}
+	B->version++;
+	return pushbuffer(L, 1);
+}
+
+/*
+	Converts a position relative to the end of a string of length len (negative values) to an absolute position, following the same rules as the string library.
+	The result may be outside of [1, len], so it should be checked by the caller.
+*/
+static lua_Integer posrelat(lua_Integer pos, size_t len) {
+	if (pos >= 0)
+		return pos;
+	else if (-pos > (lua_Integer)len)
+		return 0;
+	return (lua_Integer)len + pos + 1;
+}
+
+/*
+	Makes room for len bytes at (0-based) offset pos of the Buffer's contents by moving the contents after it, and returns a pointer to the room.
+	The Buffer's length includes the new bytes, which must be written by the caller.
+*/
+static char *openrange(Buffer *B, size_t pos, size_t len) {
+	char *b;
+	ownbuffer(B);
+	if (B->flags & BUFFER_GAP) { /* Write into the gap at pos */
+		if (B->size - B->n < len) { /* The gap is too small, grow the Buffer with the gap closed */
+			closegap(B);
+			prepbuffsize(B, len);
+		}
+		movegap(B, pos);
+		b = B->b + pos;
+		B->gap += len;
+		addsize(B, len);
+		return b;
+	}
+	b = prepbuffsize(B, len);
+	memmove(b - (B->n - pos) + len, b - (B->n - pos), (B->n - pos) * sizeof(char));
+	addsize(B, len);
+	return B->b + pos;
+}
+
+/* Removes len bytes at (0-based) offset pos of the Buffer's contents */
+static void closerange(Buffer *B, size_t pos, size_t len) {
+	ownbuffer(B);
+	if (B->flags & BUFFER_GAP) /* Move the gap to pos and extend it over the removed bytes */
+		movegap(B, pos);
+	else
+		memmove(B->b + pos, B->b + pos + len, (B->n - pos - len) * sizeof(char));
+	B->n -= len;
+	B->version++;
+}
+
+/**
+Returns the numeric codes of the bytes from position `i` to `j` of the @{Buffer}, like `string.byte`.
+Unlike `buff:s_byte()`, the Buffer's contents aren't copied to a string first.
+
+@function byte
+@int[opt=1] i The position of the first byte.
+@int[opt=i] j The position of the last byte.
+@treturn int... The byte codes.
+*/
+static int bufflib_byte(lua_State *L) {
+	Buffer *B = getrawbuffer(L, 1);
+	lua_Integer i = posrelat(luaL_optinteger(L, 2, 1), B->n);
+	lua_Integer j = posrelat(luaL_optinteger(L, 3, i), B->n);
+	int n, k;
+	if (i < 1)
+		i = 1;
+	if (j > (lua_Integer)B->n)
+		j = (lua_Integer)B->n;
+	if (i > j)
+		return 0;
+	if (j - i >= INT_MAX)
+		return luaL_error(L, "string slice too long");
+	n = (int)(j - i) + 1;
+	luaL_checkstack(L, n, "string slice too long");
+	for (k = 0; k < n; k++)
+		lua_pushinteger(L, (unsigned char)byteat(B, (size_t)(i + k - 1)));
+	return n;
+}
+
+/**
+Sets the bytes of the @{Buffer} starting at position `i` to the given numeric codes.
+All of the bytes must already be part of the Buffer's contents.
+
+@function setbyte
+@int i The position of the first byte to set.
+@int ... The byte codes, from 0 to 255.
+@treturn Buffer The Buffer object.
+*/
+static int bufflib_setbyte(lua_State *L) {
+	Buffer *B = getrawbuffer(L, 1);
+	lua_Integer i = posrelat(luaL_checkinteger(L, 2), B->n);
+	int k, count = lua_gettop(L) - 2;
+	luaL_argcheck(L, i >= 1 && (count == 0 || i <= (lua_Integer)B->n - count + 1), 2, "index out of range");
+	for (k = 0; k < count; k++) { /* Check every value first so an error leaves the Buffer unchanged */
+		lua_Integer c = luaL_checkinteger(L, k + 3);
+		luaL_argcheck(L, c >= 0 && c <= 255, k + 3, "value out of range");
+	}
+	ownbuffer(B);
+	for (k = 0; k < count; k++)
+		byteat(B, (size_t)(i + k - 1)) = (char)lua_tointeger(L, k + 3);
+	B->version++;
+	return pushbuffer(L, 1);
+}
+
+/**
+Returns the substring of the @{Buffer}'s contents from position `i` to `j`, like `string.sub`.
+Unlike `buff:s_sub()`, only the substring is copied.
+
+@function sub
+@int[opt=1] i The position of the first byte.
+@int[opt=-1] j The position of the last byte.
+@treturn string The substring.
+*/
+static int bufflib_sub(lua_State *L) {
+	Buffer *B = getrawbuffer(L, 1);
+	size_t start, end;
+	if (!rangeargs(L, 2, B->n, &start, &end)) {
+		lua_pushliteral(L, "");
+	} else if (B->flags & BUFFER_GAPOPEN && end > B->gap) {
+		size_t gaplen = B->size - B->n;
+		if (start >= B->gap) { /* After the gap */
+			lua_pushlstring(L, B->b + start + gaplen, end - start);
+		} else { /* Either side of the gap */
+			lua_pushlstring(L, B->b + start, B->gap - start);
+			lua_pushlstring(L, B->b + B->gap + gaplen, end - B->gap);
+			lua_concat(L, 2);
+		}
+	} else {
+		lua_pushlstring(L, B->b + start, end - start);
+	}
+	return 1;
+}
+
+/**
+Shortens the @{Buffer}'s contents to their first `n` bytes.
+Does nothing if the Buffer is already shorter than that. The Buffer keeps its storage, use @{Buffer:reset|`buff:reset`} to free it.
+
+@function truncate
+@int n The new length.
+@treturn Buffer The Buffer object.
+*/
+static int bufflib_truncate(lua_State *L) {
+	Buffer *B = getbuffer(L, 1);
+	lua_Integer n = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, n >= 0, 2, "must not be negative");
+	if ((size_t)n < B->n) {
+		ownbuffer(B); /* Otherwise the free space after the new end would be shared */
+		B->n = (size_t)n;
+		B->version++;
+	}
+	return pushbuffer(L, 1);
+}
+
+/**
+Inserts a string or the contents of a @{Buffer} into this Buffer so that it starts at position `pos`.
+Negative positions count back from the end, so -1 adds the value to the end of the Buffer.
+
+@function insert
+@int pos The position, from 1 to `#buff + 1`.
+@param s The string or Buffer to insert. Non-string values are converted following the same rules as `tostring()`.
+@treturn Buffer The Buffer object.
+*/
+static int bufflib_insert(lua_State *L) {
+	Buffer *B = getrawbuffer(L, 1);
+	Buffer *src;
+	lua_Integer pos = luaL_checkinteger(L, 2);
+	size_t len;
+	const char *s;
+	luaL_checkany(L, 3);
+	if (pos < 0)
+		pos = pos < -(lua_Integer)B->n - 1 ? 0 : (lua_Integer)B->n + pos + 2;
+	luaL_argcheck(L, pos >= 1 && pos <= (lua_Integer)B->n + 1, 2, "position out of bounds");
+
+	if (lua_touserdata(L, 3) == (void *)B) { /* Inserting the Buffer into itself, copy its contents first so they don't move while being copied */
+		closegap(B);
+		lua_pushlstring(L, B->b, B->n);
+		lua_replace(L, 3);
+	}
+	if ((src = testbuffer(L, 3)) != NULL) {
+		s = src->b;
+		len = src->n;
+	} else {
+		s = tolstring(L, 3, &len);
+	}
+
+	memcpy(openrange(B, (size_t)pos - 1, len), s, len * sizeof(char));
+	return pushbuffer(L, 1);
+}
+
+/**
+Removes the bytes from position `i` to `j` of the @{Buffer}, moving the bytes after them back.
+`i` and `j` are interpreted in the same way as the arguments of `string.sub`.
+
+@function remove
+@int i The position of the first byte to remove.
+@int[opt=i] j The position of the last byte to remove.
+@treturn Buffer The Buffer object.
+*/
+static int bufflib_remove(lua_State *L) {
+	Buffer *B = getrawbuffer(L, 1);
+	size_t start, end;
+	luaL_checkinteger(L, 2);
+	if (lua_isnoneornil(L, 3)) { /* Default j to i */
+		lua_settop(L, 2);
+		lua_pushvalue(L, 2);
+	}
+	if (rangeargs(L, 2, B->n, &start, &end))
+		closerange(B, start, end - start);
+	return pushbuffer(L, 1);
+}
+
+/* Returns the first occurrence of the len (> 0) bytes at s that starts from p to last, or NULL if there isn't one. The match may extend past last. */
+static const char *findplain(const char *p, const char *last, const char *s, size_t len) {
+	for (;;) {
+		p = (const char *)memchr(p, s[0], (size_t)(last - p) + 1);
+		if (p == NULL || memcmp(p + 1, s + 1, len - 1) == 0)
+			return p;
+		if (p++ == last)
+			return NULL;
+	}
+}
+
+/* A plain search split into chunks of start positions for runparallel */
+typedef struct FindTask {
+	const char *start, *s;
+	size_t nstarts, len, chunksize;
+	size_t found[POOL_MAXCHUNKS]; /* Set (atomically) once the chunk has found a match */
+	const char *matches[POOL_MAXCHUNKS]; /* The first match in each chunk, or NULL if there isn't one or the chunk was skipped */
+} FindTask;
+
+static void findchunk(void *ctx, size_t k) {
+	FindTask *t = (FindTask *)ctx;
+	const char *p = t->start + k * t->chunksize;
+	size_t j;
+	t->matches[k] = NULL;
+	for (j = 0; j < k; j++) {
+		if (atomic_load(&t->found[j])) /* An earlier chunk has a match, so this one can't be the first */
+			return;
+	}
+	t->matches[k] = findplain(p, p + chunklen(t->nstarts, t->chunksize, k) - 1, t->s, t->len);
+	if (t->matches[k] != NULL)
+		atomic_fetchor(&t->found[k], 1);
+}
+
+/**
+Finds the first occurrence of a string in the @{Buffer}, without copying its contents.
+This is a plain search, like `buff:s_find(s, init, true)`; no characters are treated as pattern characters.
+
+@function find
+@param s The string or Buffer to search for.
+@int[opt=1] init The position to start searching from. Negative values count back from the end.
+@treturn int The position of the first byte of the match, or nil if there isn't one.
+@treturn int The position of the last byte of the match.
+*/
+static int bufflib_find(lua_State *L) {
+	Buffer *B = getbuffer(L, 1);
+	size_t len;
+	const char *s = checkbytes(L, 2, &len);
+	lua_Integer init = posrelat(luaL_optinteger(L, 3, 1), B->n);
+	const char *p;
+	if (init < 1)
+		init = 1;
+	if (init > (lua_Integer)B->n + 1 || len > B->n - (size_t)(init - 1)) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	p = B->b + init - 1;
+	if (len > 0) {
+		FindTask t;
+		size_t nchunks, k;
+		t.start = p;
+		t.s = s;
+		t.len = len;
+		t.nstarts = B->n - len - (size_t)(init - 1) + 1; /* The positions a match can start at */
+		nchunks = poolchunks(t.nstarts, &t.chunksize);
+		memset(t.found, 0, nchunks * sizeof(size_t));
+		runparallel(findchunk, &t, nchunks);
+		p = NULL;
+		for (k = 0; k < nchunks && p == NULL; k++)
+			p = t.matches[k];
+		if (p == NULL) {
+			lua_pushnil(L);
+			return 1;
+		}
+	}
+
+	lua_pushinteger(L, (lua_Integer)(p - B->b) + 1);
+	lua_pushinteger(L, (lua_Integer)(p - B->b) + (lua_Integer)len);
+	return 2;
+}
+
+/*
+	Lua source serialisation (buff:addlua).
+	Tables that are referenced more than once (including cycles) can't be written as nested constructors, so if there are any the value is written as a function call
+	that creates the shared tables first and then fills them in:
+
+		(function() local t = {} t[1] = {} t[1].self = t[1] return t[1] end)()
+*/
+
+/* Maximum nesting of table constructors */
+#define SERIALISE_MAXDEPTH 200
+
+#if LUA_VERSION_NUM >= 503
+#define isinteger(L, i) lua_isinteger(L, (i))
+#else
+#define isinteger(L, i) 0
+#endif
+
+typedef struct Serialiser {
+	lua_State *L;
+	Buffer *B;
+	int seen; /* index of the table mapping each table to the number of references to it */
+	int order; /* index of the array of tables in the order countrefs first reached them */
+	int ntables; /* number of tables in order */
+	int ids; /* index of the table mapping each shared table to its index in t */
+	int sort; /* sort keys? */
+	int depth;
+} Serialiser;
+
+/* Adds a NUL-terminated string to the Buffer */
+static void addcstring(Buffer *B, const char *s) {
+	size_t len = strlen(s);
+	memcpy(prepbuffsize(B, len), s, len);
+	addsize(B, len);
+}
+
+/* Adds a quoted Lua string literal to the Buffer */
+static void addluastring(Buffer *B, const unsigned char *s, size_t len) {
+	size_t i, start = 0;
+	char *b;
+	*prepbuffsize(B, 1) = '"';
+	addsize(B, 1);
+	for (i = 0; i < len; i++) { /* Copy runs of bytes that don't need escaping in one go */
+		unsigned char c = s[i];
+		char esc[5];
+		size_t esclen = 2;
+		if (c >= 0x20 && c != '"' && c != '\\' && c != 0x7f)
+			continue;
+		esc[0] = '\\';
+		switch (c) {
+			case '"': esc[1] = '"'; break;
+			case '\\': esc[1] = '\\'; break;
+			case '\n': esc[1] = 'n'; break;
+			case '\r': esc[1] = 'r'; break;
+			case '\t': esc[1] = 't'; break;
+			default: /* Always 3 digits, so a following digit can't be read as part of the escape */
+				esc[1] = (char)('0' + c / 100);
+				esc[2] = (char)('0' + c / 10 % 10);
+				esc[3] = (char)('0' + c % 10);
+				esclen = 4;
+				break;
+		}
+		b = prepbuffsize(B, i - start + esclen);
+		memcpy(b, s + start, i - start);
+		memcpy(b + (i - start), esc, esclen);
+		addsize(B, i - start + esclen);
+		start = i + 1;
+	}
+	b = prepbuffsize(B, len - start + 1);
+	memcpy(b, s + start, len - start);
+	b[len - start] = '"';
+	addsize(B, len - start + 1);
+}
+
+/* Adds the number at index i to the Buffer so that it reads back as exactly the same value */
+static void addluanumber(lua_State *L, Buffer *B, int i) {
+	char s[64];
+	lua_Number x = lua_tonumber(L, i);
+	if (isinteger(L, i)) {
+		size_t len;
+		const char *str;
+#if LUA_VERSION_NUM >= 503
+		if (lua_tointeger(L, i) == (lua_Integer)((~(lua_Unsigned)0 >> 1) + 1)) { /* The minimum integer's literal would be read as a float */
+			sprintf(s, "(" LUA_INTEGER_FMT "-1)", (LUAI_UACINT)(lua_tointeger(L, i) + 1));
+			addcstring(B, s);
+			return;
+		}
+#endif
+		lua_pushvalue(L, i);
+		str = lua_tolstring(L, -1, &len); /* Integers convert to strings exactly */
+		memcpy(prepbuffsize(B, len), str, len);
+		addsize(B, len);
+		lua_pop(L, 1);
+		return;
+	}
+	if (x != x) {
+		addcstring(B, "(0/0)");
+		return;
+	} else if (x - x != 0) { /* Infinite */
+		addcstring(B, x > 0 ? "(1/0)" : "(-1/0)");
+		return;
+	}
+	sprintf(s, "%.15g", (double)x);
+	if (strtod(s, NULL) != (double)x) /* Use the shortest of the two formats that reads back as the same value */
+		sprintf(s, "%.17g", (double)x);
+#if LUA_VERSION_NUM >= 503
+	if (strpbrk(s, ".en") == NULL) /* Keep floats with integral values floats */
+		strcat(s, ".0");
+#endif
+	addcstring(B, s);
+}
+
+/* Is the string a valid Lua identifier (and not a reserved word)? */
+static int isidentifier(const char *s, size_t len) {
+	static const char *const reserved[] = {
+		"and", "break", "do", "else", "elseif", "end", "false", "for", "function", "goto", "if", "in",
+		"local", "nil", "not", "or", "repeat", "return", "then", "true", "until", "while", NULL
+	};
+	const char *const *r;
+	size_t i;
+	if (len == 0 || (s[0] >= '0' && s[0] <= '9'))
+		return 0;
+	for (i = 0; i < len; i++) {
+		char c = s[i];
+		if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_'))
+			return 0;
+	}
+	for (r = reserved; *r != NULL; r++) {
+		if (strlen(*r) == len && memcmp(*r, s, len) == 0)
+			return 0;
+	}
+	return 1;
+}
+
+static void addluavalue(Serialiser *S, int i);
+
+/* A key of a table being serialised, used to sort the keys */
+typedef struct SortKey {
+	int type;
+	lua_Number num;
+	const char *s;
+	size_t len;
+	int index; /* the key's index in the keys table */
+} SortKey;
+
+/* Compares two SortKeys: numbers, then strings, then booleans, then anything else in the order they were found */
+static int comparekeys(const void *a, const void *b) {
+	const SortKey *x = (const SortKey *)a, *y = (const SortKey *)b;
+	static const int order[] = {9, 2, 9, 0, 1}; /* nil, boolean, lightuserdata, number, string; everything else sorts last */
+	int ox = x->type <= LUA_TSTRING ? order[x->type] : 9, oy = y->type <= LUA_TSTRING ? order[y->type] : 9;
+	if (ox != oy)
+		return ox < oy ? -1 : 1;
+	if (x->type == LUA_TNUMBER && x->num != y->num)
+		return x->num < y->num ? -1 : 1;
+	if (x->type == LUA_TSTRING) {
+		int c = memcmp(x->s, y->s, x->len < y->len ? x->len : y->len);
+		if (c != 0)
+			return c;
+		if (x->len != y->len)
+			return x->len < y->len ? -1 : 1;
+	}
+	if (x->type == LUA_TBOOLEAN && x->num != y->num)
+		return x->num < y->num ? -1 : 1;
+	return x->index < y->index ? -1 : (x->index > y->index);
+}
+
+/* Adds a key of a table constructor or assignment ("name" or "[key]") for the key at index k */
+static void addluakey(Serialiser *S, int k, int field) {
+	Buffer *B = S->B;
+	if (lua_type(S->L, k) == LUA_TSTRING) {
+		size_t len;
+		const char *s = lua_tolstring(S->L, k, &len);
+		if (isidentifier(s, len)) {
+			char *b = prepbuffsize(B, len + 1);
+			if (field)
+				*b++ = '.';
+			memcpy(b, s, len);
+			addsize(B, len + (field ? 1 : 0));
+			return;
+		}
+	}
+	addcstring(B, "[");
+	addluavalue(S, k);
+	addcstring(B, "]");
+}
+
+/* Is the number at index k an integer from 1 to n? */
+static int isarrayindex(lua_State *L, int k, lua_Integer n) {
+	lua_Number x = lua_tonumber(L, k);
+	return x >= 1 && x <= (lua_Number)n && x == (lua_Number)(lua_Integer)x;
+}
+
+/*
+	Calls fn for each key of the table at index i that isn't part of its array part (the first n integer keys) with the key and value at the top of the stack,
+	in sorted order if the Serialiser sorts keys.
+*/
+static void eachkey(Serialiser *S, int i, lua_Integer n, void (*fn)(Serialiser *S, int k, int v, void *ud), void *ud) {
+	lua_State *L = S->L;
+	int top = lua_gettop(L);
+	if (!S->sort) {
+		lua_pushnil(L);
+		while (lua_next(L, i) != 0) {
+			if (!(lua_type(L, -2) == LUA_TNUMBER && isarrayindex(L, -2, n)))
+				fn(S, top + 1, top + 2, ud);
+			lua_settop(L, top + 1);
+		}
+	} else {
+		SortKey *keys;
+		int count = 0, k, ktab;
+		lua_newtable(L); /* The keys, kept here so their strings stay alive */
+		ktab = lua_gettop(L);
+		lua_pushnil(L);
+		while (lua_next(L, i) != 0) {
+			lua_pop(L, 1);
+			if (lua_type(L, -1) == LUA_TNUMBER && isarrayindex(L, -1, n))
+				continue;
+			lua_pushvalue(L, -1);
+			lua_rawseti(L, ktab, ++count);
+		}
+		keys = (SortKey *)newudata(L, (count > 0 ? count : 1) * sizeof(SortKey));
+		for (k = 0; k < count; k++) {
+			lua_rawgeti(L, ktab, k + 1);
+			keys[k].type = lua_type(L, -1);
+			keys[k].num = keys[k].type == LUA_TBOOLEAN ? (lua_Number)lua_toboolean(L, -1) : lua_tonumber(L, -1);
+			keys[k].s = keys[k].type == LUA_TSTRING ? lua_tolstring(L, -1, &keys[k].len) : NULL;
+			keys[k].index = k + 1;
+			lua_pop(L, 1);
+		}
+		qsort(keys, (size_t)count, sizeof(SortKey), comparekeys);
+		for (k = 0; k < count; k++) {
+			int base = lua_gettop(L);
+			lua_rawgeti(L, ktab, keys[k].index);
+			lua_pushvalue(L, -1);
+			lua_rawget(L, i);
+			fn(S, base + 1, base + 2, ud);
+			lua_settop(L, base);
+		}
+	}
+	lua_settop(L, top);
+}
+
+/* Adds a field of a table constructor */
+static void addluafield(Serialiser *S, int k, int v, void *ud) {
+	int *first = (int *)ud;
+	if (!*first)
+		addcstring(S->B, ",");
+	*first = 0;
+	addluakey(S, k, 0);
+	addcstring(S->B, "=");
+	addluavalue(S, v);
+}
+
+/* Returns the length of the array part of the table at index i: the number of non-nil values from 1 onwards */
+static lua_Integer arraylength(lua_State *L, int i) {
+	lua_Integer n = 0;
+	for (;;) {
+		int isnil;
+		lua_rawgeti(L, i, (int)(n + 1));
+		isnil = lua_isnil(L, -1);
+		lua_pop(L, 1);
+		if (isnil)
+			return n;
+		n++;
+	}
+}
+
+static void countrefs(Serialiser *S, int i);
+
+/* Counts the references to the tables in a field found by eachkey */
+static void countfieldrefs(Serialiser *S, int k, int v, void *ud) {
+	(void)ud;
+	if (lua_istable(S->L, k))
+		countrefs(S, k);
+	if (lua_istable(S->L, v))
+		countrefs(S, v);
+}
+
+/*
+	Counts the references to the table at index i and every table reachable from it.
+	The tables are visited in the same order addluavalue writes them (sorted if the Serialiser sorts keys), and added to the order array when they're first reached.
+*/
+static void countrefs(Serialiser *S, int i) {
+	lua_State *L = S->L;
+	lua_Integer count, n, k;
+	lua_pushvalue(L, i);
+	lua_rawget(L, S->seen);
+	count = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	lua_pushvalue(L, i);
+	lua_pushinteger(L, count + 1);
+	lua_rawset(L, S->seen);
+	if (count > 0) /* Already visited */
+		return;
+	lua_pushvalue(L, i);
+	lua_rawseti(L, S->order, ++S->ntables);
+
+	if (++S->depth > SERIALISE_MAXDEPTH)
+		luaL_error(L, "table nesting too deep to serialise");
+	luaL_checkstack(L, 8, "table nesting too deep to serialise");
+	n = arraylength(L, i);
+	for (k = 1; k <= n; k++) {
+		lua_rawgeti(L, i, (int)k);
+		if (lua_istable(L, -1))
+			countrefs(S, lua_gettop(L));
+		lua_pop(L, 1);
+	}
+	eachkey(S, i, n, countfieldrefs, NULL);
+	S->depth--;
+}
+
+/* Adds the value at index i as a Lua expression */
+static void addluavalue(Serialiser *S, int i) {
+	lua_State *L = S->L;
+	Buffer *B = S->B;
+	size_t len;
+	const char *s;
+
+	switch (lua_type(L, i)) {
+		case LUA_TNIL:
+			addcstring(B, "nil");
+			break;
+		case LUA_TBOOLEAN:
+			addcstring(B, lua_toboolean(L, i) ? "true" : "false");
+			break;
+		case LUA_TNUMBER:
+			addluanumber(L, B, i);
+			break;
+		case LUA_TSTRING:
+			s = lua_tolstring(L, i, &len);
+			addluastring(B, (const unsigned char *)s, len);
+			break;
+		case LUA_TTABLE: {
+			lua_Integer n, k;
+			int first = 1;
+			if (S->ids != 0) {
+				lua_pushvalue(L, i);
+				lua_rawget(L, S->ids);
+				if (!lua_isnil(L, -1)) { /* A shared table, refer to it in t */
+					char ref[32];
+					sprintf(ref, "t[%d]", (int)lua_tointeger(L, -1));
+					lua_pop(L, 1);
+					addcstring(B, ref);
+					return;
+				}
+				lua_pop(L, 1);
+			}
+			if (++S->depth > SERIALISE_MAXDEPTH)
+				luaL_error(L, "table nesting too deep to serialise");
+			luaL_checkstack(L, 8, "table nesting too deep to serialise");
+			addcstring(B, "{");
+			n = arraylength(L, i);
+			for (k = 1; k <= n; k++) {
+				if (!first)
+					addcstring(B, ",");
+				first = 0;
+				lua_rawgeti(L, i, (int)k);
+				addluavalue(S, lua_gettop(L));
+				lua_pop(L, 1);
+			}
+			eachkey(S, i, n, addluafield, &first);
+			addcstring(B, "}");
+			S->depth--;
+			break;
+		}
+		default:
+			luaL_error(L, "cannot serialise a %s value", luaL_typename(L, i));
+	}
+}
+
+/* Adds an assignment of a field of shared table number *ud */
+static void addluaassignment(Serialiser *S, int k, int v, void *ud) {
+	char ref[32];
+	sprintf(ref, " t[%d]", *(int *)ud);
+	addcstring(S->B, ref);
+	addluakey(S, k, 1);
+	addcstring(S->B, "=");
+	addluavalue(S, v);
+}
+
+/**
+Adds a value to the @{Buffer} as a Lua expression that evaluates to an equivalent value, such that `load("return " .. s)()` recreates it.
+Strings are quoted and escaped, numbers are written so they read back exactly (keeping the integer/float distinction on Lua 5.3 and later) and tables are written as constructors.
+Tables that are referenced more than once, including cyclic references, are recreated with the same sharing: if there are any, the value is written as a call to an anonymous function that builds the tables.
+Functions, userdata and threads can't be serialised.
+
+@function addlua
+@param value The value to serialise.
+@tab[opt] opts Options: `sort` (boolean) sorts table keys (numbers, then strings, then booleans) so the same table always produces the same output.
+@treturn Buffer The Buffer object.
+@error Raises an error if the value contains values that can't be serialised.
+*/
+static int bufflib_addlua(lua_State *L) {
+	Buffer *B = getbuffer(L, 1);
+	Serialiser S;
+	int nshared = 0, i;
+
+	luaL_checkany(L, 2);
+	S.L = L;
+	S.B = B;
+	S.sort = 0;
+	S.depth = 0;
+	S.ids = 0;
+	if (!lua_isnoneornil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TTABLE);
+		lua_getfield(L, 3, "sort");
+		S.sort = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+	}
+	lua_settop(L, 2);
+
+	if (!lua_istable(L, 2)) {
+		addluavalue(&S, 2);
+		return pushbuffer(L, 1);
+	}
+
+	lua_newtable(L); /* seen at 3 */
+	lua_newtable(L); /* order at 4 */
+	S.seen = 3;
+	S.order = 4;
+	S.ntables = 0;
+	countrefs(&S, 2);
+
+	/* Number the shared tables in the order they were reached, moving them to the start of order so order[id] is table id */
+	lua_newtable(L); /* ids at 5 */
+	for (i = 1; i <= S.ntables; i++) {
+		int shared;
+		lua_rawgeti(L, 4, i);
+		lua_pushvalue(L, -1);
+		lua_rawget(L, 3);
+		shared = lua_tointeger(L, -1) > 1;
+		lua_pop(L, 1);
+		if (shared) {
+			lua_pushvalue(L, -1);
+			lua_rawseti(L, 4, ++nshared);
+			lua_pushinteger(L, nshared);
+			lua_rawset(L, 5);
+		} else {
+			lua_pop(L, 1);
+		}
+	}
+
+	if (nshared == 0) {
+		addluavalue(&S, 2);
+		return pushbuffer(L, 1);
+	}
+
+	/* Create the shared tables, then fill them in (so any of them can refer to any other), then return the value */
+	S.ids = 5;
+	addcstring(B, "(function() local t = {}");
+	for (i = 1; i <= nshared; i++) {
+		char ref[48];
+		sprintf(ref, " t[%d] = {}", i);
+		addcstring(B, ref);
+	}
+	for (i = 1; i <= nshared; i++) {
+		int id = i, t;
+		lua_Integer n, k;
+		lua_rawgeti(L, 4, i);
+		t = lua_gettop(L);
+		n = arraylength(L, t);
+		for (k = 1; k <= n; k++) {
+			char ref[64];
+			sprintf(ref, " t[%d][%ld]=", id, (long)k);
+			addcstring(B, ref);
+			lua_rawgeti(L, t, (int)k);
+			addluavalue(&S, lua_gettop(L));
+			lua_pop(L, 1);
+		}
+		eachkey(&S, t, n, addluaassignment, &id);
+		lua_pop(L, 1);
+	}
+	addcstring(B, " return ");
+	addluavalue(&S, 2);
+	addcstring(B, " end)()");
+	return pushbuffer(L, 1);
+}
+
+/*
+	MessagePack (https://github.com/msgpack/msgpack/blob/master/spec.md).
+	64-bit integers are handled as two 32-bit halves so this works on every Lua version, including those where numbers are always doubles.
+*/
+
+/* Maximum nesting of arrays and maps */
+#define MSGPACK_MAXDEPTH 200
+
+/* Is the host little-endian? */
+static int islittleendian(void) {
+	const U32 one = 1;
+	return *(const unsigned char *)&one == 1;
+}
+
+/* Writes len bytes of the value at v (in host byte order) big-endian at b */
+static void writebe(unsigned char *b, const void *v, size_t len) {
+	const unsigned char *p = (const unsigned char *)v;
+	size_t i;
+	for (i = 0; i < len; i++)
+		b[i] = islittleendian() ? p[len - 1 - i] : p[i];
+}
+
+/* Reads len big-endian bytes at b into the value at v (in host byte order) */
+#define readbe(v, b, len) writebe((unsigned char *)(v), (b), (len))
+
+/* Writes the low len (1, 2 or 4) bytes of v big-endian at b */
+static void putuint(unsigned char *b, U32 v, size_t len) {
+	size_t i;
+	for (i = 0; i < len; i++)
+		b[i] = (unsigned char)(v >> (8 * (len - 1 - i)));
+}
+
+/* Writes a type byte followed by a len-byte big-endian value and returns the number of bytes written */
+static size_t putheader(unsigned char *b, unsigned type, U32 v, size_t len) {
+	b[0] = (unsigned char)type;
+	putuint(b + 1, v, len);
+	return len + 1;
+}
+
+/* Adds the smallest header for a string, array or map of n elements; fix is the type byte of the fix format and limit its maximum */
+static void addmsgpackheader(Buffer *B, size_t n, unsigned fix, size_t fixmax, unsigned type8, unsigned type16, unsigned type32) {
+	unsigned char *b = (unsigned char *)prepbuffsize(B, 5);
+	if (n <= fixmax)
+		b[0] = (unsigned char)(fix | n), addsize(B, 1);
+	else if (n <= 0xff && type8 != 0)
+		addsize(B, putheader(b, type8, (U32)n, 1));
+	else if (n <= 0xffff)
+		addsize(B, putheader(b, type16, (U32)n, 2));
+	else if (n <= 0xffffffffU)
+		addsize(B, putheader(b, type32, (U32)n, 4));
+	else
+		luaL_error(B->L, "string or table too large for MessagePack");
+}
+
+/*
+	Gets the high and low halves of the 64-bit two's complement representation of the integer at index i.
+	Returns 1 if it's non-negative, -1 if it's negative or 0 if the value isn't a number with an integral value that fits in 64 bits.
+	Without integers (Lua 5.1 and 5.2) numbers from -2^63 up to 2^64 are accepted, so unsigned 64-bit values can be used.
+*/
+static int toint64(lua_State *L, int i, U32 *hi, U32 *lo) {
+#if LUA_VERSION_NUM >= 503
+	int isnum;
+	lua_Integer v = lua_tointegerx(L, i, &isnum);
+	lua_Unsigned u = (lua_Unsigned)v;
+	*hi = *lo = 0;
+	if (!isnum || lua_type(L, i) != LUA_TNUMBER)
+		return 0;
+	*hi = (U32)((u >> 16 >> 16) & 0xffffffffU);
+	*lo = (U32)(u & 0xffffffffU);
+	return v < 0 ? -1 : 1;
+#else
+	lua_Number x = lua_tonumber(L, i), m;
+	*hi = *lo = 0;
+	if (!(x >= -9223372036854775808.0 && x < 18446744073709551616.0 && x == floor(x)) || lua_type(L, i) != LUA_TNUMBER)
+		return 0;
+	m = x < 0 ? -x : x;
+	*hi = (U32)(m / 4294967296.0);
+	*lo = (U32)(m - (lua_Number)*hi * 4294967296.0);
+	if (x < 0) { /* Two's complement */
+		*lo = (~*lo + 1) & 0xffffffffU;
+		*hi = (~*hi + (*lo == 0)) & 0xffffffffU;
+	}
+	return x < 0 ? -1 : 1;
+#endif
+}
+
+/* Adds an integer given as its sign and the high and low halves of its 64-bit two's complement representation */
+static void addmsgpackint(Buffer *B, int neg, U32 hi, U32 lo) {
+	unsigned char *b = (unsigned char *)prepbuffsize(B, 9);
+	if (!neg) {
+		if (hi != 0) {
+			putheader(b, 0xcf, hi, 4);
+			putuint(b + 5, lo, 4);
+			addsize(B, 9);
+		} else if (lo <= 0x7f) {
+			b[0] = (unsigned char)lo;
+			addsize(B, 1);
+		} else if (lo <= 0xff) {
+			addsize(B, putheader(b, 0xcc, lo, 1));
+		} else if (lo <= 0xffff) {
+			addsize(B, putheader(b, 0xcd, lo, 2));
+		} else {
+			addsize(B, putheader(b, 0xce, lo, 4));
+		}
+	} else if (hi == 0xffffffffU && lo >= 0x80000000U) { /* Fits in 32 bits */
+		if (lo >= 0xffffffe0U) {
+			b[0] = (unsigned char)lo;
+			addsize(B, 1);
+		} else if (lo >= 0xffffff80U) {
+			addsize(B, putheader(b, 0xd0, lo & 0xff, 1));
+		} else if (lo >= 0xffff8000U) {
+			addsize(B, putheader(b, 0xd1, lo & 0xffff, 2));
+		} else {
+			addsize(B, putheader(b, 0xd2, lo, 4));
+		}
+	} else {
+		putheader(b, 0xd3, hi, 4);
+		putuint(b + 5, lo, 4);
+		addsize(B, 9);
+	}
+}
+
+/* Adds the number at index i: integers use the smallest integer format, other values a float32 if that's exact or a float64 */
+static void addmsgpacknumber(lua_State *L, Buffer *B, int i) {
+	lua_Number x = lua_tonumber(L, i);
+	unsigned char *b;
+	U32 hi, lo;
+	int sign;
+#if LUA_VERSION_NUM >= 503
+	if (lua_isinteger(L, i) && (sign = toint64(L, i, &hi, &lo)) != 0) {
+#else
+	if ((sign = toint64(L, i, &hi, &lo)) != 0) { /* Integral numbers are encoded as integers */
+#endif
+		addmsgpackint(B, sign < 0, hi, lo);
+		return;
+	}
+	b = (unsigned char *)prepbuffsize(B, 9);
+	if (x != x || x - x != 0 || (x >= -FLT_MAX && x <= FLT_MAX && (lua_Number)(float)x == x)) { /* NaN, infinite or exact as a float */
+		float f = (float)x;
+		b[0] = 0xca;
+		writebe(b + 1, &f, 4);
+		addsize(B, 5);
+	} else {
+		double d = (double)x;
+		b[0] = 0xcb;
+		writebe(b + 1, &d, 8);
+		addsize(B, 9);
+	}
+}
+
+/* Adds the value at index i */
+static void addmsgpackvalue(lua_State *L, Buffer *B, int i, int depth) {
+	const char *s;
+	size_t len;
+	Buffer *src;
+	unsigned char *b;
+
+	switch (lua_type(L, i)) {
+		case LUA_TNIL:
+			b = (unsigned char *)prepbuffsize(B, 1);
+			b[0] = 0xc0;
+			addsize(B, 1);
+			break;
+		case LUA_TBOOLEAN:
+			b = (unsigned char *)prepbuffsize(B, 1);
+			b[0] = lua_toboolean(L, i) ? 0xc3 : 0xc2;
+			addsize(B, 1);
+			break;
+		case LUA_TNUMBER:
+			addmsgpacknumber(L, B, i);
+			break;
+		case LUA_TSTRING:
+			s = lua_tolstring(L, i, &len);
+			goto addstr;
+		case LUA_TUSERDATA:
+			if ((src = testbuffer(L, i)) == NULL)
+				goto unsupported;
+			if (src == B) { /* Adding the Buffer to itself, copy its contents first */
+				lua_pushlstring(L, B->b, B->n);
+				lua_replace(L, i);
+				s = lua_tolstring(L, i, &len);
+			} else {
+				s = src->b;
+				len = src->n;
+			}
+		addstr:
+			addmsgpackheader(B, len, 0xa0, 31, 0xd9, 0xda, 0xdb);
+			memcpy(prepbuffsize(B, len), s, len);
+			addsize(B, len);
+			break;
+		case LUA_TTABLE: {
+			size_t count = 0;
+			lua_Integer n, k;
+			if (depth > MSGPACK_MAXDEPTH)
+				luaL_error(L, "table nesting too deep for MessagePack (or the table is cyclic)");
+			luaL_checkstack(L, 4, "table nesting too deep for MessagePack");
+			lua_pushnil(L);
+			while (lua_next(L, i) != 0) {
+				count++;
+				lua_pop(L, 1);
+			}
+			n = arraylength(L, i);
+			if ((size_t)n == count) { /* Only has keys from 1 to n, encode it as an array (empty tables are empty arrays) */
+				addmsgpackheader(B, count, 0x90, 15, 0, 0xdc, 0xdd);
+				for (k = 1; k <= n; k++) {
+					lua_rawgeti(L, i, (int)k);
+					addmsgpackvalue(L, B, lua_gettop(L), depth + 1);
+					lua_pop(L, 1);
+				}
+			} else {
+				addmsgpackheader(B, count, 0x80, 15, 0, 0xde, 0xdf);
+				lua_pushnil(L);
+				while (lua_next(L, i) != 0) {
+					int top = lua_gettop(L);
+					addmsgpackvalue(L, B, top - 1, depth + 1);
+					addmsgpackvalue(L, B, top, depth + 1);
+					lua_settop(L, top - 1);
+				}
+			}
+			break;
+		}
+		default:
+		unsupported:
+			luaL_error(L, "cannot encode a %s value as MessagePack", luaL_typename(L, i));
+	}
+}
+
+/**
+Adds some values to the @{Buffer}, each encoded as a MessagePack message.
+Integers and the headers of strings, arrays and maps use the smallest format that fits. Floats are encoded as float 32 if that's exact, otherwise as float 64.
+Strings and Buffers are encoded as str. Tables whose keys are exactly 1 to n are encoded as arrays (so empty tables are empty arrays), other tables as maps.
+
+@function addmsgpack
+@param ... The values to encode.
+@treturn Buffer The Buffer object.
+@error Raises an error for functions, threads, userdata other than Buffers and cyclic tables.
+*/
+static int bufflib_addmsgpack(lua_State *L) {
+	Buffer *B = getbuffer(L, 1);
+	int i, numargs = lua_gettop(L);
+	for (i = 2; i <= numargs; i++)
+		addmsgpackvalue(L, B, i, 0);
+	return pushbuffer(L, 1);
+}
+
+/* Reads an unsigned big-endian integer of len (1, 2 or 4) bytes */
+static U32 readuint(const unsigned char *p, size_t len) {
+	U32 v = 0;
+	size_t i;
+	for (i = 0; i < len; i++)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+/* Pushes a 64-bit integer given as its high and low halves, as a float if it doesn't fit in a lua_Integer */
+static void pushint64(lua_State *L, U32 hi, U32 lo, int issigned) {
+	int neg = issigned && (hi & 0x80000000U);
+#if LUA_VERSION_NUM >= 503
+	lua_Unsigned u = ((lua_Unsigned)hi << 16 << 16) | lo;
+	if (neg || u <= (~(lua_Unsigned)0 >> 1)) {
+		lua_pushinteger(L, (lua_Integer)u);
+		return;
+	}
+#endif
+	if (neg) {
+		lo = (~lo + 1) & 0xffffffffU;
+		hi = (~hi + (lo == 0)) & 0xffffffffU;
+		lua_pushnumber(L, -((lua_Number)hi * 4294967296.0 + (lua_Number)lo));
+	} else {
+		lua_pushnumber(L, (lua_Number)hi * 4294967296.0 + (lua_Number)lo);
+	}
+}
+
+/*
+	Decodes the message at p (with end at end) and pushes its value.
+	Returns a pointer to the byte after the message or NULL if the message is incomplete, in which case nothing is pushed.
+*/
+static const unsigned char *unpackmsgvalue(lua_State *L, const unsigned char *p, const unsigned char *end, int depth) {
+	unsigned c;
+	size_t len, n = 0, k;
+	int ismap = 0;
+
+#define need(count) if ((size_t)(end - p) < (size_t)(count)) return NULL
+
+	need(1);
+	c = *p++;
+	if (c <= 0x7f) {
+		lua_pushinteger(L, (lua_Integer)c);
+		return p;
+	} else if (c >= 0xe0) {
+		lua_pushinteger(L, (lua_Integer)c - 256);
+		return p;
+	} else if (c >= 0xa0 && c <= 0xbf) {
+		len = c & 0x1f;
+		goto str;
+	} else if (c >= 0x90 && c <= 0x9f) {
+		n = c & 0x0f;
+		goto array;
+	} else if (c >= 0x80 && c <= 0x8f) {
+		n = c & 0x0f;
+		ismap = 1;
+		goto array;
+	}
+
+	switch (c) {
+		case 0xc0: lua_pushnil(L); return p;
+		case 0xc2: lua_pushboolean(L, 0); return p;
+		case 0xc3: lua_pushboolean(L, 1); return p;
+		case 0xcc: need(1); lua_pushinteger(L, (lua_Integer)p[0]); return p + 1;
+		case 0xcd: need(2); lua_pushinteger(L, (lua_Integer)readuint(p, 2)); return p + 2;
+		case 0xce: need(4); pushint64(L, 0, readuint(p, 4), 0); return p + 4;
+		case 0xcf: need(8); pushint64(L, readuint(p, 4), readuint(p + 4, 4), 0); return p + 8;
+		case 0xd0: need(1); lua_pushinteger(L, (lua_Integer)(signed char)p[0]); return p + 1;
+		case 0xd1: need(2); lua_pushinteger(L, (lua_Integer)readuint(p, 2) - (p[0] & 0x80 ? 0x10000 : 0)); return p + 2;
+		case 0xd2: need(4); pushint64(L, p[0] & 0x80 ? 0xffffffffU : 0, readuint(p, 4), 1); return p + 4;
+		case 0xd3: need(8); pushint64(L, readuint(p, 4), readuint(p + 4, 4), 1); return p + 8;
+		case 0xca: {
+			float f;
+			need(4);
+			readbe(&f, p, 4);
+			lua_pushnumber(L, (lua_Number)f);
+			return p + 4;
+		}
+		case 0xcb: {
+			double d;
+			need(8);
+			readbe(&d, p, 8);
+			lua_pushnumber(L, (lua_Number)d);
+			return p + 8;
+		}
+		case 0xc4: case 0xd9: need(1); len = p[0]; p += 1; goto str; /* bin 8 and str 8 */
+		case 0xc5: case 0xda: need(2); len = readuint(p, 2); p += 2; goto str;
+		case 0xc6: case 0xdb: need(4); len = readuint(p, 4); p += 4; goto str;
+		case 0xdc: need(2); n = readuint(p, 2); p += 2; goto array;
+		case 0xdd: need(4); n = readuint(p, 4); p += 4; goto array;
+		case 0xde: need(2); n = readuint(p, 2); p += 2; ismap = 1; goto array;
+		case 0xdf: need(4); n = readuint(p, 4); p += 4; ismap = 1; goto array;
+		case 0xc1:
+			luaL_error(L, "invalid MessagePack data (type 0xc1)");
+			break;
+		default:
+			luaL_error(L, "unsupported MessagePack extension type 0x%x", c);
+	}
+	return NULL;
+
+str:
+	need(len);
+	lua_pushlstring(L, (const char *)p, len);
+	return p + len;
+
+array:
+	if (depth > MSGPACK_MAXDEPTH)
+		luaL_error(L, "MessagePack data nested too deeply");
+	luaL_checkstack(L, 4, "MessagePack data nested too deeply");
+	need(n); /* Every element takes at least a byte, so this rejects impossible lengths before allocating */
+	if (ismap)
+		lua_createtable(L, 0, n > 0xffff ? 0xffff : (int)n);
+	else
+		lua_createtable(L, n > 0xffff ? 0xffff : (int)n, 0);
+	for (k = 1; k <= n; k++) {
+		if (ismap) {
+			if ((p = unpackmsgvalue(L, p, end, depth + 1)) == NULL) {
+				lua_pop(L, 1);
+				return NULL;
+			}
+			if (lua_isnil(L, -1) || (lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) != lua_tonumber(L, -1)))
+				luaL_error(L, "invalid MessagePack map key (nil or NaN)");
+		}
+		if ((p = unpackmsgvalue(L, p, end, depth + 1)) == NULL) {
+			lua_pop(L, ismap ? 2 : 1);
+			return NULL;
+		}
+		if (ismap)
+			lua_rawset(L, -3);
+		else
+			lua_rawseti(L, -2, (int)k);
+	}
+	return p;
+
+#undef need
+}
+
+/**
+Decodes a MessagePack message from the @{Buffer}, without copying its contents.
+Concatenated messages (e.g. a stream) can be decoded one at a time by passing the returned position back in.
+bin values are decoded as strings. Extension types aren't supported.
+
+	local pos = 1
+	while true do
+		local value, nextpos = buff:unpackmsg(pos)
+		if not nextpos then break end -- Wait for the rest of the message
+		handle(value)
+		pos = nextpos
+	end
+
+@function unpackmsg
+@int[opt=1] pos The position of the message in the Buffer.
+@return The decoded value, or nil if the Buffer ends before the message does.
+@treturn int The position after the message, or nil if the message is incomplete.
+@error Raises an error if the data isn't valid MessagePack.
+*/
+static int bufflib_unpackmsg(lua_State *L) {
+	size_t len;
+	const unsigned char *s = (const unsigned char *)checkbytes(L, 1, &len);
+	lua_Integer pos = luaL_optinteger(L, 2, 1);
+	const unsigned char *next;
+	luaL_argcheck(L, pos >= 1 && (size_t)pos <= len + 1, 2, "out of range");
+
+	next = unpackmsgvalue(L, s + pos - 1, s + len, 0);
+	if (next == NULL) {
+		lua_pushnil(L);
+		return 1;
+	}
+	lua_pushinteger(L, (lua_Integer)(next - s) + 1);
+	return 2;
+}
+
+/*
+	CSV.
+	Fields are scanned a machine word at a time (SWAR) for the bytes that force quoting; fields without them are copied as they are.
+*/
+
+/* The high bit of each byte of x is set if the byte is zero (exactly, without false positives) */
+#define ZEROBYTES(x) (~((((x) & ~HIGHBITS) + ~HIGHBITS) | (x)) & HIGHBITS)
+
+typedef struct CSVOptions {
+	unsigned char delim, quote;
+	const char *eol;
+	size_t eollen;
+} CSVOptions;
+
+/* Returns the offset of the first byte in s that forces the field to be quoted (the delimiter, quote, CR or LF) or len if there isn't one */
+static size_t csvspecial(const unsigned char *s, size_t len, const CSVOptions *opts) {
+	const size_t d = opts->delim * ONEBYTES, q = opts->quote * ONEBYTES, cr = '\r' * ONEBYTES, lf = '\n' * ONEBYTES;
+	size_t i = 0;
+	for (; i + sizeof(size_t) <= len; i += sizeof(size_t)) {
+		size_t w;
+		memcpy(&w, s + i, sizeof(w));
+		if ((ZEROBYTES(w ^ d) | ZEROBYTES(w ^ q) | ZEROBYTES(w ^ cr) | ZEROBYTES(w ^ lf)) != 0)
+			break;
+	}
+	for (; i < len; i++) {
+		if (s[i] == opts->delim || s[i] == opts->quote || s[i] == '\r' || s[i] == '\n')
+			return i;
+	}
+	return len;
+}
+
+/* Adds a field, quoting it (and doubling the quotes inside it) only if it has to be */
+static void addcsvfield(Buffer *B, const char *s, size_t len, const CSVOptions *opts) {
+	size_t special = csvspecial((const unsigned char *)s, len, opts);
+	const char *end = s + len, *q;
+	char *b;
+	if (special == len) {
+		memcpy(prepbuffsize(B, len), s, len);
+		addsize(B, len);
+		return;
+	}
+
+	b = prepbuffsize(B, special + 1);
+	b[0] = (char)opts->quote;
+	memcpy(b + 1, s, special);
+	addsize(B, special + 1);
+	for (s += special; (q = (const char *)memchr(s, opts->quote, (size_t)(end - s))) != NULL; s = q + 1) {
+		b = prepbuffsize(B, (size_t)(q - s) + 2);
+		memcpy(b, s, (size_t)(q - s) + 1);
+		b[q - s + 1] = (char)opts->quote;
+		addsize(B, (size_t)(q - s) + 2);
+	}
+	b = prepbuffsize(B, (size_t)(end - s) + 1);
+	memcpy(b, s, (size_t)(end - s));
+	b[end - s] = (char)opts->quote;
+	addsize(B, (size_t)(end - s) + 1);
+}
+
+/* Formats the number at index i the same way tostring does (with the default number format), without creating a string */
+static void addcsvnumber(lua_State *L, Buffer *B, int i, const CSVOptions *opts) {
+	char s[64];
+#if LUA_VERSION_NUM >= 503
+	if (lua_isinteger(L, i)) {
+		sprintf(s, LUA_INTEGER_FMT, (LUAI_UACINT)lua_tointeger(L, i));
+	} else {
+		sprintf(s, "%.14g", (double)lua_tonumber(L, i));
+		if (s[strspn(s, "-0123456789")] == '\0') /* Looks like an integer, add ".0" like tostring does */
+			strcat(s, ".0");
+	}
+#else
+	sprintf(s, "%.14g", (double)lua_tonumber(L, i));
+#endif
+	addcsvfield(B, s, strlen(s), opts);
+}
+
+/* Reads a single character option */
+static unsigned char csvcharopt(lua_State *L, int opts, const char *name, unsigned char def) {
+	unsigned char c = def;
+	lua_getfield(L, opts, name);
+	if (!lua_isnil(L, -1)) {
+		size_t len;
+		const char *s = lua_tolstring(L, -1, &len);
+		if (s == NULL || len != 1)
+			luaL_error(L, "option '%s' must be a single character", name);
+		c = (unsigned char)s[0];
+	}
+	lua_pop(L, 1);
+	return c;
+}
+
+/**
+Adds a row of CSV (or TSV, etc.) to the @{Buffer}: the values from `t[1]` to `t[t.n]` (or `t[#t]` if `t.n` is nil) separated by the delimiter and followed by the end of line.
+Fields are only quoted if they contain the delimiter, the quote character, CR or LF, and quotes inside them are doubled (RFC 4180).
+Numbers are formatted as by `tostring`, nil values are empty fields and Buffers are added by their contents.
+The length of a table with nil values isn't well defined, so rows with empty fields should set `n` (like `table.pack` does).
+
+	buff:addcsvrow({"id", "name"}):addcsvrow({1, 'say "hi"'}) -- id,name\r\n1,"say ""hi"""\r\n
+	buff:addcsvrow({"a", nil, "c", n = 3}, {delimiter = "\t", eol = "\n"}) -- a\t\tc\n
+
+@function addcsvrow
+@tab t The fields of the row, with an optional field count in `n`.
+@tab[opt] opts Options: `delimiter` (default `","`), `quote` (default `'"'`) and `eol` (default `"\r\n"`).
+@treturn Buffer The Buffer object.
+@error Raises an error if a field isn't a string, number, boolean, nil or Buffer.
+*/
+static int bufflib_addcsvrow(lua_State *L) {
+	Buffer *B = getbuffer(L, 1);
+	CSVOptions opts;
+	size_t n, k;
+
+	luaL_checktype(L, 2, LUA_TTABLE);
+	opts.delim = ',';
+	opts.quote = '"';
+	opts.eol = "\r\n";
+	opts.eollen = 2;
+	if (!lua_isnoneornil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TTABLE);
+		opts.delim = csvcharopt(L, 3, "delimiter", opts.delim);
+		opts.quote = csvcharopt(L, 3, "quote", opts.quote);
+		lua_getfield(L, 3, "eol"); /* Left on the stack so it stays valid */
+		if (!lua_isnil(L, -1) && (opts.eol = lua_tolstring(L, -1, &opts.eollen)) == NULL)
+			luaL_error(L, "option 'eol' must be a string");
+	}
+
+	lua_pushliteral(L, "n");
+	lua_rawget(L, 2);
+	if (lua_isnil(L, -1)) {
+		n = lua_rawlen(L, 2);
+	} else {
+		lua_Integer count = lua_tointeger(L, -1);
+		if (!lua_isnumber(L, -1) || (lua_Number)count != lua_tonumber(L, -1) || count < 0 || count > INT_MAX)
+			luaL_error(L, "field 'n' must be a non-negative integer");
+		n = (size_t)count;
+	}
+	lua_pop(L, 1);
+	for (k = 1; k <= n; k++) {
+		Buffer *src;
+		if (k > 1) {
+			*prepbuffsize(B, 1) = (char)opts.delim;
+			addsize(B, 1);
+		}
+		lua_rawgeti(L, 2, (int)k);
+		switch (lua_type(L, -1)) {
+			case LUA_TNIL:
+				break;
+			case LUA_TNUMBER:
+				addcsvnumber(L, B, lua_gettop(L), &opts);
+				break;
+			case LUA_TBOOLEAN:
+				addcsvfield(B, lua_toboolean(L, -1) ? "true" : "false", lua_toboolean(L, -1) ? 4 : 5, &opts);
+				break;
+			case LUA_TSTRING: {
+				size_t len;
+				const char *s = lua_tolstring(L, -1, &len);
+				addcsvfield(B, s, len, &opts);
+				break;
+			}
+			default:
+				if ((src = testbuffer(L, -1)) == NULL)
+					luaL_error(L, "invalid value (a %s) at index %d in table for 'addcsvrow'", luaL_typename(L, -1), (int)k);
+				if (src == B) { /* The Buffer may move as it grows, so add a copy of its contents */
+					lua_pushlstring(L, B->b, B->n);
+					addcsvfield(B, lua_tostring(L, -1), lua_rawlen(L, -1), &opts);
+					lua_pop(L, 1);
+				} else {
+					addcsvfield(B, src->b, src->n, &opts);
+				}
+		}
+		lua_pop(L, 1);
+	}
+	memcpy(prepbuffsize(B, opts.eollen), opts.eol, opts.eollen);
+	addsize(B, opts.eollen);
+	return pushbuffer(L, 1);
+}
+
+/*
+	Varints and bits.
+	Varints are unsigned LEB128 (as used by Protocol Buffers) of the 64-bit two's complement representation, so negative numbers always take 10 bytes
+	unless they're zigzag encoded first. Bits are written and read most significant bit first.
+*/
+
+/* The most bytes in the varint of a 64-bit value */
+#define VARINT_MAXLEN 10
+
+/* Adds the varint of the 64-bit value with the given high and low halves */
+static void addvarint(Buffer *B, U32 hi, U32 lo) {
+	unsigned char *b = (unsigned char *)prepbuffsize(B, VARINT_MAXLEN);
+	size_t n = 0;
+	while (hi != 0 || lo > 0x7f) {
+		b[n++] = (unsigned char)((lo & 0x7f) | 0x80);
+		lo = ((lo >> 7) | (hi << 25)) & 0xffffffffU;
+		hi >>= 7;
+	}
+	b[n++] = (unsigned char)lo;
+	addsize(B, n);
+}
+
+/* Gets the halves of the integer argument at index i, raising an error if it isn't one */
+static int checkint64(lua_State *L, int i, U32 *hi, U32 *lo) {
+	int sign = toint64(L, i, hi, lo);
+	if (sign == 0)
+		luaL_argerror(L, i, lua_type(L, i) == LUA_TNUMBER ? "number has no integer representation" : "integer expected");
+	return sign;
+}
+
+/**
+Adds some integers to the @{Buffer} as varints (unsigned LEB128, as used by Protocol Buffers).
+Negative numbers are encoded as their 64-bit two's complement, so they always take 10 bytes; use @{Buffer:addzigzag|`buff:addzigzag`} for signed values.
+
+@function addvarint
+@int ... The integers to add.
+@treturn Buffer The Buffer object.
+*/
+static int bufflib_addvarint(lua_State *L) {
+	Buffer *B = getbuffer(L, 1);
+	int i, numargs = lua_gettop(L);
+	U32 hi, lo;
+	for (i = 2; i <= numargs; i++) {
+		checkint64(L, i, &hi, &lo);
+		addvarint(B, hi, lo);
+	}
+	return pushbuffer(L, 1);
+}
+
+/**
+Adds some integers to the @{Buffer} as zigzag encoded varints, so numbers close to zero take few bytes whatever their sign
+(0, -1, 1, -2, ... are encoded as 0, 1, 2, 3, ...).
+
+@function addzigzag
+@int ... The integers to add.
+@treturn Buffer The Buffer object.
+*/
+static int bufflib_addzigzag(lua_State *L) {
+	Buffer *B = getbuffer(L, 1);
+	int i, numargs = lua_gettop(L);
+	U32 hi, lo;
+	for (i = 2; i <= numargs; i++) {
+		int neg = checkint64(L, i, &hi, &lo) < 0;
+		hi = ((hi << 1) | (lo >> 31)) & 0xffffffffU; /* (n << 1) ^ (n >> 63) */
+		lo = (lo << 1) & 0xffffffffU;
+		if (neg) {
+			hi ^= 0xffffffffU;
+			lo ^= 0xffffffffU;
+		}
+		addvarint(B, hi, lo);
+	}
+	return pushbuffer(L, 1);
+}
+
+/*
+	Reads the varint at position pos of the bytes at s (of length len), leaving its halves in hi and lo.
+	Returns the position after it, or 0 if the bytes end before it does.
+*/
+static size_t readvarint(lua_State *L, const unsigned char *s, size_t len, size_t pos, U32 *hi, U32 *lo) {
+	unsigned shift = 0;
+	*hi = *lo = 0;
+	for (; pos < len; pos++, shift += 7) {
+		U32 v = s[pos] & 0x7f;
+		if (shift >= 64 || (shift == 63 && v > 1))
+			luaL_error(L, "varint too long");
+		if (shift < 32)
+			*lo |= (v << shift) & 0xffffffffU;
+		if (shift > 25)
+			*hi |= (shift >= 32 ? v << (shift - 32) : v >> (32 - shift)) & 0xffffffffU;
+		if ((s[pos] & 0x80) == 0)
+			return pos + 1;
+	}
+	return 0;
+}
+
+/* Gets the bytes and position arguments of the read functions, returning the position as an offset */
+static const unsigned char *checkreadargs(lua_State *L, size_t *len, size_t *pos) {
+	const unsigned char *s = (const unsigned char *)checkbytes(L, 1, len);
+	lua_Integer p = luaL_optinteger(L, 2, 1);
+	luaL_argcheck(L, p >= 1 && (size_t)p <= *len + 1, 2, "out of range");
+	*pos = (size_t)p - 1;
+	return s;
+}
+
+/**
+Reads a varint written by @{Buffer:addvarint|`buff:addvarint`} from the @{Buffer}.
+Values with the top bit set are returned as negative numbers (as written by `buff:addvarint` for negative numbers).
+Without integers (Lua 5.1 and 5.2), values beyond 2^53 lose precision.
+
+@function readvarint
+@int[opt=1] pos The position of the varint in the Buffer.
+@treturn int The value, or nil if the Buffer ends before the varint does.
+@treturn int The position after the varint, or nil if it's incomplete.
+@error Raises an error if the varint is longer than 64 bits.
+*/
+static int bufflib_readvarint(lua_State *L) {
+	size_t len, pos;
+	const unsigned char *s = checkreadargs(L, &len, &pos);
+	U32 hi, lo;
+	if ((pos = readvarint(L, s, len, pos, &hi, &lo)) == 0) {
+		lua_pushnil(L);
+		return 1;
+	}
+	pushint64(L, hi, lo, 1);
+	lua_pushinteger(L, (lua_Integer)pos + 1);
+	return 2;
+}
+
+/**
+Reads a zigzag encoded varint written by @{Buffer:addzigzag|`buff:addzigzag`} from the @{Buffer}.
+
+@function readzigzag
+@int[opt=1] pos The position of the varint in the Buffer.
+@treturn int The value, or nil if the Buffer ends before the varint does.
+@treturn int The position after the varint, or nil if it's incomplete.
+@error Raises an error if the varint is longer than 64 bits.
+*/
+static int bufflib_readzigzag(lua_State *L) {
+	size_t len, pos;
+	const unsigned char *s = checkreadargs(L, &len, &pos);
+	U32 hi, lo, neg;
+	if ((pos = readvarint(L, s, len, pos, &hi, &lo)) == 0) {
+		lua_pushnil(L);
+		return 1;
+	}
+	neg = lo & 1;
+	lo = (lo >> 1) | ((hi & 1) << 31); /* (n >> 1) ^ -(n & 1) */
+	hi >>= 1;
+	if (neg) {
+		hi ^= 0xffffffffU;
+		lo ^= 0xffffffffU;
+	}
+	pushint64(L, hi, lo, 1);
+	lua_pushinteger(L, (lua_Integer)pos + 1);
+	return 2;
+}
+
+/**
+Reads an unsigned integer of some bits from the @{Buffer}, most significant bit first (the order @{BitWriter:put|`writer:put`} writes them in).
+Unlike the other positions, bit offsets start from 0: bit `k` is bit `7 - k % 8` of byte `k // 8 + 1`.
+64-bit values with the top bit set are returned as negative numbers. Without integers (Lua 5.1 and 5.2), values beyond 2^53 lose precision.
+
+@function readbits
+@int offset The offset of the first bit.
+@int nbits The number of bits to read, from 1 to 64.
+@treturn int The value, or nil if the Buffer ends before the bits do.
+@treturn int The offset after the bits.
+*/
+static int bufflib_readbits(lua_State *L) {
+	size_t len, offset, nbits, i;
+	const unsigned char *s = (const unsigned char *)checkbytes(L, 1, &len);
+	lua_Integer o = luaL_checkinteger(L, 2), n = luaL_checkinteger(L, 3);
+	U32 hi = 0, lo = 0;
+	luaL_argcheck(L, o >= 0, 2, "out of range");
+	luaL_argcheck(L, n >= 1 && n <= 64, 3, "out of range");
+	offset = (size_t)o;
+	nbits = (size_t)n;
+	if (offset > len * 8 || nbits > len * 8 - offset) {
+		lua_pushnil(L);
+		return 1;
+	}
+	for (i = offset; i < offset + nbits; i++) { /* Bit at a time, but only whole bytes are copied below */
+		unsigned bit;
+		if ((i & 7) == 0 && offset + nbits - i >= 8) { /* A whole byte */
+			hi = ((hi << 8) | (lo >> 24)) & 0xffffffffU;
+			lo = ((lo << 8) | s[i >> 3]) & 0xffffffffU;
+			i += 7;
+			continue;
+		}
+		bit = (s[i >> 3] >> (7 - (i & 7))) & 1;
+		hi = ((hi << 1) | (lo >> 31)) & 0xffffffffU;
+		lo = ((lo << 1) | bit) & 0xffffffffU;
+	}
+	pushint64(L, hi, lo, 1); /* Only 64-bit values can have the top bit set */
+	lua_pushinteger(L, (lua_Integer)(offset + nbits));
+	return 2;
+}
+
+/* A bit writer's state, see the BitWriter type below */
+typedef struct BitWriter {
+	U32 acc; /* pending bits, in the low count bits */
+	int count; /* number of pending bits, always less than 8 between calls */
+} BitWriter;
+
+/**
+Creates a @{BitWriter} that adds bits to the end of the @{Buffer}.
+Bits are added in whole bytes as they fill up, and @{BitWriter:flush|`writer:flush()`} adds any remaining bits padded with zeros.
+Don't add anything else to the Buffer while the writer has bits pending.
+
+	buff:bits():put(5, 3):put(1, 1):put(300, 12):flush() -- 1011 0001 0010 1100
+
+@function bits
+@treturn BitWriter The new writer.
+*/
+static int bufflib_bits(lua_State *L) {
+	BitWriter *W;
+	getbuffer(L, 1);
+	W = (BitWriter *)newudatauv(L, sizeof(BitWriter), 1);
+	W->acc = 0;
+	W->count = 0;
+	luaL_setmetatable(L, BITWRITERTYPE);
+	lua_createtable(L, 1, 0); /* The writer's user value holds its Buffer */
+	lua_pushvalue(L, 1);
+	lua_rawseti(L, -2, 1);
+	setuservalue(L, -2);
+	return 1;
+}
+
+/**
+Creates a copy of the @{Buffer}, with the same contents and options.
+Rather than copying the contents, the two Buffers share them until either of them is changed, which gives it its own copy.
+Cloning a prefix and then adding different things to each clone only copies the prefix once per clone, when it's first added to.
+Small contents (that fit in the Buffer itself) and mapped Buffers' contents are copied straight away, and the clone of a mapped Buffer isn't mapped.
+
+	local header = bufflib.new():add(commonheaders)
+	for _, user in ipairs(users) do
+		send(header:clone():add(body(user)))
+	end
+
+@function clone
+@treturn Buffer The new Buffer.
+*/
+static int bufflib_clone(lua_State *L) {
+	Buffer *B = getbuffer(L, 1);
+	Buffer *C = newcompactbuffer(L, B->initsize);
+	C->flags = B->flags & ~BUFFER_GAPOPEN;
+	C->maxsize = B->maxsize;
+	if (B->store != STORE_ALLOC || B->b == B->initb) {
+		memcpy(prepbuffsize(C, B->n), B->b, B->n * sizeof(char));
+		addsize(C, B->n);
+		return 1;
+	}
+	if (B->block == NULL) { /* Start sharing the contents */
+		SharedBlock *block = (SharedBlock *)B->allocf(B->allocud, NULL, 0, sizeof(SharedBlock));
+		if (block == NULL)
+			return luaL_error(L, "not enough memory");
+		block->refs = 1;
+		block->size = B->size;
+		B->block = block;
+		B->size = B->n;
+	}
+	B->block->refs++;
+	C->b = B->b;
+	C->n = C->size = B->n;
+	C->block = B->block;
+	return 1;
+}
+
+/*
+Garbage collection metamethod. This should never be called by the user, so it's not included in the documentation.
+If the Buffer is storing its contents in an allocated block, frees it. If the Buffer is mapped, flushes and closes its file.
+This never raises an error, since errors in finalizers are turned into warnings in Lua 5.4.
+It may run after __close, so it leaves the Buffer empty.
+*/
+static int bufflib_gc(lua_State *L){
+	Buffer *B = (Buffer *)lua_touserdata(L, 1);
+	if (B != NULL)
+		freebuffer(B);
+	return 0;
+}
+
+/*
+	Common header of the objects that can be shared between lua_States (Shared stores and Logs).
+	These are allocated with malloc, reference counted and referred to from each state by a Handle userdata.
+*/
+typedef struct SharedObject {
+	Mutex lock; /* protects refs (and the contents of Shared stores) */
+	int refs; /* number of Handles and unredeemed tokens referring to this object */
+	const char *type; /* registry key of the metatable for Handles to this object */
+	void (*destroy)(struct SharedObject *obj); /* frees the object's contents, but not the object itself */
+} SharedObject;
+
+typedef struct Handle {
+	SharedObject *obj; /* NULL until the object is created and after the Handle has been collected */
+} Handle;
+
+/*
+	A token created by shared:token() or log:token(), waiting to be redeemed by bufflib.attach().
+	Tokens are kept in a process-wide list, since they're used to pass objects between lua_States.
+*/
+typedef struct Token {
+	lua_Integer id;
+	SharedObject *obj; /* the token owns one reference to the object */
+	struct Token *next;
+} Token;
+
+static Mutex tokenlock = MUTEX_INITIALIZER;
+static Token *tokens = NULL;
+static lua_Integer lasttoken = 0;
+
+/* Initialises the header of a new shared object, with one reference for the Handle that created it */
+static void objinit(SharedObject *obj, const char *type, void (*destroy)(SharedObject *obj)) {
+	mutex_init(&obj->lock);
+	obj->refs = 1;
+	obj->type = type;
+	obj->destroy = destroy;
+}
+
+/* Adds a reference to the object */
+static void objretain(SharedObject *obj) {
+	mutex_lock(&obj->lock);
+	obj->refs++;
+	mutex_unlock(&obj->lock);
+}
+
+/* Removes a reference from the object, freeing it if that was the last one */
+static void objrelease(SharedObject *obj) {
+	int refs;
+	mutex_lock(&obj->lock);
+	refs = --obj->refs;
+	mutex_unlock(&obj->lock);
+	if (refs == 0) {
+		obj->destroy(obj);
+		mutex_destroy(&obj->lock);
+		free(obj);
+	}
+}
+
+/*
+	Pushes a new Handle with the given metatable onto the stack.
+	The caller must set its obj field to an object holding a reference for it.
+*/
+static Handle *newhandle(lua_State *L, const char *type) {
+	Handle *h = (Handle *)newudata(L, sizeof(Handle));
+	h->obj = NULL;
+	luaL_setmetatable(L, type);
+	return h;
+}
+
+/* Returns the object of the Handle at index i, raising an error if the value isn't a Handle of the given type */
+static SharedObject *gethandle(lua_State *L, int i, const char *type) {
+	Handle *h = (Handle *)luaL_checkudata(L, i, type);
+	return h->obj;
+}
+
+/* Registers a new token holding a reference to the object and pushes its id onto the stack */
+static int pushtoken(lua_State *L, SharedObject *obj) {
+	Token *t = (Token *)malloc(sizeof(Token));
+	if (t == NULL)
+		return luaL_error(L, "not enough memory");
+
+	objretain(obj);
+	t->obj = obj;
+
+	mutex_lock(&tokenlock);
+	t->id = ++lasttoken;
+	t->next = tokens;
+	tokens = t;
+	mutex_unlock(&tokenlock);
+
+	lua_pushinteger(L, t->id);
+	return 1;
+}
+
+/*
+Garbage collection metamethod for Handles. This should never be called by the user, so it's not included in the documentation.
+Releases the Handle's reference to its object.
+*/
+static int bufflib_handlegc(lua_State *L) {
+	Handle *h = (Handle *)lua_touserdata(L, 1);
+	if (h != NULL && h->obj != NULL) {
+		objrelease(h->obj);
+		h->obj = NULL;
+	}
+	return 0;
+}
+
+/**
+A Buffer whose contents can be shared between multiple lua\_States running in different OS threads.
+
+The contents are stored in a reference counted block allocated with `malloc`, so they don't belong to any one state.
+Each state holds its own Shared object referring to the block and the block is freed when the last of these is collected.
+Every operation locks the block, so Shared objects can be used concurrently from any number of threads.
+
+To hand a Shared Buffer to another state, call @{Shared:token|`shared:token()`} and pass the returned integer to @{attach} in the other state.
+
+Shared Buffers only support the methods documented here, use @{Shared:addto|`shared:addto(buff)`} to copy their contents into a regular @{Buffer}.
+
+@type Shared
+*/
+typedef struct SharedStore {
+	SharedObject obj;
+	char *b;
+	size_t size;
+	size_t n;
+} SharedStore;
+
+/* Frees the contents of a Shared store */
+static void shareddestroy(SharedObject *obj) {
+	free(((SharedStore *)obj)->b);
+}
+
+/*
+	Creates a new Shared store with no contents and pushes a Shared object referring to it onto the stack.
+*/
+static SharedStore *newshared(lua_State *L) {
+	Handle *h = newhandle(L, SHAREDTYPE);
+	SharedStore *S = (SharedStore *)malloc(sizeof(SharedStore));
+	if (S == NULL)
+		luaL_error(L, "not enough memory");
+	objinit(&S->obj, SHAREDTYPE, shareddestroy);
+	S->b = NULL;
+	S->size = 0;
+	S->n = 0;
+	h->obj = &S->obj;
+	return S;
+}
+
+/* Returns the store of the Shared object at index i, raising an error if the value isn't a Shared object */
+#define getshared(L, i) ((SharedStore *)gethandle(L, i, SHAREDTYPE))
+
+/*
+	Appends len characters from str to the store. The store must be locked.
+	Returns 0 if the store couldn't be grown.
+*/
+static int sharedappend(SharedStore *S, const char *str, size_t len) {
+	if (S->size - S->n < len) {
+		char *newb;
+		size_t newsize = nextbuffsize(S->size < LUAL_BUFFERSIZE ? LUAL_BUFFERSIZE : S->size, S->n, len);
+		if (newsize == 0 || (newb = (char *)realloc(S->b, newsize)) == NULL)
+			return 0;
+		S->b = newb;
+		S->size = newsize;
+	}
+	memcpy(S->b + S->n, str, len * sizeof(char));
+	S->n += len;
+	return 1;
+}
+
+/*
+	Adds the values from index firstarg to the top of the stack to the store.
+	The values are converted to strings before the store is locked, since __tostring metamethods may raise errors.
+*/
+static void sharedaddstrings(lua_State *L, SharedStore *S, int firstarg) {
+	int numargs = lua_gettop(L);
+	int ok = 1;
+	int i;
+
+	luaL_checkstack(L, numargs - firstarg + 1, "too many arguments");
+	for (i = firstarg; i <= numargs; i++) {
+		luaL_tolstring(L, i, NULL); /* Leave the strings on the stack so they can't be collected */
+	}
+
+	mutex_lock(&S->obj.lock);
+	for (i = numargs + 1; ok && i <= lua_gettop(L); i++) {
+		size_t len;
+		const char *str = lua_tolstring(L, i, &len);
+		ok = sharedappend(S, str, len);
+	}
+	mutex_unlock(&S->obj.lock);
+
+	lua_settop(L, numargs);
+	if (!ok)
+		luaL_error(L, "not enough memory");
+}
+
+/**
+Add some strings to the Shared Buffer.
+All non-string arguments are converted to strings following the same rules as the `tostring()` function.
+All of the strings are added atomically, so they won't be interleaved with strings added from other threads.
+
+@function add
+@param ... Some values to add to the Shared Buffer.
+@treturn Shared The Shared object.
+*/
+static int bufflib_sharedadd(lua_State *L) {
+	SharedStore *S = getshared(L, 1);
+	sharedaddstrings(L, S, 2);
+	return pushbuffer(L, 1);
+}
+
+/**
+Copy the Shared Buffer's contents to the end of a regular @{Buffer}.
+This copies the contents once, without creating an intermediate string.
+
+@function addto
+@tparam Buffer buff The Buffer to add the contents to.
+@treturn Buffer The Buffer object.
+*/
+static int bufflib_sharedaddto(lua_State *L) {
+	SharedStore *S = getshared(L, 1);
+	Buffer *B = getbuffer(L, 2);
+	const char *err = NULL;
+
+	mutex_lock(&S->obj.lock);
+	if (B->size - B->n < S->n)
+		err = growbuffer(B, S->n);
+	if (err == NULL) {
+		memcpy(&B->b[B->n], S->b, S->n * sizeof(char));
+		addsize(B, S->n);
+	}
+	mutex_unlock(&S->obj.lock);
+
+	if (err != NULL)
+		luaL_error(L, "%s", err);
+	return pushbuffer(L, 2);
+}
+
+/**
+Reset the Shared Buffer to its initial (empty) state, freeing its contents.
+This affects every Shared object referring to the same contents.
+
+@function reset
+@treturn Shared The Shared object.
+*/
+static int bufflib_sharedreset(lua_State *L) {
+	SharedStore *S = getshared(L, 1);
+	mutex_lock(&S->obj.lock);
+	free(S->b);
+	S->b = NULL;
+	S->size = 0;
+	S->n = 0;
+	mutex_unlock(&S->obj.lock);
+	return pushbuffer(L, 1);
+}
+
+/**
+Converts the Shared Buffer to a string representing its current contents.
+
+@function __tostring
+@treturn string The contents of the Shared Buffer
+*/
+static int bufflib_sharedtostring(lua_State *L) {
+	SharedStore *S = getshared(L, 1);
+	size_t size, n;
+	char *copy;
+
+	/*
+		Nothing can be allocated through Lua while the store is locked, since that may run a garbage collection step that
+		collects another Shared object referring to the store, which would lock it again. Copy the contents into a userdata
+		allocated beforehand, retrying if they grow in the meantime.
+	*/
+	mutex_lock(&S->obj.lock);
+	size = S->n;
+	mutex_unlock(&S->obj.lock);
+	for (;;) {
+		copy = (char *)newudata(L, size);
+		mutex_lock(&S->obj.lock);
+		n = S->n;
+		if (n <= size && n > 0) /* S->b is NULL while the store is empty */
+			memcpy(copy, S->b, n * sizeof(char));
+		mutex_unlock(&S->obj.lock);
+		if (n <= size)
+			break;
+		lua_pop(L, 1);
+		size = n;
+	}
+
+	lua_pushlstring(L, copy, n);
+	return 1;
+}
+
+/**
+Metamethod for the `#` (length) operation.
+Returns the length of the Shared Buffer's current contents.
+
+@function __len
+@treturn int length
+*/
+static int bufflib_sharedlen(lua_State *L) {
+	SharedStore *S = getshared(L, 1);
+	size_t n;
+	mutex_lock(&S->obj.lock);
+	n = S->n;
+	mutex_unlock(&S->obj.lock);
+	lua_pushinteger(L, (lua_Integer)n);
+	return 1;
+}
+
+/**
+Creates a token that can be used to attach to this Shared Buffer from another lua\_State with @{attach}.
+Each token can only be redeemed once. The contents stay alive until every token has been redeemed and every Shared object referring to them has been collected, so a token that's never redeemed keeps the contents alive until the process exits.
+
+@function token
+@treturn int The token.
+*/
+static int bufflib_sharedtoken(lua_State *L) {
+	return pushtoken(L, gethandle(L, 1, SHAREDTYPE));
+}
+
+/**
+A bounded, lock-free log that any number of lua\_States (in any number of OS threads) can append records to.
+
+Each record is added with a single atomic fetch-and-add that reserves space for it, followed by a `memcpy`, so producers never block each other or the consumer.
+A record is never split or interleaved with other records.
+If there isn't enough space left for a record, it's dropped and counted (see @{Log:dropped|`log:dropped()`}) instead of waiting for space.
+
+The log has two segments of the capacity given to @{log}. Producers append to the active segment while @{Log:drain|`log:drain(...)`} swaps the segments and copies out the one that was active.
+Only one consumer drains at a time; concurrent calls to `drain` wait for each other (but not for producers).
+
+Like @{Shared} Buffers, Logs are passed to other states with @{Log:token|`log:token()`} and @{attach}.
+
+@type Log
+*/
+
+/* Set in a segment's reserved count once it has been sealed by the consumer */
+#define SEALBIT ((size_t)1 << (sizeof(size_t) * 8 - 1))
+
+typedef struct LogSegment {
+	volatile size_t reserved; /* bytes reserved by producers, SEALBIT is set once the segment has been sealed */
+	volatile size_t committed; /* bytes of reservations that are finished (written or abandoned) */
+	size_t end; /* offset of the first record that didn't fit, set by the producer that reserved it */
+	char *data;
+} LogSegment;
+
+typedef struct LogStore {
+	SharedObject obj; /* obj.lock serialises consumers */
+	size_t capacity; /* size of each segment */
+	volatile size_t active; /* index of the segment producers append to */
+	volatile size_t dropped; /* number of records dropped because the active segment was full */
+	LogSegment segs[2];
+} LogStore;
+
+/* Frees the segments of a Log */
+static void logdestroy(SharedObject *obj) {
+	LogStore *S = (LogStore *)obj;
+	free(S->segs[0].data);
+	free(S->segs[1].data);
+}
+
+/* Returns the store of the Log at index i, raising an error if the value isn't a Log */
+#define getlog(L, i) ((LogStore *)gethandle(L, i, LOGTYPE))
+
+/*
+	Reserves len bytes in the active segment. Never blocks.
+	Returns the segment and stores the offset of the reserved space in off, or returns NULL if the record doesn't fit.
+	The caller must commit len bytes to the segment once it has written the record.
+*/
+static LogSegment *logreserve(LogStore *S, size_t len, size_t *off) {
+	if (len <= S->capacity) {
+		for (;;) {
+			LogSegment *seg = &S->segs[atomic_load(&S->active)];
+			size_t pos = atomic_fetchadd(&seg->reserved, len);
+
+			if (pos & SEALBIT) /* The consumer sealed this segment after we loaded it, try the new active segment */
+				continue;
+
+			if (pos + len <= S->capacity) {
+				*off = pos;
+				return seg;
+			}
+
+			if (pos < S->capacity) /* This is the first record that doesn't fit, the segment's data ends here */
+				seg->end = pos;
+			atomic_fetchadd(&seg->committed, len); /* Abandon the reservation */
+			break;
+		}
+	}
+	atomic_fetchadd(&S->dropped, 1);
+	return NULL;
+}
+
+/**
+Add a record to the Log.
+The arguments are converted to strings following the same rules as the `tostring()` function and joined to form the record.
+
+@function add
+@param ... Some values that make up the record.
+@treturn bool Was the record added? This is false if the record was dropped because the Log was full.
+*/
+static int bufflib_logadd(lua_State *L) {
+	LogStore *S = getlog(L, 1);
+	int numargs = lua_gettop(L);
+	size_t len = 0, off;
+	LogSegment *seg;
+	int i;
+
+	luaL_checkstack(L, numargs, "too many arguments");
+	for (i = 2; i <= numargs; i++) {
+		size_t l;
+		luaL_tolstring(L, i, &l); /* Leave the strings on the stack so they can't be collected */
+		len += l;
+	}
+
+	seg = logreserve(S, len, &off);
+	if (seg != NULL) {
+		char *b = seg->data + off;
+		for (i = numargs + 1; i <= lua_gettop(L); i++) {
+			size_t l;
+			const char *str = lua_tolstring(L, i, &l);
+			memcpy(b, str, l * sizeof(char));
+			b += l;
+		}
+		atomic_fetchadd(&seg->committed, len);
+	}
+
+	lua_pushboolean(L, seg != NULL);
+	return 1;
+}
+
+/*
+	Returns the FILE of the file handle at index i or NULL if the value isn't a file handle.
+	Raises an error if the file is closed.
+*/
+static FILE *tofile(lua_State *L, int i) {
+#if LUA_VERSION_NUM >= 502
+	luaL_Stream *p = (luaL_Stream *)luaL_testudata(L, i, LUA_FILEHANDLE);
+	if (p == NULL)
+		return NULL;
+	if (p->closef == NULL)
+		luaL_argerror(L, i, "attempt to use a closed file");
+	return p->f;
+#else
+	FILE **p = (FILE **)luaL_testudata(L, i, LUA_FILEHANDLE); /* Also matches LuaJIT's file handles, which start with the FILE pointer */
+	if (p == NULL)
+		return NULL;
+	if (*p == NULL)
+		luaL_argerror(L, i, "attempt to use a closed file");
+	return *p;
+#endif
+}
+
+/* Writes len bytes from b to the file descriptor, retrying after partial writes. Returns 0 on success, or -1 on error with errno set. */
+static int writefd(int fd, const char *b, size_t len) {
+	while (len > 0) {
+		long w = (long)write(fd, b, len);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		b += w;
+		len -= (size_t)w;
+	}
+	return 0;
+}
+
+/**
+Drain the records added so far to a Buffer, file handle or file descriptor.
+Records that are still being written by producers when `drain` is called are waited for, records added after that are left for the next call.
+The records are written in the order their space was reserved.
+
+@function drain
+@param dest A @{Buffer}, a file handle (as returned by `io.open`) or an integer file descriptor.
+@treturn int The number of bytes drained.
+@error If writing to a file fails, returns nil followed by an error message and the number of bytes lost.
+*/
+static int bufflib_logdrain(lua_State *L) {
+	LogStore *S = getlog(L, 1);
+	Buffer *B = NULL;
+	FILE *f = NULL;
+	int fd = -1;
+	LogSegment *seg, *next;
+	size_t cur, reserved, len;
+	const char *err = NULL;
+	int res = 0;
+
+	if (isbuffer(L, 2))
+		B = getbuffer(L, 2);
+	else if ((f = tofile(L, 2)) == NULL)
+		fd = (int)luaL_checkinteger(L, 2);
+
+	mutex_lock(&S->obj.lock);
+
+	cur = atomic_load(&S->active);
+	seg = &S->segs[cur];
+	next = &S->segs[1 - cur];
+
+	/* Reopen the other segment (sealed by the previous drain), then make it the active one */
+	atomic_swap(&next->committed, 0);
+	next->end = S->capacity;
+	atomic_swap(&next->reserved, 0);
+	atomic_swap(&S->active, 1 - cur);
+
+	/* Seal the old segment, then wait for the producers that reserved space in it before it was sealed */
+	reserved = atomic_fetchor(&seg->reserved, SEALBIT);
+	while (atomic_load(&seg->committed) != reserved)
+		thread_yield();
+
+	len = reserved < seg->end ? reserved : seg->end;
+
+	if (B != NULL) {
+		if (B->size - B->n < len)
+			err = growbuffer(B, len);
+		if (err == NULL) {
+			memcpy(&B->b[B->n], seg->data, len * sizeof(char));
+			addsize(B, len);
+		}
+	} else if (f != NULL) {
+		res = fwrite(seg->data, sizeof(char), len, f) == len ? 0 : -1;
+	} else {
+		res = writefd(fd, seg->data, len);
+	}
+
+	mutex_unlock(&S->obj.lock);
+
+	if (err != NULL)
+		return luaL_error(L, "%s", err);
+	if (res != 0) {
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(errno));
+		lua_pushinteger(L, (lua_Integer)len);
+		return 3;
+	}
+	lua_pushinteger(L, (lua_Integer)len);
+	return 1;
+}
+
+/**
+Returns the number of records that have been dropped because the Log was full.
+
+@function dropped
+@treturn int The number of dropped records.
+*/
+static int bufflib_logdropped(lua_State *L) {
+	LogStore *S = getlog(L, 1);
+	lua_pushinteger(L, (lua_Integer)atomic_load(&S->dropped));
+	return 1;
+}
+
+/**
+Returns the capacity of each of the Log's segments.
+A record can only be added if it fits in the space left in the active segment.
+
+@function capacity
+@treturn int The capacity in bytes.
+*/
+static int bufflib_logcapacity(lua_State *L) {
+	LogStore *S = getlog(L, 1);
+	lua_pushinteger(L, (lua_Integer)S->capacity);
+	return 1;
+}
+
+/**
+Creates a token that can be used to attach to this Log from another lua\_State with @{attach}.
+Tokens work the same way as those created by @{Shared:token|`shared:token()`}.
+
+@function token
+@treturn int The token.
+*/
+static int bufflib_logtoken(lua_State *L) {
+	return pushtoken(L, gethandle(L, 1, LOGTYPE));
+}
+
+/**
+A compiled set of strings (needles) that can be searched for in a @{Buffer} or string all at once, created by @{matcher}.
+
+The needles are compiled into an Aho-Corasick automaton: a table of state transitions indexed by the current state and the class of the next byte
+(bytes that don't appear in any needle share a single class). Each search is a single pass over the contents, however many needles there are.
+
+@type Matcher
+*/
+
+typedef struct Matcher {
+	lua_Alloc allocf; /* allocator used for the arrays below */
+	void *allocud;
+	size_t maxstates; /* number of states allocated */
+	int nstates; /* number of states, the root is state 0 */
+	int nclasses; /* number of byte classes */
+	int nneedles;
+	unsigned short classes[256]; /* the class of each byte, up to 256 (all 256 bytes used, leaving class 0 empty) */
+	int *delta; /* delta[state * nclasses + class] is the next state */
+	int *term; /* term[state] is the index of the needle ending at state, or -1 */
+	int *dict; /* dict[state] is the longest proper suffix state with a needle ending at it, or -1 */
+	int *out; /* out[state] is state if term[state] >= 0, otherwise dict[state] */
+	size_t *lens; /* lens[i] is the length of needle i */
+} Matcher;
+
+/* Returns the Matcher at index i, raising an error if the value isn't a Matcher */
+#define getmatcher(L, i) ((Matcher *)luaL_checkudata(L, i, MATCHERTYPE))
+
+/* Frees the Matcher's arrays */
+static void freematcher(Matcher *M) {
+	size_t nstates = M->maxstates, nclasses = (size_t)M->nclasses;
+	if (M->delta != NULL)
+		M->allocf(M->allocud, M->delta, nstates * nclasses * sizeof(int), 0);
+	if (M->term != NULL)
+		M->allocf(M->allocud, M->term, nstates * 3 * sizeof(int), 0); /* term, dict and out share one block */
+	if (M->lens != NULL)
+		M->allocf(M->allocud, M->lens, (size_t)M->nneedles * sizeof(size_t), 0);
+	M->delta = M->term = M->dict = M->out = NULL;
+	M->lens = NULL;
+}
+
+/* Folds an ASCII uppercase letter to lowercase */
+#define foldcase(c) ((c) >= 'A' && (c) <= 'Z' ? (c) + ('a' - 'A') : (c))
+
+/*
+	Compiles the needles in the array at index 1 into M, which has just been created and has NULL arrays.
+*/
+static void buildmatcher(lua_State *L, Matcher *M, int ignorecase) {
+	int n = (int)lua_rawlen(L, 1), i, c, head, tail;
+	size_t total = 1, nclasses;
+	int *fail;
+
+	/* Assign a class to each byte used in the needles (class 0 is every other byte) */
+	M->nclasses = 1;
+	memset(M->classes, 0, sizeof(M->classes));
+	for (i = 1; i <= n; i++) {
+		size_t len, k;
+		const unsigned char *s;
+		lua_rawgeti(L, 1, i);
+		if (lua_type(L, -1) != LUA_TSTRING)
+			luaL_error(L, "bad needle #%d (string expected, got %s)", i, luaL_typename(L, -1));
+		s = (const unsigned char *)lua_tolstring(L, -1, &len);
+		if (len == 0)
+			luaL_error(L, "bad needle #%d (empty string)", i);
+		for (k = 0; k < len; k++) {
+			c = ignorecase ? foldcase(s[k]) : s[k];
+			if (M->classes[c] == 0)
+				M->classes[c] = (unsigned short)M->nclasses++;
+		}
+		lua_pop(L, 1);
+		total += len;
+		if (total > (size_t)INT_MAX / 257 || total > (size_t)-1 / 257 / sizeof(int)) /* There are at most 257 classes */
+			luaL_error(L, "needles too long");
+	}
+	if (ignorecase) {
+		for (c = 'A'; c <= 'Z'; c++)
+			M->classes[c] = M->classes[c + ('a' - 'A')];
+	}
+	nclasses = (size_t)M->nclasses;
+
+	/* Allocate enough states for a trie with no shared prefixes */
+	M->nneedles = n;
+	M->maxstates = total;
+	M->delta = (int *)M->allocf(M->allocud, NULL, 0, total * nclasses * sizeof(int));
+	M->term = (int *)M->allocf(M->allocud, NULL, 0, total * 3 * sizeof(int));
+	M->lens = (size_t *)M->allocf(M->allocud, NULL, 0, (size_t)n * sizeof(size_t));
+	if (M->delta == NULL || M->term == NULL || (n > 0 && M->lens == NULL)) {
+		freematcher(M);
+		luaL_error(L, "not enough memory");
+	}
+	M->dict = M->term + total;
+	M->out = M->dict + total;
+	memset(M->delta, -1, total * nclasses * sizeof(int));
+	memset(M->term, -1, total * sizeof(int));
+
+	/* Build the trie */
+	M->nstates = 1;
+	for (i = 1; i <= n; i++) {
+		size_t len, k;
+		const unsigned char *s;
+		int state = 0;
+		lua_rawgeti(L, 1, i);
+		s = (const unsigned char *)lua_tolstring(L, -1, &len);
+		for (k = 0; k < len; k++) {
+			int *next = &M->delta[(size_t)state * nclasses + M->classes[s[k]]];
+			if (*next < 0)
+				*next = M->nstates++;
+			state = *next;
+		}
+		if (M->term[state] < 0) /* Duplicate needles are reported as the first one */
+			M->term[state] = i - 1;
+		M->lens[i - 1] = len;
+		lua_pop(L, 1);
+	}
+
+	/* Fill in the failure transitions breadth-first, using out as the queue and dict to hold the failure states */
+	fail = M->dict;
+	head = tail = 0;
+	for (c = 0; c < (int)nclasses; c++) {
+		int *next = &M->delta[c];
+		if (*next < 0) {
+			*next = 0;
+		} else {
+			fail[*next] = 0;
+			M->out[tail++] = *next;
+		}
+	}
+	while (head < tail) {
+		int r = M->out[head++];
+		for (c = 0; c < (int)nclasses; c++) {
+			int *next = &M->delta[(size_t)r * nclasses + c];
+			int f = M->delta[(size_t)fail[r] * nclasses + c];
+			if (*next < 0) {
+				*next = f;
+			} else {
+				fail[*next] = f;
+				M->out[tail++] = *next;
+			}
+		}
+	}
+
+	/* Replace the failure states with dictionary suffix links, in breadth-first order so each state's failure state is already done */
+	M->dict[0] = -1;
+	for (head = 0; head < tail; head++) {
+		int s = M->out[head];
+		int f = fail[s];
+		fail[s] = M->term[f] >= 0 ? f : M->dict[f]; /* fail and dict are the same array, so this overwrites the failure state */
+	}
+	for (i = 0; i < M->nstates; i++)
+		M->out[i] = M->term[i] >= 0 ? i : M->dict[i];
+}
+
+/*
+	Returns a pointer to the subject (Buffer or string) at index i and stores its length in len.
+*/
+#define getsubject(L, i, len) ((const unsigned char *)checkbytes(L, i, len))
+
+/**
+Finds the first match of any of the needles in a @{Buffer} or string.
+The match that ends first is returned; if several needles end at the same position, the longest one is returned.
+
+@function find
+@param subject The Buffer or string to search.
+@int[opt=1] init The position to start searching from. Negative values count back from the end.
+@treturn int The position of the first byte of the match, or nil if there isn't one.
+@treturn int The position of the last byte of the match.
+@treturn int The index of the needle that matched.
+*/
+static int bufflib_matcherfind(lua_State *L) {
+	Matcher *M = getmatcher(L, 1);
+	size_t len, i, nclasses = (size_t)M->nclasses;
+	const unsigned char *s = getsubject(L, 2, &len);
+	lua_Integer init = posrelat(luaL_optinteger(L, 3, 1), len);
+	int state = 0;
+
+	for (i = init < 1 ? 0 : (size_t)init - 1; i < len; i++) {
+		state = M->delta[(size_t)state * nclasses + M->classes[s[i]]];
+		if (M->out[state] >= 0) {
+			int needle = M->term[M->out[state]];
+			lua_pushinteger(L, (lua_Integer)(i + 2 - M->lens[needle]));
+			lua_pushinteger(L, (lua_Integer)i + 1);
+			lua_pushinteger(L, (lua_Integer)needle + 1);
+			return 3;
+		}
+	}
+	lua_pushnil(L);
+	return 1;
+}
+
+/**
+Counts the matches of the needles in a @{Buffer} or string, including overlapping matches.
+
+@function count
+@param subject The Buffer or string to search.
+@treturn int The number of matches.
+*/
+static int bufflib_matchercount(lua_State *L) {
+	Matcher *M = getmatcher(L, 1);
+	size_t len, i, count = 0, nclasses = (size_t)M->nclasses;
+	const unsigned char *s = getsubject(L, 2, &len);
+	int state = 0, o;
+
+	for (i = 0; i < len; i++) {
+		state = M->delta[(size_t)state * nclasses + M->classes[s[i]]];
+		for (o = M->out[state]; o >= 0; o = M->dict[o])
+			count++;
+	}
+	lua_pushinteger(L, (lua_Integer)count);
+	return 1;
+}
+
+/**
+Calls a function for every match of the needles in a @{Buffer} or string, including overlapping matches, in the order they end.
+Matches that end at the same position are reported longest first.
+If the function modifies a Buffer subject, the search continues over the new contents from the same position.
+
+@function each
+@param subject The Buffer or string to search.
+@func fn The function to call with the position of the first and last byte of the match and the index of the needle that matched.
+Returning `false` (but not nil) from the function stops the search.
+@treturn int The number of matches reported to the function.
+*/
+static int bufflib_matchereach(lua_State *L) {
+	Matcher *M = getmatcher(L, 1);
+	size_t len, i, count = 0, nclasses = (size_t)M->nclasses;
+	const unsigned char *s = getsubject(L, 2, &len);
+	int state = 0, o;
+	luaL_checktype(L, 3, LUA_TFUNCTION);
+
+	for (i = 0; i < len; i++) {
+		state = M->delta[(size_t)state * nclasses + M->classes[s[i]]];
+		if (M->out[state] < 0)
+			continue;
+		for (o = M->out[state]; o >= 0; o = M->dict[o]) {
+			int needle = M->term[o], stop;
+			count++;
+			lua_pushvalue(L, 3);
+			lua_pushinteger(L, (lua_Integer)(i + 2 - M->lens[needle]));
+			lua_pushinteger(L, (lua_Integer)i + 1);
+			lua_pushinteger(L, (lua_Integer)needle + 1);
+			lua_call(L, 3, 1);
+			stop = lua_isboolean(L, -1) && !lua_toboolean(L, -1);
+			lua_pop(L, 1);
+			if (stop)
+				goto done;
+		}
+		s = getsubject(L, 2, &len); /* The function may have changed or moved a Buffer's contents */
+	}
+
+done:
+	lua_pushinteger(L, (lua_Integer)count);
+	return 1;
+}
+
+/*
+Garbage collection metamethod. This should never be called by the user, so it's not included in the documentation.
+Frees the Matcher's automaton.
+*/
+static int bufflib_matchergc(lua_State *L) {
+	Matcher *M = (Matcher *)lua_touserdata(L, 1);
+	if (M != NULL)
+		freematcher(M);
+	return 0;
+}
+
+/**
+A compiled template that renders straight into a @{Buffer}, created by @{template}.
+
+Templates use a subset of the Mustache syntax:
+
+- `{{name}}` adds the value of `name`, HTML-escaped.
+- `{{{name}}}` or `{{&name}}` adds the value without escaping it.
+- `{{%name}}` adds the value percent-encoded for use in URLs.
+- `{{#name}}...{{/name}}` renders its contents once for each element if the value is a non-empty array, once with the value as the innermost scope if it's any other table or true value, and not at all if it's false, nil or an empty table.
+- `{{^name}}...{{/name}}` renders its contents only if the value is false, nil or an empty table.
+- `{{! comment }}` is ignored.
+
+Names are dotted paths like `user.address.city`; path components that are integers index arrays. The first component is looked up in each scope from the innermost to the outermost (the environment passed to @{Template:render|`render`}), the rest are looked up in the result.
+The name `.` refers to the innermost scope itself, e.g. the current element of an array.
+Values are added as-is if they're strings, numbers or Buffers; nil adds nothing and anything else is converted following the same rules as the `tostring()` function.
+
+The template is parsed once, into a list of operations that refer to the literal text of the source and to pre-interned path keys.
+
+@type Template
+*/
+
+/* Operations */
+#define TOP_TEXT 0 /* Add the literal text at start */
+#define TOP_VALUE 1 /* Add the value of a path, escaped with esc */
+#define TOP_SECTION 2 /* Render the operations up to jump for the value of a path */
+#define TOP_INVERTED 3 /* Render the operations up to jump if the value of a path is false */
+#define TOP_END 4 /* End of a section */
+
+/* Escapers */
+#define ESC_RAW 0
+#define ESC_HTML 1
+#define ESC_URL 2
+
+typedef struct TemplateOp {
+	int type;
+	int esc; /* escaper for TOP_VALUE */
+	size_t start, len; /* TOP_TEXT: the text in the source. Others: the index of the first key of the path in the keys table and the number of keys (0 for ".") */
+	size_t jump; /* TOP_SECTION and TOP_INVERTED: the index of the matching TOP_END */
+} TemplateOp;
+
+typedef struct Template {
+	lua_Alloc allocf; /* allocator used for ops */
+	void *allocud;
+	TemplateOp *ops;
+	size_t nops, size; /* number of operations and number allocated */
+	const char *src; /* the source, kept alive by the keys table */
+	int keysref; /* registry reference to the keys table: [1] is the source, the path keys follow */
+} Template;
+
+/* Returns the Template at index i, raising an error if the value isn't a Template */
+#define gettemplate(L, i) ((Template *)luaL_checkudata(L, i, TEMPLATETYPE))
+
+/* Appends an operation to the Template and returns it */
+static TemplateOp *addop(lua_State *L, Template *T, int type) {
+	TemplateOp *op;
+	if (T->nops == T->size) {
+		size_t newsize = T->size == 0 ? 16 : T->size * 2;
+		TemplateOp *ops = (TemplateOp *)T->allocf(T->allocud, T->ops, T->size * sizeof(TemplateOp), newsize * sizeof(TemplateOp));
+		if (ops == NULL)
+			luaL_error(L, "not enough memory");
+		T->ops = ops;
+		T->size = newsize;
+	}
+	op = &T->ops[T->nops++];
+	op->type = type;
+	op->esc = ESC_RAW;
+	op->start = op->len = op->jump = 0;
+	return op;
+}
+
+/*
+	Compiles a dotted path of len bytes at s, appending its keys to the keys table at index keys (which has nkeys keys so far).
+	Stores the position and number of keys in op and returns the new number of keys.
+*/
+static size_t compilepath(lua_State *L, TemplateOp *op, const char *s, size_t len, int keys, size_t nkeys) {
+	const char *end = s + len;
+	op->start = nkeys + 2; /* The keys start at index 2 of the keys table */
+	op->len = 0;
+	if (len == 1 && *s == '.')
+		return nkeys;
+	while (s <= end) {
+		const char *dot = (const char *)memchr(s, '.', (size_t)(end - s));
+		size_t seglen = (size_t)((dot != NULL ? dot : end) - s), k;
+		int isint = seglen > 0 && seglen < 10;
+		if (seglen == 0) {
+			lua_pushlstring(L, end - len, len);
+			luaL_error(L, "invalid template name '%s'", lua_tostring(L, -1));
+		}
+		for (k = 0; k < seglen && isint; k++)
+			isint = s[k] >= '0' && s[k] <= '9';
+		if (isint)
+			lua_pushinteger(L, (lua_Integer)strtol(s, NULL, 10));
+		else
+			lua_pushlstring(L, s, seglen);
+		lua_rawseti(L, keys, (int)(nkeys + 2));
+		nkeys++;
+		op->len++;
+		s += seglen + 1;
+	}
+	return nkeys;
+}
+
+/* Returns 1 if c is a space, tab or newline */
+#define isspacechar(c) ((c) == ' ' || (c) == '\t' || (c) == '\r' || (c) == '\n')
+
+/*
+	Parses the source at index 1 into the Template's operations.
+	The keys table is at index keys.
+*/
+static void compiletemplate(lua_State *L, Template *T, int keys) {
+	size_t len, nkeys = 0, open = 0, pos = 0;
+	const char *src = lua_tolstring(L, 1, &len);
+	struct {
+		size_t op; /* index of the section's operation */
+		const char *name; /* the section's name in the source */
+		size_t namelen;
+	} stack[64]; /* The open sections */
+	size_t depth = 0;
+
+	T->src = src;
+	while (pos < len) {
+		const char *tag = NULL, *p = src + pos, *name, *close;
+		size_t remaining = len - pos, namelen;
+		const char *closer = "}}";
+		TemplateOp *op;
+		int type = TOP_VALUE, esc = ESC_HTML;
+
+		/* Find the next tag */
+		while (remaining >= 2 && (p = (const char *)memchr(p, '{', remaining - 1)) != NULL) {
+			if (p[1] == '{') {
+				tag = p;
+				break;
+			}
+			p++;
+			remaining = len - (size_t)(p - src);
+		}
+		if (tag == NULL) {
+			op = addop(L, T, TOP_TEXT);
+			op->start = pos;
+			op->len = len - pos;
+			break;
+		}
+		if (tag > src + pos) {
+			op = addop(L, T, TOP_TEXT);
+			op->start = pos;
+			op->len = (size_t)(tag - src) - pos;
+		}
+
+		open = (size_t)(tag - src);
+		name = tag + 2;
+		if (name < src + len && *name == '{') { /* {{{name}}} */
+			closer = "}}}";
+			esc = ESC_RAW;
+			name++;
+		} else if (name < src + len) {
+			switch (*name) {
+				case '&': esc = ESC_RAW; name++; break;
+				case '%': esc = ESC_URL; name++; break;
+				case '#': type = TOP_SECTION; name++; break;
+				case '^': type = TOP_INVERTED; name++; break;
+				case '/': type = TOP_END; name++; break;
+				case '!': type = -1; name++; break;
+			}
+		}
+
+		/* Find the end of the tag */
+		close = name;
+		for (;;) {
+			close = (const char *)memchr(close, '}', (size_t)(src + len - close));
+			if (close == NULL || (size_t)(src + len - close) < strlen(closer))
+				luaL_error(L, "unclosed template tag at position %d", (int)open + 1);
+			if (memcmp(close, closer, strlen(closer)) == 0)
+				break;
+			close++;
+		}
+		pos = (size_t)(close - src) + strlen(closer);
+
+		if (type == -1) /* Comment */
+			continue;
+
+		while (name < close && isspacechar(*name))
+			name++;
+		while (close > name && isspacechar(close[-1]))
+			close--;
+		namelen = (size_t)(close - name);
+		if (namelen == 0)
+			luaL_error(L, "empty template tag at position %d", (int)open + 1);
+
+		if (type == TOP_END) {
+			TemplateOp *section;
+			if (depth == 0 || namelen != stack[depth - 1].namelen || memcmp(name, stack[depth - 1].name, namelen) != 0) {
+				lua_pushlstring(L, name, namelen);
+				luaL_error(L, "unexpected {{/%s}} at position %d", lua_tostring(L, -1), (int)open + 1);
+			}
+			depth--;
+			op = addop(L, T, TOP_END);
+			section = &T->ops[stack[depth].op]; /* Get this after addop, which may move the operations */
+			section->jump = T->nops - 1;
+			op->start = section->start;
+			op->len = section->len;
+			continue;
+		}
+
+		op = addop(L, T, type);
+		op->esc = esc;
+		nkeys = compilepath(L, op, name, namelen, keys, nkeys);
+		if (type == TOP_SECTION || type == TOP_INVERTED) {
+			if (depth == sizeof(stack) / sizeof(stack[0]))
+				luaL_error(L, "template sections nested too deeply at position %d", (int)open + 1);
+			stack[depth].op = T->nops - 1;
+			stack[depth].name = name;
+			stack[depth].namelen = namelen;
+			depth++;
+		}
+	}
+
+	if (depth > 0)
+		luaL_error(L, "unclosed template section");
+}
+
+/*
+	Pushes the value of the path of op. The scopes are at stack indices base to top (innermost) and the keys table is at index keys.
+*/
+static void pushpath(lua_State *L, const TemplateOp *op, int keys, int base, int top) {
+	size_t k;
+	int i;
+	if (op->len == 0) {
+		lua_pushvalue(L, top);
+		return;
+	}
+
+	lua_pushnil(L);
+	for (i = top; i >= base; i--) { /* Look up the first key in each scope */
+		if (!lua_istable(L, i))
+			continue;
+		lua_pop(L, 1);
+		lua_rawgeti(L, keys, (int)op->start);
+		lua_gettable(L, i);
+		if (!lua_isnil(L, -1))
+			break;
+	}
+	for (k = 1; k < op->len && !lua_isnil(L, -1); k++) {
+		if (!lua_istable(L, -1)) {
+			lua_pop(L, 1);
+			lua_pushnil(L);
+			break;
+		}
+		lua_rawgeti(L, keys, (int)(op->start + k));
+		lua_gettable(L, -2);
+		lua_remove(L, -2);
+	}
+}
+
+/* Adds len bytes at s to the Buffer, escaped with esc */
+static void addescaped(Buffer *B, const unsigned char *s, size_t len, int esc) {
+	static const char hex[] = "0123456789ABCDEF";
+	size_t i, start = 0;
+	char *b;
+
+	if (esc == ESC_RAW) {
+		b = prepbuffsize(B, len);
+		memcpy(b, s, len);
+		addsize(B, len);
+		return;
+	}
+
+	for (i = 0; i < len; i++) { /* Copy runs of bytes that don't need escaping in one go */
+		unsigned char c = s[i];
+		const char *rep = NULL;
+		char pct[3];
+		size_t replen;
+		if (esc == ESC_HTML) {
+			switch (c) {
+				case '&': rep = "&amp;"; break;
+				case '<': rep = "&lt;"; break;
+				case '>': rep = "&gt;"; break;
+				case '"': rep = "&quot;"; break;
+				case '\'': rep = "&#39;"; break;
+				default: continue;
+			}
+			replen = strlen(rep);
+		} else {
+			if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_' || c == '.' || c == '~')
+				continue;
+			pct[0] = '%';
+			pct[1] = hex[c >> 4];
+			pct[2] = hex[c & 15];
+			rep = pct;
+			replen = 3;
+		}
+		b = prepbuffsize(B, i - start + replen);
+		memcpy(b, s + start, i - start);
+		memcpy(b + (i - start), rep, replen);
+		addsize(B, i - start + replen);
+		start = i + 1;
+	}
+	b = prepbuffsize(B, len - start);
+	memcpy(b, s + start, len - start);
+	addsize(B, len - start);
+}
+
+/* Adds the value at the top of the stack to the Buffer, escaped with esc, and pops it */
+static void addtemplatevalue(lua_State *L, Buffer *B, int esc) {
+	Buffer *src;
+	const char *s;
+	size_t len;
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		return;
+	}
+	if ((src = testbuffer(L, -1)) != NULL) {
+		if (src == B) { /* Adding the Buffer to itself, copy its contents first */
+			lua_pushlstring(L, B->b, B->n);
+			lua_replace(L, -2);
+			s = lua_tolstring(L, -1, &len);
+		} else {
+			s = src->b;
+			len = src->n;
+		}
+		addescaped(B, (const unsigned char *)s, len, esc);
+		lua_pop(L, 1);
+		return;
+	}
+	if (lua_type(L, -1) == LUA_TSTRING || lua_type(L, -1) == LUA_TNUMBER) {
+		s = lua_tolstring(L, -1, &len);
+	} else {
+		s = luaL_tolstring(L, -1, &len);
+		lua_remove(L, -2);
+	}
+	addescaped(B, (const unsigned char *)s, len, esc);
+	lua_pop(L, 1);
+}
+
+/* Is the value at index i false, nil or an empty table? */
+static int isfalsy(lua_State *L, int i) {
+	if (!lua_toboolean(L, i))
+		return 1;
+	if (lua_istable(L, i)) {
+		int empty;
+		lua_pushnil(L);
+		empty = lua_next(L, i) == 0;
+		if (!empty)
+			lua_pop(L, 2);
+		return empty;
+	}
+	return 0;
+}
+
+/*
+	Renders operations from to to (exclusive) into the Buffer.
+	The keys table is at index keys and the scopes are at stack indices base to the top of the stack.
+*/
+static void rendertemplate(lua_State *L, Template *T, Buffer *B, size_t from, size_t to, int keys, int base) {
+	size_t i = from;
+	int top = lua_gettop(L);
+	luaL_checkstack(L, 8, "template sections nested too deeply");
+	while (i < to) {
+		const TemplateOp *op = &T->ops[i];
+		switch (op->type) {
+			case TOP_TEXT: {
+				char *b = prepbuffsize(B, op->len);
+				memcpy(b, T->src + op->start, op->len);
+				addsize(B, op->len);
+				i++;
+				break;
+			}
+			case TOP_VALUE:
+				pushpath(L, op, keys, base, top);
+				addtemplatevalue(L, B, op->esc);
+				i++;
+				break;
+			case TOP_SECTION:
+			case TOP_INVERTED: {
+				size_t end = op->jump;
+				int value;
+				pushpath(L, op, keys, base, top);
+				value = lua_gettop(L);
+				if (op->type == TOP_INVERTED) {
+					if (isfalsy(L, value))
+						rendertemplate(L, T, B, i + 1, end, keys, base);
+				} else if (!isfalsy(L, value)) {
+					lua_Integer n = lua_istable(L, value) ? (lua_Integer)lua_rawlen(L, value) : 0, k;
+					if (n > 0) { /* An array, render the section for each element */
+						for (k = 1; k <= n; k++) {
+							lua_rawgeti(L, value, (int)k);
+							rendertemplate(L, T, B, i + 1, end, keys, base);
+							lua_pop(L, 1);
+						}
+					} else { /* Any other value is the innermost scope */
+						rendertemplate(L, T, B, i + 1, end, keys, base);
+					}
+				}
+				lua_settop(L, top);
+				i = end + 1;
+				break;
+			}
+			default: /* TOP_END is skipped by the section */
+				i++;
+				break;
+		}
+	}
+}
+
+/**
+Renders the template into a @{Buffer}.
+
+@function render
+@tparam Buffer buff The Buffer to add the output to.
+@param env The outermost scope, usually a table.
+@treturn Buffer The Buffer object.
+*/
+static int bufflib_templaterender(lua_State *L) {
+	Template *T = gettemplate(L, 1);
+	Buffer *B = getbuffer(L, 2);
+	lua_settop(L, 3);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, T->keysref); /* keys at 4 */
+	lua_pushvalue(L, 3); /* The environment is the outermost scope, at 5 */
+	rendertemplate(L, T, B, 0, T->nops, 4, 5);
+	return pushbuffer(L, 2);
+}
+
+/*
+Garbage collection metamethod. This should never be called by the user, so it's not included in the documentation.
+Frees the Template's operations and releases its keys table.
+*/
+static int bufflib_templategc(lua_State *L) {
+	Template *T = (Template *)lua_touserdata(L, 1);
+	if (T != NULL) {
+		if (T->ops != NULL)
+			T->allocf(T->allocud, T->ops, T->size * sizeof(TemplateOp), 0);
+		T->ops = NULL;
+		T->size = T->nops = 0;
+		luaL_unref(L, LUA_REGISTRYINDEX, T->keysref);
+		T->keysref = LUA_NOREF;
+	}
+	return 0;
+}
+
+/**
+Writes integers of any number of bits to a @{Buffer}, created by @{Buffer:bits|`buff:bits()`}.
+Bits are collected in a register and added to the Buffer a byte at a time as they fill up, most significant bit first.
+They can be read back with @{Buffer:readbits|`buff:readbits`}.
+
+@type BitWriter
+*/
+
+/* Returns the BitWriter at index i, raising an error if the value isn't a BitWriter */
+#define getbitwriter(L, i) ((BitWriter *)luaL_checkudata(L, i, BITWRITERTYPE))
+
+/* Pushes the BitWriter's Buffer and returns it */
+static Buffer *getwriterbuffer(lua_State *L, int i) {
+	getuservalue(L, i);
+	lua_rawgeti(L, -1, 1);
+	lua_remove(L, -2);
+	return getbuffer(L, lua_gettop(L));
+}
+
+/* Adds the low n (at most 16) bits of v to the writer, adding any whole bytes to the Buffer */
+static void putbits(BitWriter *W, Buffer *B, U32 v, int n) {
+	char *b = prepbuffsize(B, 3);
+	size_t k = 0;
+	W->acc = ((W->acc << n) | (v & ((1U << n) - 1))) & 0xffffffU; /* At most 7 + 16 bits are pending */
+	W->count += n;
+	while (W->count >= 8) {
+		W->count -= 8;
+		b[k++] = (char)(W->acc >> W->count);
+	}
+	addsize(B, k);
+}
+
+/* Adds the low n (at most 32) bits of v */
+static void putword(BitWriter *W, Buffer *B, U32 v, int n) {
+	if (n > 16) {
+		putbits(W, B, v >> 16, n - 16);
+		n = 16;
+	}
+	putbits(W, B, v, n);
+}
+
+/**
+Adds the low bits of an integer.
+
+@function put
+@int value The integer. Negative numbers are written as their 64-bit two's complement.
+@int nbits The number of bits to add, from 1 to 64.
+@treturn BitWriter The writer.
+*/
+static int bufflib_bitwriterput(lua_State *L) {
+	BitWriter *W = getbitwriter(L, 1);
+	lua_Integer n = luaL_checkinteger(L, 3);
+	Buffer *B;
+	U32 hi, lo;
+	int nbits = (int)n;
+	checkint64(L, 2, &hi, &lo);
+	luaL_argcheck(L, n >= 1 && n <= 64, 3, "out of range");
+	B = getwriterbuffer(L, 1);
+	if (nbits > 32) {
+		putword(W, B, hi, nbits - 32);
+		nbits = 32;
+	}
+	putword(W, B, lo, nbits);
+	lua_settop(L, 1);
+	return 1;
+}
+
+/**
+Adds any pending bits to the @{Buffer}, padded to a whole byte with zeros.
+
+@function flush
+@treturn Buffer The Buffer.
+*/
+static int bufflib_bitwriterflush(lua_State *L) {
+	BitWriter *W = getbitwriter(L, 1);
+	Buffer *B = getwriterbuffer(L, 1);
+	if (W->count > 0)
+		putbits(W, B, 0, 8 - W->count);
+	return 1;
+}
+
+/**
+Buffer Manipulation.
+
+The functions in this section are available in the `bufflib` table, returned from `require"bufflib"`.
+
+@section manipulation
+*/
+
+/* The keys recognised in the options table passed to bufflib.new */
+static const char *const bufferoptions[] = {"inplace", "mode", "inline", "maxsize", NULL};
+
+/* Is the value at index i an options table (a table without a metatable that has at least one of the keys in bufferoptions)? */
+static int isoptions(lua_State *L, int i) {
+	const char *const *opt;
+	int found = 0;
+
+	if (lua_type(L, i) != LUA_TTABLE)
+		return 0;
+	if (lua_getmetatable(L, i)) {
+		lua_pop(L, 1);
+		return 0;
+	}
+	for (opt = bufferoptions; *opt != NULL && !found; opt++) {
+		lua_getfield(L, i, *opt);
+		found = !lua_isnil(L, -1);
+		lua_pop(L, 1);
+	}
+	return found;
+}
+
+/*
+	Returns the inline size set by the options table at index i (see isoptions), or LUAL_BUFFERSIZE if there isn't one.
+	The inline size is never more than the maxsize option (which is checked by setoptions), so the Buffer starts within its limit.
+*/
+static size_t inlineoption(lua_State *L, int i) {
+	lua_Integer size = LUAL_BUFFERSIZE;
+	if (!isoptions(L, i))
+		return (size_t)size;
+	lua_getfield(L, i, "inline");
+	if (!lua_isnil(L, -1)) {
+		if (lua_type(L, -1) != LUA_TNUMBER)
+			luaL_error(L, "option 'inline' must be a number");
+		size = lua_tointeger(L, -1);
+		if (size < 0 || size > LUAL_BUFFERSIZE)
+			luaL_error(L, "option 'inline' must be from 0 to %d", (int)LUAL_BUFFERSIZE);
+	}
+	lua_getfield(L, i, "maxsize");
+	if (lua_type(L, -1) == LUA_TNUMBER && lua_tointeger(L, -1) >= 0 && lua_tointeger(L, -1) < size)
+		size = lua_tointeger(L, -1);
+	lua_pop(L, 2);
+	return (size_t)size;
+}
+
+/*
+	If the value at index i is an options table (see isoptions), applies its options to the Buffer and returns 1.
+	Returns 0 for any other value. The inline option is applied when the Buffer is created (see inlineoption).
+*/
+static int setoptions(Buffer *B, int i) {
+	lua_State *L = B->L;
+
+	if (!isoptions(L, i))
+		return 0;
+
+	lua_getfield(L, i, "inplace");
+	if (lua_toboolean(L, -1))
+		B->flags |= BUFFER_INPLACE;
+	lua_pop(L, 1);
+
+	lua_getfield(L, i, "maxsize");
+	if (!lua_isnil(L, -1)) {
+		lua_Integer maxsize = lua_tointeger(L, -1);
+		if (lua_type(L, -1) != LUA_TNUMBER || maxsize < 0)
+			luaL_error(L, "option 'maxsize' must be a non-negative number");
+		B->maxsize = (size_t)maxsize;
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, i, "mode");
+	if (!lua_isnil(L, -1)) {
+		const char *mode = lua_tostring(L, -1);
+		if (mode != NULL && strcmp(mode, "gap") == 0)
+			B->flags |= BUFFER_GAP;
+		else if (mode == NULL || strcmp(mode, "append") != 0)
+			luaL_error(L, "invalid Buffer mode '%s'", mode != NULL ? mode : luaL_typename(L, -1));
+	}
+	lua_pop(L, 1);
+	return 1;
+}
+
+/**
+Creates a new Buffer object, optionally adding some strings to the new Buffer.
+All non-string arguments are converted to strings following the same rules as the `tostring()` function.
+
+If the first argument is a table without a metatable that has any of the following keys, it's used as a table of options for the new Buffer instead of being added to it:
+
+- `inplace` (boolean): If true, concatenating another Buffer to this one with `..` adds the other Buffer's contents to this one instead of creating a new Buffer (see @{Buffer:__concat|`__concat`}).
+- `mode` (string): How the contents are stored. `"append"` (the default) is best for Buffers that are mostly added to.
+`"gap"` keeps the free space at the position of the last @{Buffer:insert|`insert`} or @{Buffer:remove|`remove`}, so a run of edits near each other only costs the size of the edits.
+@{Buffer:byte|`byte`}, @{Buffer:setbyte|`setbyte`}, @{Buffer:sub|`sub`} and `#` work around the gap; every other function moves it back to the end first.
+- `inline` (integer): The size of the space inside the Buffer object for small contents, from 0 to @{buffersize} (the default).
+Contents that don't fit are allocated separately, so a smaller size saves memory when there are many small or empty Buffers.
+- `maxsize` (integer): The most bytes the Buffer may hold. Adding to it beyond this raises a "buffer size limit exceeded" error (see also @{setlimit}).
+
+@function newbuffer
+@tab[opt] options A table of options for the new Buffer.
+@param[opt] ... Some values to add to the new Buffer.
+@treturn Buffer The new Buffer object.
+*/
+static int bufflib_newbuffer(lua_State *L){
+	Buffer *B = newcompactbuffer(L, inlineoption(L, 1));
+	int firstarg = setoptions(B, 1) ? 2 : 1;
+	addstrings(B, firstarg, 1); /* Pass addstrings an offset of 1 to account for the new userdata at the top of the stack. */
+	return 1; /* The new Buffer is already on the stack */
+}
+
+/**
+Limits the memory allocated for the contents of all @{Buffer|Buffers} in this Lua state (not including the space inside the Buffer objects themselves or mapped Buffers' files).
+This includes the indexes built by the UTF-8 methods, which take about an eighth of the size of the contents on 64-bit platforms.
+Adding to a Buffer that would need more than this raises a "memory limit exceeded" error, which can be caught with `pcall`, leaving the Buffer unchanged.
+A limit below the current usage doesn't free anything, it only stops Buffers from growing.
+
+@function setlimit
+@int[opt] bytes The limit, or nil for no limit.
+@treturn int The previous limit, or nil if there wasn't one.
+*/
+static int bufflib_setlimit(lua_State *L) {
+	Budget *budget = getbudget(L);
+	lua_Integer limit = luaL_optinteger(L, 1, 0);
+	luaL_argcheck(L, limit > 0 || lua_isnoneornil(L, 1), 1, "must be positive");
+	if (budget->limit != 0)
+		lua_pushinteger(L, (lua_Integer)budget->limit);
+	else
+		lua_pushnil(L);
+	budget->limit = (size_t)limit;
+	return 1;
+}
+
+/**
+Returns the memory allocated for the contents of all @{Buffer|Buffers} in this Lua state, as counted by @{setlimit}.
+This is kept up to date as Buffers grow and are freed, so it's cheap to call.
+
+@function usage
+@treturn int The bytes allocated.
+@treturn int The limit, or nil if there isn't one.
+*/
+static int bufflib_usage(lua_State *L) {
+	Budget *budget = getbudget(L);
+	lua_pushinteger(L, (lua_Integer)budget->used);
+	if (budget->limit != 0)
+		lua_pushinteger(L, (lua_Integer)budget->limit);
+	else
+		lua_pushnil(L);
+	return 2;
+}
+
+/**
+Sets the number of threads used to process large @{Buffer|Buffers}.
+When a Buffer's contents are at least `minsize` bytes long, @{Buffer:upper|`buff:upper`}, @{Buffer:lower|`buff:lower`}, @{Buffer:translate|`buff:translate`} (without deletions),
+@{Buffer:find|`buff:find`} and the UTF-8 methods (when they build their index) split them into chunks and process them on that many threads, including the calling thread.
+The methods still return once they're finished and give the same results as they do on a single thread.
+
+The worker threads are shared by every Lua state in the process that has loaded bufflib, and are stopped when the last of them is closed.
+If the workers are busy with another state's task, a task runs on the calling thread alone. The default is 1 thread, which never starts any workers.
+
+@function setthreads
+@int n The number of threads, from 1 to 64.
+@int[opt] minsize The smallest contents that are split into chunks. Defaults to the current setting, which is initially 1 MiB.
+@treturn int The previous number of threads.
+@treturn int The previous `minsize`.
+*/
+static int bufflib_setthreads(lua_State *L) {
+	lua_Integer n = luaL_checkinteger(L, 1);
+	lua_Integer minsize = luaL_optinteger(L, 2, -1);
+	size_t oldminsize;
+	int old;
+	luaL_argcheck(L, n >= 1 && n <= POOL_MAXTHREADS, 1, "thread count out of range");
+	luaL_argcheck(L, minsize >= 0 || lua_isnoneornil(L, 2), 2, "must not be negative");
+
+	mutex_lock(&pool.lock);
+	old = pool.target + 1;
+	oldminsize = pool.minsize;
+	if (minsize >= 0)
+		pool.minsize = (size_t)minsize;
+	mutex_unlock(&pool.lock);
+
+	if (poolresize((int)n - 1) != (int)n - 1)
+		return luaL_error(L, "can't start worker threads");
+	lua_pushinteger(L, (lua_Integer)old);
+	lua_pushinteger(L, (lua_Integer)oldminsize);
+	return 2;
+}
+
+/*
+	Garbage collection metamethod of the userdata stored under POOLKEY. The state is being closed, so stop the workers if it's the last one using them.
+	Lua unloads the library after this (its userdata is older), so the workers are gone before their code is.
+*/
+static int bufflib_poolgc(lua_State *L) {
+	int last;
+	(void)L;
+	mutex_lock(&pool.lock);
+	last = --pool.states == 0;
+	mutex_unlock(&pool.lock);
+	if (last)
+		poolresize(0);
+	return 0;
+}
+
+/**
+Tests whether or not the argument is a @{Buffer}.
+
+@function isbuffer
+@param arg The value to check.
+@treturn bool Is this a Buffer?
+*/
+static int bufflib_isbuffer(lua_State *L){
+	lua_pushboolean(L, isbuffer(L, 1));
+	return 1;
+}
+
+/**
+Creates a new mapped Buffer, which stores its contents in a memory mapped file instead of memory allocated by Lua.
+The file is created if it doesn't exist and truncated if it does.
+
+A mapped Buffer supports every Buffer method. When it needs more space, the file is extended and remapped without copying its contents, so the contents can be larger than the available memory.
+While the Buffer is open, the file may be longer than the contents; use @{Buffer:flush|`buff:flush()`} or @{Buffer:close|`buff:close()`} to write the contents and truncate the file to their length.
+The file is also flushed and closed when the Buffer is garbage collected, but any errors are ignored.
+
+Mapped Buffers aren't supported on Windows.
+
+@function mapped
+@string path The path of the file.
+@int[opt=0] initial The number of bytes to reserve in the file initially.
+@treturn[1] Buffer The new Buffer object.
+@return[2] nil
+@treturn[2] string An error message.
+*/
+static int bufflib_mapped(lua_State *L){
+#ifdef MAPPED_SUPPORTED
+	const char *path = luaL_checkstring(L, 1);
+	lua_Integer initial = luaL_optinteger(L, 2, 0);
+	Buffer *B;
+	int fd;
+
+	luaL_argcheck(L, initial >= 0, 2, "initial size must not be negative");
+
+	B = newbuffer(L);
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s: %s", path, strerror(errno));
+		return 2;
+	}
+	B->store = STORE_MAPPED;
+	B->fd = fd;
+	B->size = 0;
+
+	if (initial > 0) {
+		const char *err = growmapped(B, (size_t)initial);
+		if (err != NULL) {
+			freebuffer(B);
+			lua_pushnil(L);
+			lua_pushfstring(L, "%s: %s", path, err);
+			return 2;
+		}
+	}
+	return 1;
+#else
+	return luaL_error(L, "mapped Buffers aren't supported on this platform");
+#endif
+}
+
+/**
+Creates a new @{Shared} Buffer, optionally adding some strings to it.
+All non-string arguments are converted to strings following the same rules as the `tostring()` function.
+
+@function shared
+@param[opt] ... Some values to add to the new Shared Buffer.
+@treturn Shared The new Shared object.
 */
-static int bufflib_len(lua_State *L) {
-	Buffer *B = getbuffer(L, 1);
-	lua_pushinteger(L, B->n);
+static int bufflib_shared(lua_State *L) {
+	SharedStore *S = newshared(L);
+	lua_insert(L, 1); /* Move the new Shared object below the values */
+	sharedaddstrings(L, S, 2);
+	lua_settop(L, 1);
 	return 1;
 }
 
 /**
-Metamethod for the `..` (concatenation) operation.
-If both arguments are @{Buffer|Buffers}, creates a new Buffer from their joined contents.
-Otherwise adds a value to the Buffer, converting it to a string following the same rules as the `tostring()` function.
+Creates a new @{Log}.
 
-@function __concat
-@param B A Buffer to concatenate with this one or some value to to add to it.
-@treturn Buffer Either the new Buffer created from the two Buffer arguments or the Buffer that the non-Buffer argument was added to.
+@function log
+@int capacity The size of each of the Log's two segments in bytes.
+@treturn Log The new Log.
 */
-static int bufflib_concat(lua_State *L) {
-	int arg1IsBuffer = isbuffer(L, 1);
-	int arg2IsBuffer = isbuffer(L, 2);
+static int bufflib_log(lua_State *L) {
+	lua_Integer capacity = luaL_checkinteger(L, 1);
+	Handle *h;
+	LogStore *S;
 
-	if (arg1IsBuffer && arg1IsBuffer) { /* If both arguments are Buffers, combine them into a new Buffer */
-		Buffer *destbuff = newbuffer(L);
+	luaL_argcheck(L, capacity > 0 && (size_t)capacity < SEALBIT, 1, "capacity out of range");
 
-		size_t len1 = -1, len2 = -1;
-		const char *str1, *str2;
-		char *b;
+	h = newhandle(L, LOGTYPE);
+	S = (LogStore *)malloc(sizeof(LogStore));
+	if (S == NULL)
+		return luaL_error(L, "not enough memory");
+	S->segs[0].data = (char *)malloc((size_t)capacity);
+	S->segs[1].data = (char *)malloc((size_t)capacity);
+	if (S->segs[0].data == NULL || S->segs[1].data == NULL) {
+		logdestroy(&S->obj);
+		free(S);
+		return luaL_error(L, "not enough memory");
+	}
 
-		str1 = tolstring(L, 1, &len1);
-		str2 = tolstring(L, 2, &len2);
+	objinit(&S->obj, LOGTYPE, logdestroy);
+	S->capacity = (size_t)capacity;
+	S->active = 0;
+	S->dropped = 0;
+	S->segs[0].reserved = 0;
+	S->segs[0].committed = 0;
+	S->segs[0].end = S->capacity;
+	S->segs[1].reserved = SEALBIT; /* The inactive segment stays sealed until the first drain reopens it */
+	S->segs[1].committed = 0;
+	S->segs[1].end = S->capacity;
+	h->obj = &S->obj;
+	return 1;
+}
 
-		b = prepbuffsize(destbuff, len1 + len2); /* Prepare the Buffer for the combined length of the strings */
-		memcpy(b, str1, len1 * sizeof(char)); /* Add the first string */
-		addsize(destbuff, len1);
+/**
+Compiles a list of strings into a @{Matcher} that finds all of them in a single pass over a @{Buffer} or string.
 
-		b += len1; /* Get a pointer to the position after the first string */
-		memcpy(b, str2, len2 * sizeof(char)); /* Add the second string */
-		addsize(destbuff, len2);
+	local filter = bufflib.matcher({"foo", "bar"}, true)
+	if filter:find(buff) then ... end
 
-		return 1; /* The new Buffer is already on the stack */
-	} else { /* If only one argument is a Buffer, add the non-Buffer argument to it */
-		size_t len = -1;
-		const char *str;
-		char *b;
-		int buffindex;
-		Buffer *destbuff;
+@function matcher
+@tab needles An array of non-empty strings to search for.
+@bool[opt=false] ignorecase If true, ASCII letters match regardless of their case.
+@treturn Matcher The new Matcher.
+*/
+static int bufflib_matcher(lua_State *L) {
+	int ignorecase = lua_toboolean(L, 2);
+	Matcher *M;
+	luaL_checktype(L, 1, LUA_TTABLE);
 
-		if (arg1IsBuffer) {
-			destbuff = getbuffer(L, 1);
-			str = tolstring(L, 2, &len);
-			buffindex = 1;
-		} else {
-			destbuff = getbuffer(L, 2);
-			str = tolstring(L, 1, &len);
-			buffindex = 2;
-		}
+	M = (Matcher *)newudata(L, sizeof(Matcher));
+	M->allocf = lua_getallocf(L, &M->allocud);
+	M->delta = M->term = M->dict = M->out = NULL;
+	M->lens = NULL;
+	M->maxstates = 0;
+	M->nstates = M->nclasses = M->nneedles = 0;
+	luaL_setmetatable(L, MATCHERTYPE); /* Set the metatable first so the arrays are freed if building fails */
+	buildmatcher(L, M, ignorecase);
+	return 1;
+}
 
-		b = prepbuffsize(destbuff, len);
-		memcpy(b, str, len);
-		addsize(destbuff, len);
+/**
+Compiles a @{Template}.
 
-		return pushbuffer(L, buffindex);
-	}
+	local page = bufflib.template("<h1>{{title}}</h1>{{#items}}<li>{{name}}</li>{{/items}}")
+	page:render(buff, {title = "List", items = {{name = "a"}, {name = "b"}}})
+
+@function template
+@string src The template source.
+@treturn Template The new Template.
+@error Raises an error if the source is invalid.
+*/
+static int bufflib_template(lua_State *L) {
+	Template *T;
+	luaL_checkstring(L, 1);
+	lua_settop(L, 1);
+
+	T = (Template *)newudata(L, sizeof(Template)); /* Template at 2 */
+	T->allocf = lua_getallocf(L, &T->allocud);
+	T->ops = NULL;
+	T->nops = T->size = 0;
+	T->src = NULL;
+	T->keysref = LUA_NOREF;
+	luaL_setmetatable(L, TEMPLATETYPE); /* Set the metatable first so the operations are freed if compiling fails */
+
+	lua_newtable(L); /* keys table at 3 */
+	lua_pushvalue(L, 1);
+	lua_rawseti(L, 3, 1); /* keys[1] = src, keeping the literal text alive */
+	compiletemplate(L, T, 3);
+	T->keysref = luaL_ref(L, LUA_REGISTRYINDEX);
+	return 1;
 }
 
 /**
-Metamethod for the `==` (equality) operation.
-Returns true if the @{Buffer|Buffers} hold the same contents, false if they don't.
-The contents of each Buffer are converted to Lua strings and then the two strings are compared to obtain the result.
+Redeems a token created by @{Shared:token|`shared:token()`} or @{Log:token|`log:token()`} (in this or any other lua\_State), returning a new object that refers to the same contents.
 
-@function __eq
-@tparam Buffer buff2 The Buffer to compare with this one.
-@treturn bool equal Do the Buffers hold the same contents?
+@function attach
+@int token The token.
+@return The new @{Shared} or @{Log} object.
 */
-static int bufflib_equal(lua_State *L){
-	Buffer *buff1 = getbuffer(L, 1);
-	Buffer *buff2 = getbuffer(L, 2);
+static int bufflib_attach(lua_State *L) {
+	lua_Integer id = luaL_checkinteger(L, 1);
+	Token **p, *t = NULL;
 
-	lua_pushlstring(L, buff1->b, buff1->n); /* Push the contents of each Buffer onto the stack */
-	lua_pushlstring(L, buff2->b, buff2->n);
+	mutex_lock(&tokenlock);
+	for (p = &tokens; *p != NULL; p = &(*p)->next) {
+		if ((*p)->id == id) {
+			t = *p;
+			*p = t->next; /* Unlink the token, it can only be redeemed once */
+			break;
+		}
+	}
+	mutex_unlock(&tokenlock);
 
-	lua_pushboolean(L, lua_rawequal(L, -1, -2)); /* Return the result of a lua_rawequal comparison of the strings */
+	if (t == NULL)
+		return luaL_argerror(L, 1, "invalid or already redeemed token");
+
+	newhandle(L, t->obj->type)->obj = t->obj; /* The new Handle takes over the token's reference */
+	free(t);
 	return 1;
 }
 
 /*
-Garbage collection metamethod. This should never be called by the user, so it's not included in the documentation.
-If the Buffer is storing its contents as a userdata in the registry, unreferences it; allowing it to be collected
+	Gather writes.
+	Windows has no writev, so it's emulated there by writing each piece in turn.
 */
-static int bufflib_gc(lua_State *L){
-	Buffer *B = getbuffer(L, 1);
-	buff_unref(L, B);
-	return 0;
-}
+#define WRITEV_BATCH 64 /* The maximum number of pieces passed to a single writev call */
 
-/**
-Buffer Manipulation.
+#ifdef _WIN32
+struct iovec {
+	void *iov_base;
+	size_t iov_len;
+};
 
-The functions in this section are available in the `bufflib` table, returned from `require"bufflib"`.
+static long writev(int fd, const struct iovec *iov, int cnt) {
+	long total = 0;
+	int i;
+	for (i = 0; i < cnt; i++) {
+		long w = (long)write(fd, iov[i].iov_base, iov[i].iov_len);
+		if (w < 0)
+			return total > 0 ? total : -1;
+		total += w;
+		if ((size_t)w < iov[i].iov_len)
+			break;
+	}
+	return total;
+}
+#endif
 
-@section manipulation
+/*
+	Returns a pointer to the contents of the Buffer or string at index i of the table at index t and stores their length in len.
+	The contents stay valid while the table holds them, since nothing calls back into Lua while they're being written.
 */
+static const char *getpiece(lua_State *L, int t, lua_Integer i, size_t *len) {
+	const char *s;
+	rawgetinteger(L, t, i);
+	if (isbuffer(L, -1)) {
+		Buffer *B = testbuffer(L, -1);
+		s = B->b;
+		*len = B->n;
+	} else if (lua_type(L, -1) == LUA_TSTRING) {
+		s = lua_tolstring(L, -1, len);
+	} else {
+		const char *tname = luaL_typename(L, -1); /* Before pushing the index's string */
+		s = NULL;
+		luaL_error(L, "bad element #%s in list (string or Buffer expected, got %s)", pushintstring(L, i), tname);
+	}
+	lua_pop(L, 1);
+	return s;
+}
 
 /**
-Creates a new Buffer object, optionally adding some strings to the new Buffer.
-All non-string arguments are converted to strings following the same rules as the `tostring()` function.
+Writes a list of @{Buffer|Buffers} and strings to a file handle or file descriptor with a single system call where possible (`writev`), without concatenating them first.
+Partial writes are retried until everything has been written. If the file descriptor is non-blocking and would block, the number of bytes written so far is returned;
+pass it back as `skip` to resume from where the previous call stopped.
 
-@function newbuffer
-@param[opt] ... Some values to add to the new Buffer.
-@treturn Buffer The new Buffer object.
+@function writev
+@param dest A file handle (as returned by `io.open`) or an integer file descriptor. File handles are flushed before writing.
+@tab list An array of Buffers and strings to write, in order.
+@int[opt=0] skip The number of bytes at the start of the list to skip, usually the result of a previous call that didn't finish.
+@treturn int The number of bytes of the list written so far, including `skip`. This is the total length of the list if everything was written.
+@error If writing fails, returns nil followed by an error message and the number of bytes of the list written so far.
 */
-static int bufflib_newbuffer(lua_State *L){
-	Buffer *B = newbuffer(L);
-	addstrings(B, 1, 1); /* Pass addstrings an offset of 1 to account for the new userdata at the top of the stack. */
-	return 1; /* The new Buffer is already on the stack */
-}
+static int bufflib_writev(lua_State *L) {
+	FILE *f = tofile(L, 1);
+	struct iovec iov[WRITEV_BATCH];
+	lua_Integer n, i = 1, skip;
+	size_t written, off, len;
+	const char *s = NULL;
+	int fd;
 
-/**
-Tests whether or not the argument is a @{Buffer}.
+	if (f != NULL) {
+		fflush(f);
+#ifdef _WIN32
+		fd = _fileno(f);
+#else
+		fd = fileno(f);
+#endif
+	} else {
+		fd = (int)luaL_checkinteger(L, 1);
+	}
+	luaL_checktype(L, 2, LUA_TTABLE);
+	skip = luaL_optinteger(L, 3, 0);
+	luaL_argcheck(L, skip >= 0, 3, "must not be negative");
+	n = (lua_Integer)lua_rawlen(L, 2);
 
-@function isbuffer
-@param arg The value to check.
-@treturn bool Is this a Buffer?
-*/
-static int bufflib_isbuffer(lua_State *L){
-	lua_pushboolean(L, isbuffer(L, 1));
+	/* Find the piece and offset to start from */
+	written = 0;
+	off = (size_t)skip;
+	for (; i <= n; i++) {
+		s = getpiece(L, 2, i, &len);
+		if (off < len)
+			break;
+		off -= len;
+		written += len;
+	}
+	if (i > n) {
+		lua_pushinteger(L, (lua_Integer)written);
+		return 1;
+	}
+	written += off;
+
+	while (i <= n) {
+		lua_Integer j = i;
+		size_t curlen = len, curoff = off;
+		const char *cur = s;
+		int cnt = 0;
+		long w;
+
+		/* Gather the next batch of pieces, starting partway through the current one */
+		while (cnt < WRITEV_BATCH && j <= n) {
+			if (curlen > curoff) {
+				iov[cnt].iov_base = (void *)(cur + curoff);
+				iov[cnt].iov_len = curlen - curoff;
+				cnt++;
+			}
+			if (++j <= n) {
+				cur = getpiece(L, 2, j, &curlen);
+				curoff = 0;
+			}
+		}
+
+		if (cnt == 0)
+			break;
+
+		w = (long)writev(fd, iov, cnt);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+#ifdef EWOULDBLOCK
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+#else
+			if (errno == EAGAIN)
+#endif
+				break;
+			lua_pushnil(L);
+			lua_pushstring(L, strerror(errno));
+			lua_pushinteger(L, (lua_Integer)written);
+			return 3;
+		}
+
+		/* Advance past the written bytes */
+		written += (size_t)w;
+		while (i <= n && (size_t)w >= len - off) {
+			w -= (long)(len - off);
+			off = 0;
+			if (++i <= n)
+				s = getpiece(L, 2, i, &len);
+		}
+		off += (size_t)w;
+	}
+
+	lua_pushinteger(L, (lua_Integer)written);
 	return 1;
 }
 
@@ -554,6 +6041,291 @@ Equivalent to @{Buffer:reset|`buff:reset()`}.
 @treturn Buffer The emptied Buffer object.
 */
 
+/**
+Equivalent to @{Buffer:flush|`buff:flush()`}.
+@function flush
+@tparam Buffer buff The Buffer to flush.
+@treturn[1] Buffer The Buffer object.
+@return[2] nil
+@treturn[2] string An error message.
+*/
+
+/**
+Equivalent to @{Buffer:close|`buff:close()`}.
+@function close
+@tparam Buffer buff The Buffer to close.
+@treturn[1] bool true
+@return[2] nil
+@treturn[2] string An error message.
+*/
+
+/**
+Equivalent to @{Buffer:addbuffer|`buff:addbuffer(other, i, j)`}.
+@function addbuffer
+@tparam Buffer buff The Buffer to add to.
+@tparam Buffer other The Buffer to copy from.
+@int[opt=1] i The position of the first character to copy.
+@int[opt=-1] j The position of the last character to copy.
+@treturn Buffer The Buffer object.
+*/
+
+/**
+Equivalent to @{Buffer:addtable|`buff:addtable(t, sep, i, j)`}.
+@function addtable
+@tparam Buffer buff The Buffer to add to.
+@tab t The array.
+@string[opt=""] sep The string to add between each element.
+@int[opt=1] i The index of the first element to add.
+@int[opt=#t] j The index of the last element to add.
+@treturn Buffer The Buffer object.
+*/
+
+/**
+Equivalent to @{Buffer:compress|`buff:compress(level)`}.
+@function compress
+@tparam Buffer buff The Buffer to compress.
+@int[opt=9] level The compression level, from 1 to 9.
+@treturn Buffer The new Buffer holding the compressed frame.
+*/
+
+/**
+Equivalent to @{Buffer:addcompressed|`buff:addcompressed(src, level)`}.
+@function addcompressed
+@tparam Buffer buff The Buffer to add the compressed frame to.
+@param src The string or Buffer to compress.
+@int[opt=9] level The compression level, from 1 to 9.
+@treturn Buffer The Buffer object.
+*/
+
+/**
+Equivalent to @{Buffer:adddecompressed|`buff:adddecompressed(src, pos)`}.
+@function adddecompressed
+@tparam Buffer buff The Buffer to add the decompressed contents to.
+@param src The string or Buffer holding the compressed frames.
+@int[opt=1] pos The position of the first frame in `src`.
+@treturn Buffer The Buffer object.
+@treturn int The position after the last complete frame.
+*/
+
+/**
+Equivalent to @{Buffer:utf8valid|`buff:utf8valid()`}.
+@function utf8valid
+@tparam Buffer buff The Buffer to check.
+@treturn bool Are the contents valid UTF-8?
+@treturn int If they aren't, the position of the first invalid byte sequence.
+*/
+
+/**
+Equivalent to @{Buffer:utf8len|`buff:utf8len()`}.
+@function utf8len
+@tparam Buffer buff The Buffer.
+@treturn int The number of codepoints.
+*/
+
+/**
+Equivalent to @{Buffer:utf8sub|`buff:utf8sub(i, j)`}.
+@function utf8sub
+@tparam Buffer buff The Buffer.
+@int[opt=1] i The position of the first codepoint.
+@int[opt=-1] j The position of the last codepoint.
+@treturn string The substring.
+*/
+
+/**
+Equivalent to @{Buffer:addcodepoint|`buff:addcodepoint(...)`}.
+@function addcodepoint
+@tparam Buffer buff The Buffer to add to.
+@int ... The codepoints.
+@treturn Buffer The Buffer object.
+*/
+
+/**
+Equivalent to @{Buffer:upper|`buff:upper()`}.
+@function upper
+@tparam Buffer buff The Buffer to convert.
+@treturn Buffer The Buffer object.
+*/
+
+/**
+Equivalent to @{Buffer:lower|`buff:lower()`}.
+@function lower
+@tparam Buffer buff The Buffer to convert.
+@treturn Buffer The Buffer object.
+*/
+
+/**
+Equivalent to @{Buffer:translate|`buff:translate(from, to, delete)`}.
+@function translate
+@tparam Buffer buff The Buffer to translate.
+@string from The bytes to replace.
+@string to The replacement bytes.
+@string[opt] delete The bytes to remove.
+@treturn Buffer The Buffer object.
+*/
+
+/**
+Equivalent to @{Buffer:byte|`buff:byte(i, j)`}.
+@function byte
+@tparam Buffer buff The Buffer.
+@int[opt=1] i The position of the first byte.
+@int[opt=i] j The position of the last byte.
+@treturn int... The byte codes.
+*/
+
+/**
+Equivalent to @{Buffer:setbyte|`buff:setbyte(i, ...)`}.
+@function setbyte
+@tparam Buffer buff The Buffer.
+@int i The position of the first byte to set.
+@int ... The byte codes.
+@treturn Buffer The Buffer object.
+*/
+
+/**
+Equivalent to @{Buffer:sub|`buff:sub(i, j)`}.
+@function sub
+@tparam Buffer buff The Buffer.
+@int[opt=1] i The position of the first byte.
+@int[opt=-1] j The position of the last byte.
+@treturn string The substring.
+*/
+
+/**
+Equivalent to @{Buffer:truncate|`buff:truncate(n)`}.
+@function truncate
+@tparam Buffer buff The Buffer to shorten.
+@int n The new length.
+@treturn Buffer The Buffer object.
+*/
+
+/**
+Equivalent to @{Buffer:insert|`buff:insert(pos, s)`}.
+@function insert
+@tparam Buffer buff The Buffer to insert into.
+@int pos The position.
+@param s The string or Buffer to insert.
+@treturn Buffer The Buffer object.
+*/
+
+/**
+Equivalent to @{Buffer:remove|`buff:remove(i, j)`}.
+@function remove
+@tparam Buffer buff The Buffer to remove from.
+@int i The position of the first byte to remove.
+@int[opt=i] j The position of the last byte to remove.
+@treturn Buffer The Buffer object.
+*/
+
+/**
+Equivalent to @{Buffer:find|`buff:find(s, init)`}.
+@function find
+@tparam Buffer buff The Buffer to search.
+@param s The string or Buffer to search for.
+@int[opt=1] init The position to start searching from.
+@treturn int The position of the first byte of the match, or nil if there isn't one.
+@treturn int The position of the last byte of the match.
+*/
+
+/**
+Equivalent to @{Buffer:addlua|`buff:addlua(value, opts)`}.
+@function addlua
+@tparam Buffer buff The Buffer to add to.
+@param value The value to serialise.
+@tab[opt] opts Options.
+@treturn Buffer The Buffer object.
+*/
+
+/**
+Equivalent to @{Buffer:addmsgpack|`buff:addmsgpack(...)`}.
+@function addmsgpack
+@tparam Buffer buff The Buffer to add to.
+@param ... The values to encode.
+@treturn Buffer The Buffer object.
+*/
+
+/**
+Equivalent to @{Buffer:unpackmsg|`buff:unpackmsg(pos)`}, but also accepts a string.
+@function unpackmsg
+@param src The Buffer or string to decode from.
+@int[opt=1] pos The position of the message in `src`.
+@return The decoded value, or nil if the message is incomplete.
+@treturn int The position after the message, or nil if the message is incomplete.
+*/
+
+/**
+Equivalent to @{Buffer:addcsvrow|`buff:addcsvrow(t, opts)`}.
+@function addcsvrow
+@tparam Buffer buff The Buffer to add to.
+@tab t The fields of the row.
+@tab[opt] opts Options.
+@treturn Buffer The Buffer object.
+*/
+
+/**
+Equivalent to @{Buffer:addvarint|`buff:addvarint(...)`}.
+@function addvarint
+@tparam Buffer buff The Buffer to add to.
+@int ... The integers to add.
+@treturn Buffer The Buffer object.
+*/
+
+/**
+Equivalent to @{Buffer:addzigzag|`buff:addzigzag(...)`}.
+@function addzigzag
+@tparam Buffer buff The Buffer to add to.
+@int ... The integers to add.
+@treturn Buffer The Buffer object.
+*/
+
+/**
+Equivalent to @{Buffer:readvarint|`buff:readvarint(pos)`}, but also accepts a string.
+@function readvarint
+@param src The Buffer or string to read from.
+@int[opt=1] pos The position of the varint in `src`.
+@treturn int The value, or nil if the varint is incomplete.
+@treturn int The position after the varint.
+*/
+
+/**
+Equivalent to @{Buffer:readzigzag|`buff:readzigzag(pos)`}, but also accepts a string.
+@function readzigzag
+@param src The Buffer or string to read from.
+@int[opt=1] pos The position of the varint in `src`.
+@treturn int The value, or nil if the varint is incomplete.
+@treturn int The position after the varint.
+*/
+
+/**
+Equivalent to @{Buffer:readbits|`buff:readbits(offset, nbits)`}, but also accepts a string.
+@function readbits
+@param src The Buffer or string to read from.
+@int offset The offset of the first bit, starting from 0.
+@int nbits The number of bits to read, from 1 to 64.
+@treturn int The value, or nil if `src` ends before the bits do.
+@treturn int The offset after the bits.
+*/
+
+/**
+Equivalent to @{Buffer:bits|`buff:bits()`}.
+@function bits
+@tparam Buffer buff The Buffer to add to.
+@treturn BitWriter The new writer.
+*/
+
+/**
+Equivalent to @{Buffer:clone|`buff:clone()`}.
+@function clone
+@tparam Buffer buff The Buffer to clone.
+@treturn Buffer The new Buffer.
+*/
+
+/**
+Equivalent to @{Buffer:take|`buff:take()`}.
+@function take
+@tparam Buffer buff The Buffer to take the contents of.
+@treturn string The Buffer's contents.
+*/
+
 /**
 Equivalent to `tostring(buff)` or @{Buffer:__tostring|`buff:__tostring()`}.
 @function tostring
@@ -585,9 +6357,8 @@ Equivalent to `buff1 == buff2` or @{Buffer:__eq|`buff1:__eq(buff2)`}.
 */
 
 /**
-The initial length of the char array used by @{Buffer|Buffers}.
-This is set by the value of the LUAL_BUFFERSIZE macro defined in luaconf.h.
-This field is not actually used by lua_bufflib, so changing it won't affect the length of new Buffers.
+The length of the space inside each @{Buffer} object for small contents, unless the `inline` option of @{newbuffer|`bufflib.new`} sets a smaller one.
+This is set by the value of the LUAL_BUFFERSIZE macro defined in luaconf.h. Changing this field doesn't affect new Buffers.
 @int buffersize
 */
 
@@ -597,9 +6368,84 @@ static struct luaL_Reg metareg[] = {
 	{"__len", bufflib_len},
 	{"__tostring", bufflib_tostring},
 	{"__gc", bufflib_gc},
+	{"__close", bufflib_close},
 	{"add", bufflib_add},
 	{"addsep", bufflib_addsep},
 	{"reset", bufflib_reset},
+	{"flush", bufflib_flush},
+	{"close", bufflib_closebuffer},
+	{"compress", bufflib_compress},
+	{"addcompressed", bufflib_addcompressed},
+	{"adddecompressed", bufflib_adddecompressed},
+	{"addbuffer", bufflib_addbuffer},
+	{"addtable", bufflib_addtable},
+	{"utf8valid", bufflib_utf8valid},
+	{"utf8len", bufflib_utf8len},
+	{"utf8sub", bufflib_utf8sub},
+	{"addcodepoint", bufflib_addcodepoint},
+	{"upper", bufflib_upper},
+	{"lower", bufflib_lower},
+	{"translate", bufflib_translate},
+	{"byte", bufflib_byte},
+	{"setbyte", bufflib_setbyte},
+	{"sub", bufflib_sub},
+	{"truncate", bufflib_truncate},
+	{"insert", bufflib_insert},
+	{"remove", bufflib_remove},
+	{"find", bufflib_find},
+	{"addlua", bufflib_addlua},
+	{"addmsgpack", bufflib_addmsgpack},
+	{"unpackmsg", bufflib_unpackmsg},
+	{"addcsvrow", bufflib_addcsvrow},
+	{"addvarint", bufflib_addvarint},
+	{"addzigzag", bufflib_addzigzag},
+	{"readvarint", bufflib_readvarint},
+	{"readzigzag", bufflib_readzigzag},
+	{"readbits", bufflib_readbits},
+	{"bits", bufflib_bits},
+	{"clone", bufflib_clone},
+	{"take", bufflib_take},
+	{NULL, NULL}
+};
+
+static struct luaL_Reg sharedreg[] = {
+	{"__len", bufflib_sharedlen},
+	{"__tostring", bufflib_sharedtostring},
+	{"__gc", bufflib_handlegc},
+	{"add", bufflib_sharedadd},
+	{"addto", bufflib_sharedaddto},
+	{"reset", bufflib_sharedreset},
+	{"token", bufflib_sharedtoken},
+	{NULL, NULL}
+};
+
+static struct luaL_Reg logreg[] = {
+	{"__gc", bufflib_handlegc},
+	{"add", bufflib_logadd},
+	{"capacity", bufflib_logcapacity},
+	{"drain", bufflib_logdrain},
+	{"dropped", bufflib_logdropped},
+	{"token", bufflib_logtoken},
+	{NULL, NULL}
+};
+
+static struct luaL_Reg templatereg[] = {
+	{"__gc", bufflib_templategc},
+	{"render", bufflib_templaterender},
+	{NULL, NULL}
+};
+
+static struct luaL_Reg matcherreg[] = {
+	{"__gc", bufflib_matchergc},
+	{"count", bufflib_matchercount},
+	{"each", bufflib_matchereach},
+	{"find", bufflib_matcherfind},
+	{NULL, NULL}
+};
+
+static struct luaL_Reg bitwriterreg[] = {
+	{"flush", bufflib_bitwriterflush},
+	{"put", bufflib_bitwriterput},
 	{NULL, NULL}
 };
 
@@ -612,7 +6458,50 @@ static struct luaL_Reg libreg[] = {
 	{"new", bufflib_newbuffer},
 	{"reset", bufflib_reset},
 	{"tostring", bufflib_tostring},
+	{"flush", bufflib_flush},
+	{"close", bufflib_closebuffer},
+	{"compress", bufflib_compress},
+	{"addcompressed", bufflib_addcompressed},
+	{"adddecompressed", bufflib_adddecompressed},
+	{"addbuffer", bufflib_addbuffer},
+	{"addtable", bufflib_addtable},
+	{"utf8valid", bufflib_utf8valid},
+	{"utf8len", bufflib_utf8len},
+	{"utf8sub", bufflib_utf8sub},
+	{"addcodepoint", bufflib_addcodepoint},
+	{"upper", bufflib_upper},
+	{"lower", bufflib_lower},
+	{"translate", bufflib_translate},
+	{"byte", bufflib_byte},
+	{"setbyte", bufflib_setbyte},
+	{"sub", bufflib_sub},
+	{"truncate", bufflib_truncate},
+	{"insert", bufflib_insert},
+	{"remove", bufflib_remove},
+	{"find", bufflib_find},
+	{"addlua", bufflib_addlua},
+	{"addmsgpack", bufflib_addmsgpack},
+	{"unpackmsg", bufflib_unpackmsg},
+	{"addcsvrow", bufflib_addcsvrow},
+	{"addvarint", bufflib_addvarint},
+	{"addzigzag", bufflib_addzigzag},
+	{"readvarint", bufflib_readvarint},
+	{"readzigzag", bufflib_readzigzag},
+	{"readbits", bufflib_readbits},
+	{"bits", bufflib_bits},
+	{"clone", bufflib_clone},
+	{"take", bufflib_take},
 	{"isbuffer", bufflib_isbuffer},
+	{"mapped", bufflib_mapped},
+	{"shared", bufflib_shared},
+	{"attach", bufflib_attach},
+	{"log", bufflib_log},
+	{"matcher", bufflib_matcher},
+	{"template", bufflib_template},
+	{"writev", bufflib_writev},
+	{"setlimit", bufflib_setlimit},
+	{"usage", bufflib_usage},
+	{"setthreads", bufflib_setthreads},
 	{NULL, NULL}
 };
 
@@ -624,9 +6513,57 @@ EXPORT int luaopen_bufflib(lua_State *L) {
 	lua_pushcfunction(L, bufflib_index);
 	lua_setfield(L, -2, "__index"); /* mt.__index = bufflib_index */
 	
+	luaL_newmetatable(L, SHAREDTYPE); /* Create the Shared metatable */
+	luaL_setfuncs(L, sharedreg, 0);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index"); /* mt.__index = mt */
+	lua_pop(L, 1);
+	
+	luaL_newmetatable(L, LOGTYPE); /* Create the Log metatable */
+	luaL_setfuncs(L, logreg, 0);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index"); /* mt.__index = mt */
+	lua_pop(L, 1);
+	
+	luaL_newmetatable(L, MATCHERTYPE); /* Create the Matcher metatable */
+	luaL_setfuncs(L, matcherreg, 0);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index"); /* mt.__index = mt */
+	lua_pop(L, 1);
+	
+	luaL_newmetatable(L, TEMPLATETYPE); /* Create the Template metatable */
+	luaL_setfuncs(L, templatereg, 0);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index"); /* mt.__index = mt */
+	lua_pop(L, 1);
+	
+	luaL_newmetatable(L, BITWRITERTYPE); /* Create the BitWriter metatable */
+	luaL_setfuncs(L, bitwriterreg, 0);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index"); /* mt.__index = mt */
+	lua_pop(L, 1);
+	
 	luaL_newlib(L, libreg); /* Create the library table */
 	lua_pushinteger(L, LUAL_BUFFERSIZE);
 	lua_setfield(L, -2, "buffersize");
+	lua_pushlightuserdata(L, (void *)&ffiapi);
+	lua_setfield(L, -2, FFIAPI); /* Used by bufflib/ffi.lua, not part of the documented API */
+	lua_pushlightuserdata(L, (void *)&ffiapi);
+	lua_setfield(L, LUA_REGISTRYINDEX, BUFFLIB_API_KEY); /* Used by other C modules through bufflib.h */
+	
+	lua_getfield(L, LUA_REGISTRYINDEX, POOLKEY);
+	if (lua_isnil(L, -1)){ /* The first time the library is opened in this state, count the state as a user of the worker pool */
+		newudata(L, 1);
+		lua_createtable(L, 0, 1);
+		lua_pushcfunction(L, bufflib_poolgc);
+		lua_setfield(L, -2, "__gc");
+		lua_setmetatable(L, -2);
+		lua_setfield(L, LUA_REGISTRYINDEX, POOLKEY);
+		mutex_lock(&pool.lock);
+		pool.states++;
+		mutex_unlock(&pool.lock);
+	}
+	lua_pop(L, 1);
 	
 	lua_getglobal(L, "string");
 	if (lua_isnil(L, -1)){ /* If there's no string table, return now */
@@ -98,6 +98,721 @@ assert(testbuff:s_upper() == teststr:upper(), "s_upper failed")
 
 print("String method tests passed")
 
+-- Coroutine and to-be-closed variable tests
+do
+	local cobuff = bufflib.new(teststr)
+	local co = coroutine.wrap(function(...)
+		cobuff:add(...)
+		coroutine.yield()
+		cobuff:addsep(testsep, teststr, teststr)
+	end)
+	co(teststr, testlongstr)
+	co()
+	assert(tostring(cobuff) == teststr .. teststr .. testlongstr .. teststr .. testsep .. teststr, "add from coroutine failed")
+
+	if _VERSION >= "Lua 5.4" then
+		local closefunc = assert((loadstring or load)([[
+			local bufflib, str = ...
+			local outer
+			do
+				local buff <close> = bufflib.new(str)
+				outer = buff
+			end
+			return outer
+		]]))
+		assert(#closefunc(bufflib, testlongstr) == 0, "__close failed")
+	end
+end
+print("Coroutine and close tests passed")
+
+-- Shared Buffer tests
+do
+	local shared = bufflib.shared(teststr, testtab)
+	assert(tostring(shared) == teststr .. testtabstr, "shared creation failed")
+	shared:add(testlongstr)
+	assert(#shared == #teststr + #testtabstr + #testlongstr, "shared add/length failed")
+
+	local token = shared:token()
+	local attached = bufflib.attach(token)
+	attached:add(teststr)
+	assert(tostring(shared) == tostring(attached), "shared attach failed")
+	assert(not pcall(bufflib.attach, token), "shared token redeemed twice")
+
+	assert(tostring(attached:addto(bufflib.new(teststr))) == teststr .. tostring(shared), "shared addto failed")
+	assert(#shared:reset() == 0 and #attached == 0, "shared reset failed")
+
+	-- Converting to a string mustn't hold the lock while a collection may finalise another object referring to the same contents
+	shared:add(testlongstr)
+	local pause = collectgarbage("setpause", 0)
+	for i = 1, 200 do
+		bufflib.attach(shared:token())
+		assert(tostring(shared) == testlongstr, "shared tostring failed")
+	end
+	collectgarbage("setpause", pause)
+end
+print("Shared Buffer tests passed")
+
+-- Log tests
+do
+	local log = bufflib.log(64)
+	assert(log:capacity() == 64, "log capacity failed")
+	assert(log:add(teststr, testsep) and log:add(teststr), "log add failed")
+	assert(not log:add(testlongstr) and log:dropped() == 1, "log dropped record not counted")
+
+	local attached = bufflib.attach(log:token())
+	assert(attached:add(testsep), "attached log add failed")
+
+	local dest = bufflib.new()
+	assert(log:drain(dest) == #teststr * 2 + #testsep * 2, "log drain failed")
+	assert(tostring(dest) == teststr .. testsep .. teststr .. testsep, "log drain contents failed")
+	assert(attached:drain(dest) == 0, "log drain (empty) failed")
+
+	for i = 1, 100 do log:add("0123456789") end
+	assert(log:dropped() == 1 + 100 - 6, "log full segment not counted")
+	assert(log:drain(dest:reset()) == 60 and tostring(dest) == ("0123456789"):rep(6), "log drain (full segment) failed")
+end
+print("Log tests passed")
+
+-- Mapped Buffer tests
+if package.config:sub(1, 1) == "/" then
+	local path = os.tmpname()
+	local mapped = assert(bufflib.mapped(path))
+	mapped:add(teststr):add(testlongstr, testtab)
+	assert(tostring(mapped) == teststr .. testlongstr .. testtabstr, "mapped add failed")
+	assert(mapped:flush() == mapped, "mapped flush failed")
+
+	local file = assert(io.open(path, "rb"))
+	assert(file:read("*a") == teststr .. testlongstr .. testtabstr, "mapped file contents (flush) failed")
+	file:close()
+
+	mapped:reset():add(teststr, teststr)
+	assert(tostring(mapped) == teststr .. teststr, "mapped reset failed")
+	assert(mapped:close() and #mapped == 0, "mapped close failed")
+
+	file = assert(io.open(path, "rb"))
+	assert(file:read("*a") == teststr .. teststr, "mapped file contents (close) failed")
+	file:close()
+	os.remove(path)
+	print("Mapped Buffer tests passed")
+end
+
+-- Compression tests
+do
+	local plain = bufflib.new()
+	for i = 1, 2000 do
+		plain:add(teststr, i, " ")
+	end
+	local plainstr = tostring(plain)
+
+	local packed = plain:compress()
+	assert(bufflib.isbuffer(packed) and #packed < #plain, "compress failed")
+	local unpacked, nextpos = bufflib.new():adddecompressed(packed)
+	assert(tostring(unpacked) == plainstr and nextpos == #packed + 1, "compress/adddecompressed round trip failed")
+
+	local fast = plain:compress(1)
+	assert(tostring(bufflib.new():adddecompressed(tostring(fast))) == plainstr, "compress level 1 round trip failed")
+	assert(tostring(bufflib.new():adddecompressed(bufflib.compress(bufflib.new()))) == "", "compress empty failed")
+
+	-- One frame per chunk, decompressed as the stream arrives
+	local stream = bufflib.new()
+	stream:addcompressed("first chunk "):addcompressed(plain, 5):addcompressed("last chunk")
+	local streamstr = tostring(stream)
+	local out, pos = bufflib.new(), 1
+	for i = 7, #streamstr, 7 do
+		local _
+		_, pos = out:adddecompressed(streamstr:sub(1, i), pos)
+	end
+	out:adddecompressed(streamstr, pos)
+	assert(tostring(out) == "first chunk " .. plainstr .. "last chunk", "streaming decompression failed")
+
+	local corrupt = tostring(packed):sub(1, 20) .. "\255" .. tostring(packed):sub(22)
+	assert(not pcall(bufflib.adddecompressed, bufflib.new(), corrupt), "corrupt frame not detected")
+	local badsum = tostring(packed):sub(1, -2) .. string.char((tostring(packed):byte(-1) + 1) % 256)
+	local kept = bufflib.new("kept")
+	assert(not pcall(kept.adddecompressed, kept, badsum) and tostring(kept) == "kept", "corrupt frame content not discarded")
+	local random = {}
+	for i = 1, 64 do
+		random[i] = string.char((i * 97 + 13) % 256)
+	end
+	local stored = tostring(bufflib.new(table.concat(random)):compress()) -- Incompressible, so the block is stored uncompressed
+	assert(tostring(bufflib.new():adddecompressed(stored)) == table.concat(random), "stored block round trip failed")
+	assert(not pcall(bufflib.adddecompressed, bufflib.new(), stored:sub(1, 15) .. "\1\0\64\128" .. stored:sub(20)), "oversized stored block not detected")
+	assert(not pcall(stream.addcompressed, stream, stream), "compressing into self not detected")
+	print("Compression tests passed")
+end
+
+-- Gather write tests
+do
+	local path = os.tmpname()
+	local head, body = bufflib.new("head:"), bufflib.new(teststr)
+	local list = {head, "|", body, "", bufflib.new(), "|end"}
+	local total = #head + 1 + #body + 4
+
+	local file = assert(io.open(path, "wb"))
+	file:write("pre|")
+	assert(bufflib.writev(file, list) == total, "writev failed")
+	assert(bufflib.writev(file, list, total - 5) == total, "writev with skip failed")
+	assert(bufflib.writev(file, list, total) == total, "writev with everything skipped failed")
+	file:close()
+
+	file = assert(io.open(path, "rb"))
+	local whole = "head:|" .. teststr .. "|end"
+	assert(file:read("*a") == "pre|" .. whole .. whole:sub(-5), "writev file contents failed")
+	file:close()
+	os.remove(path)
+
+	local badok, baderr = pcall(bufflib.writev, -1, {"a", true})
+	assert(not pcall(bufflib.writev, -1, {1}) and not badok and baderr:find("bad element #2 in list", 1, true), "writev bad element not detected")
+	local ok, err, written = bufflib.writev(-1, list)
+	assert(ok == nil and type(err) == "string" and written == 0, "writev bad descriptor failed")
+	print("Gather write tests passed")
+end
+
+-- Buffer to Buffer tests
+do
+	local src = bufflib.new("0123456789")
+	local dest = bufflib.new("x")
+	assert(tostring(dest:addbuffer(src)) == "x0123456789", "addbuffer failed")
+	assert(tostring(bufflib.new():addbuffer(src, 3, 5)) == "234", "addbuffer range failed")
+	assert(tostring(bufflib.new():addbuffer(src, -3)) == "789", "addbuffer negative range failed")
+	assert(tostring(bufflib.addbuffer(bufflib.new(), src, 6, 2)) == "", "addbuffer empty range failed")
+
+	local self = bufflib.new(teststr)
+	for i = 1, 10 do self:addbuffer(self) end -- Grows past the initial buffer while copying from itself
+	assert(tostring(self) == teststr:rep(1024), "addbuffer self failed")
+
+	assert(tostring(bufflib.new():add(src, "|", src)) == "0123456789|0123456789", "add Buffer failed")
+	assert(tostring(bufflib.new():addsep(",", src, src)) == "0123456789,0123456789", "addsep Buffer failed")
+
+	local joined = src .. dest
+	assert(joined ~= src and tostring(joined) == "0123456789x0123456789", "concat Buffers failed")
+	assert(#src == 10, "concat modified left Buffer")
+
+	local page = bufflib.new({inplace = true}, "<p>")
+	local result = page .. src .. bufflib.new("</p>")
+	assert(rawequal(result, page) and tostring(page) == "<p>0123456789</p>", "inplace concat failed")
+	assert(tostring(page .. page) == "<p>0123456789</p><p>0123456789</p>", "inplace self concat failed")
+	assert(tostring(bufflib.new({inplace = false})) == "", "options table added to Buffer")
+	print("Buffer to Buffer tests passed")
+end
+
+-- Table join tests
+do
+	local parts = {}
+	for i = 1, 100000 do
+		parts[i] = (i % 3 == 0) and i or tostring(i)
+	end
+	parts[50] = bufflib.new("fifty")
+	local expected = table.concat(parts, ",", 1, 49) .. ",fifty," .. table.concat(parts, ",", 51)
+
+	assert(tostring(bufflib.new():addtable(parts, ",")) == expected, "addtable failed")
+	assert(tostring(bufflib.new("x"):addtable({"a", 1.5, "c"})) == "xa1.5c", "addtable no separator failed")
+	assert(tostring(bufflib.new():addtable({"a", "b", "c", "d"}, "-", 2, 3)) == "b-c", "addtable range failed")
+	assert(tostring(bufflib.new():addtable({"a", [4294967297] = "big"}, "-", 4294967297, 4294967297)) == "big", "addtable large index failed")
+	local ok, err = pcall(bufflib.addtable, bufflib.new(), {"a", "b"}, "", 4294967297, 4294967298)
+	assert(not ok and err:find("at index 4294967297)", 1, true) and err:find("got nil", 1, true), "addtable large index read the wrong element")
+	assert(tostring(bufflib.addtable(bufflib.new("x"), {}, ",")) == "x", "addtable empty failed")
+
+	local self = bufflib.new("ab")
+	assert(tostring(self:addtable({self, "|", self})) == "abab|ab", "addtable self failed")
+	assert(not pcall(bufflib.addtable, bufflib.new(), {"a", {}}), "addtable invalid element not detected")
+	print("Table join tests passed")
+end
+
+-- UTF-8 tests
+do
+	local text = bufflib.new("h\195\169llo w\195\182rld \226\130\172 \240\159\152\128")
+	assert(text:utf8valid() == true, "utf8valid failed")
+	assert(text:utf8len() == 15, "utf8len failed")
+	assert(text:utf8sub(2, 5) == "\195\169llo", "utf8sub failed")
+	assert(text:utf8sub(-3) == "\226\130\172 \240\159\152\128", "utf8sub negative failed")
+	assert(text:utf8sub(10, 2) == "", "utf8sub empty failed")
+	local ok, err = pcall(bufflib.utf8sub, bufflib.new("ab\255c"), 1)
+	assert(not ok and err:find("invalid UTF%-8 at position 3$"), "utf8sub invalid position failed")
+
+	-- Long text crosses several index strides and SWAR words
+	local long = bufflib.new()
+	local chars = {}
+	for i = 1, 5000 do
+		local cp = (i % 5 == 0) and (0x400 + i) or (i % 7 == 0) and 0x1F600 or (0x61 + i % 26)
+		long:addcodepoint(cp)
+		chars[i] = cp
+	end
+	assert(long:utf8len() == 5000, "utf8len long failed")
+	for _, i in ipairs{1, 63, 64, 65, 129, 4999, 5000} do
+		assert(long:utf8sub(i, i) == tostring(bufflib.new():addcodepoint(chars[i])), "utf8sub long failed at " .. i)
+	end
+
+	long:add("!") -- Any change invalidates the cached index
+	assert(long:utf8len() == 5001 and long:utf8sub(-1) == "!", "utf8 index invalidation failed")
+	long:reset():add("abc")
+	assert(long:utf8len() == 3, "utf8 index reset failed")
+
+	local bad = bufflib.new("abcdefghij\237\160\128") -- An encoded surrogate
+	local ok, pos = bad:utf8valid()
+	assert(ok == false and pos == 11, "utf8valid invalid failed")
+	assert(select(2, bad:utf8len()) == 11 and not pcall(bad.utf8sub, bad, 1), "utf8len invalid failed")
+	assert(not bufflib.new("\192\128"):utf8valid() and not bufflib.new("\244\144\128\128"):utf8valid(), "utf8valid overlong/out of range failed")
+	assert(not pcall(bufflib.addcodepoint, bufflib.new(), 0xD800), "addcodepoint surrogate not detected")
+	print("UTF-8 tests passed")
+end
+
+-- Byte transform tests
+do
+	local all = {}
+	for i = 0, 255 do all[#all + 1] = string.char(i) end
+	all = table.concat(all)
+	local upper = all:gsub("%l", string.upper) -- Only ASCII letters are converted, so build the expected result byte by byte
+	local lower = all:gsub("%u", string.lower)
+
+	local buff = bufflib.new(all, all)
+	assert(tostring(buff:upper()) == upper .. upper, "upper failed")
+	assert(tostring(buff:lower()) == lower .. lower, "lower failed")
+	assert(tostring(bufflib.upper(bufflib.new("MiXeD cAsE 123"))) == "MIXED CASE 123", "upper mixed failed")
+
+	assert(tostring(bufflib.new("aabbcc"):translate("abc", "xyz")) == "xxyyzz", "translate failed")
+	assert(tostring(bufflib.new("line\r\nline\r\n"):translate("", "", "\r")) == "line\nline\n", "translate delete failed")
+	assert(tostring(bufflib.new("a-b_c"):translate("-_", "  ", "b")) == "a  c", "translate replace and delete failed")
+	assert(tostring(bufflib.new("abcab"):translate("a", "b", "b")) == "bcb", "translate delete of replaced bytes failed")
+	assert(tostring(bufflib.new("abc"):translate("a", "x", "a")) == "bc", "translate delete of original bytes failed")
+	assert(not pcall(bufflib.translate, bufflib.new(), "ab", "x"), "translate length mismatch not detected")
+	print("Byte transform tests passed")
+end
+
+-- Random access tests
+do
+	local buff = bufflib.new("hello world")
+	assert(buff:byte() == 104 and buff:byte(-1) == 100, "byte failed")
+	assert(select("#", buff:byte(1, -1)) == 11 and select(3, buff:byte(1, 3)) == 108, "byte range failed")
+	assert(buff:byte(20) == nil, "byte out of range failed")
+
+	assert(buff:sub(1, 5) == "hello" and buff:sub(-5) == "world" and buff:sub(8, 3) == "", "sub failed")
+	assert(tostring(buff:setbyte(1, 72)) == "Hello world", "setbyte failed")
+	assert(tostring(buff:setbyte(-5, 87, 79)) == "Hello WOrld", "setbyte multiple failed")
+	assert(not pcall(buff.setbyte, buff, -1, 33, 33), "setbyte out of range not detected")
+	assert(not pcall(buff.setbyte, buff, 1, 256), "setbyte value out of range not detected")
+	assert(buff:utf8len() == 11 and not pcall(buff.setbyte, buff, 1, 65, 300), "setbyte later value out of range not detected")
+	assert(tostring(buff) == "Hello WOrld" and buff:utf8len() == 11, "setbyte error modified the Buffer")
+
+	assert(buff:find("o") == 5 and buff:find("o", 6) == nil and buff:find("O", -5) == 8, "find failed")
+	local s, e = buff:find("WOrld")
+	assert(s == 7 and e == 11 and buff:find("world") == nil and buff:find("", 3) == 3, "find string failed")
+
+	assert(tostring(buff:insert(6, ",")) == "Hello, WOrld", "insert failed")
+	assert(tostring(buff:insert(1, bufflib.new(">"))) == ">Hello, WOrld", "insert Buffer failed")
+	assert(tostring(buff:insert(-1, "!")) == ">Hello, WOrld!", "insert at end failed")
+	assert(tostring(buff:remove(1)) == "Hello, WOrld!", "remove failed")
+	assert(tostring(buff:remove(6, 7)) == "HelloWOrld!", "remove range failed")
+	assert(tostring(buff:truncate(5)) == "Hello" and #buff:truncate(10) == 5, "truncate failed")
+	assert(tostring(buff:insert(3, buff)) == "HeHellollo", "insert self failed")
+
+	local big = bufflib.new(("x"):rep(1000))
+	big:insert(500, ("y"):rep(2000)) -- Grows the Buffer while moving the tail
+	assert(tostring(big) == ("x"):rep(499) .. ("y"):rep(2000) .. ("x"):rep(501), "insert grow failed")
+	print("Random access tests passed")
+end
+
+-- Gap Buffer tests
+do
+	local doc = bufflib.new({mode = "gap"}, "0123456789")
+	local plain = "0123456789"
+	local function edit(op, pos, a, b)
+		if op == "insert" then
+			doc:insert(pos, a)
+			plain = plain:sub(1, pos - 1) .. a .. plain:sub(pos)
+		else
+			doc:remove(pos, a)
+			plain = plain:sub(1, pos - 1) .. plain:sub(a + 1)
+		end
+		assert(#doc == #plain and doc:sub(1, -1) == plain, "gap " .. op .. " failed")
+	end
+
+	edit("insert", 5, "abc")
+	edit("insert", 8, "de")
+	edit("remove", 3, 6)
+	edit("insert", 1, ("x"):rep(600)) -- Grows the Buffer while the gap is open
+	edit("insert", #plain + 1, "end")
+	edit("remove", 590, 605)
+	for i = 1, 200 do
+		edit("insert", 300 + i, string.char(65 + i % 26))
+	end
+
+	assert(doc:sub(295, 305) == plain:sub(295, 305) and doc:sub(-5) == plain:sub(-5), "gap sub failed")
+	assert(doc:byte(302) == plain:byte(302) and doc:byte(-1) == plain:byte(-1), "gap byte failed")
+	doc:setbyte(700, 33)
+	plain = plain:sub(1, 699) .. "!" .. plain:sub(701)
+	assert(doc:find("!") == 700, "gap find failed")
+	assert(tostring(doc) == plain, "gap tostring failed")
+	edit("insert", 10, "again") -- Reopens the gap after tostring closed it
+	assert(tostring(bufflib.new():add(doc)) == plain, "gap add failed")
+	assert(not pcall(bufflib.new, {mode = "nope"}), "invalid mode not detected")
+	print("Gap Buffer tests passed")
+end
+
+-- Matcher tests
+do
+	local m = bufflib.matcher({"he", "she", "his", "hers"})
+	local text = bufflib.new("ushers and his hero")
+	local s, e, i = m:find(text)
+	assert(s == 2 and e == 4 and i == 2, "matcher find failed") -- "she" ends before "he" starts a longer match
+	s, e, i = m:find(text, 5)
+	assert(s == 12 and e == 14 and i == 3, "matcher find init failed")
+	assert(m:find("nothing to see") == nil, "matcher find no match failed")
+	assert(m:count(text) == 5 and m:count("hehehe") == 3, "matcher count failed")
+
+	local found = {}
+	assert(m:each(text, function(s, e, i) found[#found + 1] = s .. "-" .. e .. ":" .. i end) == 5, "matcher each count failed")
+	assert(table.concat(found, " ") == "2-4:2 3-4:1 3-6:4 12-14:3 16-17:1", "matcher each failed")
+	assert(m:each(text, function() return false end) == 1, "matcher each stop failed")
+
+	local nocase = bufflib.matcher({"Forbidden", "WORD"}, true)
+	assert(nocase:count("a forbidden word, a FORBIDDEN Word") == 4, "matcher ignorecase failed")
+	assert(bufflib.matcher({"Word"}):count("word WORD Word") == 1, "matcher case sensitive failed")
+	assert(bufflib.matcher({}):count(text) == 0, "empty matcher failed")
+	assert(not pcall(bufflib.matcher, {"ok", ""}), "empty needle not detected")
+	local allbytes = {}
+	for c = 0, 255 do
+		allbytes[#allbytes + 1] = string.char(c)
+	end
+	local every = bufflib.matcher({table.concat(allbytes), "\255"})
+	assert(every:find("\0") == nil and every:count("\0\0\0") == 0, "matcher with every byte matched the wrong byte")
+	assert(every:count("\254\255\0") == 1 and select(3, every:find(table.concat(allbytes))) == 1, "matcher with every byte failed")
+	print("Matcher tests passed")
+end
+
+-- Template tests
+do
+	local page = bufflib.template("<h1>{{ title }}</h1>{{! a comment }}<ul>{{#items}}<li>{{name}}={{{raw}}}</li>{{/items}}</ul>{{^items}}none{{/items}}")
+	local env = {title = "A & B", items = {{name = "<x>", raw = "<b>"}, {name = 2, raw = bufflib.new("buff")}}}
+	assert(tostring(page:render(bufflib.new(), env)) == "<h1>A &amp; B</h1><ul><li>&lt;x&gt;=<b></li><li>2=buff</li></ul>", "template render failed")
+	assert(tostring(page:render(bufflib.new(), {title = "t", items = {}})) == "<h1>t</h1><ul></ul>none", "template inverted failed")
+
+	local paths = bufflib.template("{{user.address.city}} {{&user.name}} {{list.2}} {{%q}} {{missing.deep}}|{{#user}}{{name}}/{{title}}{{/user}}|{{#list}}{{.}},{{/list}}|{{#flag}}yes{{/flag}}")
+	local out = paths:render(bufflib.new("> "), {
+		title = "outer",
+		user = {name = "Ann", address = {city = "Oslo"}},
+		list = {"a", "b", "c"},
+		q = "a b&c/d",
+		flag = true
+	})
+	assert(tostring(out) == "> Oslo Ann b a%20b%26c%2Fd |Ann/outer|a,b,c,|yes", "template paths failed")
+
+	assert(not pcall(bufflib.template, "{{#a}}x"), "unclosed section not detected")
+	assert(not pcall(bufflib.template, "{{#a}}x{{/b}}"), "mismatched section not detected")
+	assert(not pcall(bufflib.template, "text {{name"), "unclosed tag not detected")
+	assert(tostring(bufflib.template("no tags { } here"):render(bufflib.new(), {})) == "no tags { } here", "template without tags failed")
+	print("Template tests passed")
+end
+
+-- Lua serialisation tests
+do
+	local loadstring = loadstring or load
+	local function roundtrip(value, opts)
+		local src = tostring(bufflib.new():addlua(value, opts))
+		return assert(loadstring("return " .. src))(), src
+	end
+
+	local value = {1, 2.5, "three", true, name = "x", ["not an identifier"] = "\0\1\"\\\n\2552", [10] = -1e300, nested = {a = {b = {}}}}
+	local copy = roundtrip(value)
+	assert(copy[1] == 1 and copy[2] == 2.5 and copy[3] == "three" and copy[4] == true and copy[10] == -1e300, "addlua array failed")
+	assert(copy.name == "x" and copy["not an identifier"] == value["not an identifier"] and type(copy.nested.a.b) == "table", "addlua keys failed")
+	assert(roundtrip(0.1) == 0.1 and roundtrip(1 / 3) == 1 / 3 and roundtrip(math.huge) == math.huge and roundtrip(-math.huge) == -math.huge, "addlua numbers failed")
+	local nan = roundtrip(0 / 0)
+	assert(nan ~= nan, "addlua nan failed")
+	if math.type then
+		assert(math.type(roundtrip(3)) == "integer" and math.type(roundtrip(3.0)) == "float" and math.type(roundtrip(math.mininteger)) == "integer" and roundtrip(math.mininteger) == math.mininteger, "addlua integer/float failed")
+	end
+
+	local shared = {}
+	local cyclic = {a = shared, b = shared}
+	cyclic.self = cyclic
+	shared[1] = cyclic
+	copy = roundtrip(cyclic)
+	assert(copy.a == copy.b and copy.self == copy and copy.a[1] == copy, "addlua shared references failed")
+
+	local _, src1 = roundtrip({z = 1, a = 2, [3] = 3, [1.5] = 4, m = {y = 1, b = 2}}, {sort = true})
+	assert(src1 == '{[1.5]=4,[3]=3,a=2,m={b=2,y=1},z=1}', "addlua sort failed")
+	local function sharedvalue(padding)
+		local tables = {}
+		for i = 1, 20 do -- Allocate the shared tables in a different order (and at different addresses) each time
+			tables[(i * padding) % 20 + 1] = {i}
+		end
+		local root = {self = nil}
+		for i, t in ipairs(tables) do
+			root["k" .. t[1]] = t
+			root["l" .. t[1]] = t
+		end
+		root.self = root
+		return root
+	end
+	local sorted
+	copy, sorted = roundtrip(sharedvalue(3), {sort = true})
+	for padding = 7, 17, 10 do
+		assert(tostring(bufflib.new():addlua(sharedvalue(padding), {sort = true})) == sorted, "addlua sort with shared tables not deterministic")
+	end
+	assert(copy.self == copy and copy.k5 == copy.l5 and copy.k5[1] == 5, "addlua sorted shared references failed")
+	assert(sorted:find("t%[1%] = {} t%[2%] = {}.* t%[1%]%.k1=t%[2%]"), "addlua shared ids not in sorted order")
+	assert(not pcall(bufflib.addlua, bufflib.new(), {print}), "addlua function not detected")
+	print("Lua serialisation tests passed")
+end
+
+-- MessagePack tests
+do
+	local function hex(s)
+		return (s:gsub(".", function(c) return string.format("%02x", c:byte()) end))
+	end
+	local function encode(...)
+		return tostring(bufflib.new():addmsgpack(...))
+	end
+	assert(hex(encode(nil, false, true, 0, 127, 128, 65535, 65536, -1, -32, -33, -129, -40000)) == "c0c2c300" .. "7fcc80cdffffce00010000ffe0d0dfd1ff7fd2ffff63c0", "msgpack scalar encoding failed")
+	assert(hex(encode(4294967296, 0.5, 0.1)) == "cf0000000100000000ca3f000000cb3fb999999999999a", "msgpack number encoding failed")
+	assert(hex(encode("abc", {1, 2}, {}, {a = 1})) == "a3616263920102" .. "9081a16101", "msgpack container encoding failed")
+	assert(hex(encode(string.rep("x", 32))):sub(1, 4) == "d920" and hex(encode(string.rep("x", 256))):sub(1, 6) == "da0100", "msgpack str header failed")
+
+	local value = {1, -2.5, "three", true, {nested = {"deep"}}, big = -2147483649, huge = 1e300, bin = "\0\255"}
+	local stream = bufflib.new():addmsgpack(value, "second", nil)
+	local copy, pos = stream:unpackmsg()
+	assert(copy[1] == 1 and copy[2] == -2.5 and copy[3] == "three" and copy[4] == true and copy[5].nested[1] == "deep", "msgpack array roundtrip failed")
+	assert(copy.big == -2147483649 and copy.huge == 1e300 and copy.bin == "\0\255", "msgpack map roundtrip failed")
+	local second, pos2 = bufflib.unpackmsg(tostring(stream), pos)
+	assert(second == "second", "msgpack stream decode failed")
+	local third, pos3 = stream:unpackmsg(pos2)
+	assert(third == nil and pos3 == #stream + 1, "msgpack nil decode failed")
+
+	local partial = tostring(stream):sub(1, pos - 2)
+	assert(select("#", bufflib.unpackmsg(partial)) == 1 and bufflib.unpackmsg(partial) == nil, "msgpack incomplete not detected")
+	assert(bufflib.unpackmsg("\196\2ab") == "ab", "msgpack bin decode failed")
+	if math.type then
+		assert(math.type(bufflib.unpackmsg(encode(2.0))) == "float" and bufflib.unpackmsg(encode(math.mininteger)) == math.mininteger, "msgpack integer/float failed")
+	end
+	assert(not pcall(bufflib.unpackmsg, "\193"), "msgpack invalid type not detected")
+	assert(not pcall(bufflib.addmsgpack, bufflib.new(), print), "msgpack function not detected")
+	print("MessagePack tests passed")
+end
+
+-- CSV tests
+do
+	local buff = bufflib.new():addcsvrow({"id", "name", "note"}):addcsvrow({1, 'say "hi"', "a,b"}):addcsvrow({2.5, nil, "line\nbreak", true, bufflib.new("buff"), n = 5})
+	assert(tostring(buff) == 'id,name,note\r\n1,"say ""hi""","a,b"\r\n2.5,,"line\nbreak",true,buff\r\n', "addcsvrow failed")
+	local long = string.rep("abcdefgh", 10)
+	assert(tostring(bufflib.new():addcsvrow({long, long .. '"' .. long})) == long .. ',"' .. long .. '""' .. long .. '"\r\n', "addcsvrow long fields failed")
+	assert(tostring(bufflib.new():addcsvrow({"a,b", "c\td", "'"}, {delimiter = "\t", quote = "'", eol = "\n"})) == "a,b\t'c\td'\t''''\n", "addcsvrow options failed")
+	assert(tostring(bufflib.new():addcsvrow({})) == "\r\n", "addcsvrow empty row failed")
+	assert(tostring(bufflib.new():addcsvrow({"a", n = 3})) == "a,,\r\n" and tostring(bufflib.new():addcsvrow({"a", "b", n = 1})) == "a\r\n", "addcsvrow n failed")
+	assert(not pcall(bufflib.addcsvrow, bufflib.new(), {n = -1}) and not pcall(bufflib.addcsvrow, bufflib.new(), {n = 1.5}), "addcsvrow bad n not detected")
+	if math.type then
+		assert(tostring(bufflib.new():addcsvrow({3, 3.0, -0.5})) == "3,3.0,-0.5\r\n", "addcsvrow number formatting failed")
+	end
+	assert(not pcall(bufflib.addcsvrow, bufflib.new(), {{}}), "addcsvrow table field not detected")
+	assert(not pcall(bufflib.addcsvrow, bufflib.new(), {"a"}, {delimiter = ";;"}), "addcsvrow bad delimiter not detected")
+	print("CSV tests passed")
+end
+
+-- Varint and bits tests
+do
+	local function hex(s)
+		return (tostring(s):gsub(".", function(c) return string.format("%02x", c:byte()) end))
+	end
+	assert(hex(bufflib.new():addvarint(0, 1, 127, 128, 300, 4294967296)) == "00017f8001ac02" .. "8080808010", "addvarint failed")
+	assert(hex(bufflib.new():addvarint(-1)) == "ffffffffffffffffff01", "addvarint negative failed")
+	assert(hex(bufflib.new():addzigzag(0, -1, 1, -2, 2147483647, -2147483648)) == "00010203feffffff0fffffffff0f", "addzigzag failed")
+
+	local values = {0, 1, -1, 63, -64, 64, 1000000, -1000000, 2 ^ 40, -(2 ^ 40)}
+	local buff = bufflib.new()
+	for _, v in ipairs(values) do
+		buff:addvarint(v):addzigzag(v)
+	end
+	local pos = 1
+	for _, v in ipairs(values) do
+		local a, b
+		a, pos = buff:readvarint(pos)
+		b, pos = bufflib.readzigzag(tostring(buff), pos)
+		assert(a == v and b == v, "varint roundtrip failed for " .. v)
+	end
+	assert(pos == #buff + 1, "varint positions failed")
+	assert(bufflib.readvarint("\128\128") == nil, "incomplete varint not detected")
+	assert(not pcall(bufflib.readvarint, string.rep("\255", 11)), "long varint not detected")
+	assert(not pcall(bufflib.addvarint, bufflib.new(), 1.5), "non-integer varint not detected")
+
+	local bits = bufflib.new("x")
+	local writer = bits:bits()
+	assert(writer:put(5, 3):put(1, 1):put(300, 12):flush() == bits and hex(bits) == "78b12c", "bit writer failed")
+	bits:bits():put(1, 1):put(0x123456789, 36):put(3, 2):flush()
+	assert(bits:readbits(8, 3) == 5 and select(2, bits:readbits(8, 3)) == 11 and bits:readbits(12, 12) == 300, "readbits failed")
+	assert(bits:readbits(24, 1) == 1 and bits:readbits(25, 36) == 0x123456789 and bits:readbits(61, 2) == 3 and bits:readbits(63, 1) == 0, "readbits wide failed")
+	assert(#bits == 8 and bits:readbits(62, 3) == nil, "bit writer padding failed")
+	assert(not pcall(writer.put, writer, 1, 65), "bit count not checked")
+	print("Varint and bits tests passed")
+end
+
+-- Clone tests
+do
+	local prefix = bufflib.new():add(string.rep("header ", 2000))
+	local a, b = prefix:clone(), prefix:clone()
+	assert(tostring(a) == tostring(prefix) and #b == #prefix, "clone failed")
+	a:add("A")
+	b:add("B"):upper()
+	prefix:add("P")
+	assert(tostring(a) == string.rep("header ", 2000) .. "A", "clone append failed")
+	assert(tostring(b) == string.rep("HEADER ", 2000) .. "B", "clone in place change failed")
+	assert(tostring(prefix) == string.rep("header ", 2000) .. "P", "cloned Buffer changed")
+
+	local base = bufflib.new():add(string.rep("x", 10000))
+	local c = base:clone()
+	base:truncate(5):add("y")
+	assert(#c == 10000 and tostring(c):sub(1, 7) == "xxxxxxx" and tostring(base) == "xxxxxy", "clone truncate failed")
+	local d = c:clone()
+	c:reset()
+	d:setbyte(1, 65)
+	assert(#c == 0 and tostring(d):sub(1, 2) == "Ax" and #d == 10000, "clone after reset failed")
+
+	local gap = bufflib.new({mode = "gap"}):add(string.rep("g", 10000))
+	gap:insert(5, "-")
+	local e = gap:clone()
+	e:insert(2, "+")
+	gap:remove(1, 1)
+	assert(tostring(e):sub(1, 7) == "g+ggg-g" and tostring(gap):sub(1, 6) == "ggg-gg", "clone gap Buffer failed")
+	assert(tostring(bufflib.new("small"):clone():add("!")) == "small!", "clone small Buffer failed")
+	print("Clone tests passed")
+end
+
+-- Take tests
+do
+	local big = bufflib.new():add(string.rep("0123456789", 10000))
+	local s = big:take()
+	assert(s == string.rep("0123456789", 10000) and #big == 0 and tostring(big:add("again")) == "again", "take failed")
+	assert(bufflib.new("small"):take() == "small" and bufflib.take(bufflib.new()) == "", "take small failed")
+	local shared = bufflib.new():add(string.rep("s", 5000))
+	local clone = shared:clone()
+	assert(clone:take() == string.rep("s", 5000) and #clone == 0 and #shared == 5000 and tostring(shared) == string.rep("s", 5000), "take clone failed")
+	local full = bufflib.new({maxsize = 20000})
+	for i = 1, 20 do
+		full:add(string.rep("f", 1000))
+	end
+	assert(full:take() == string.rep("f", 20000) and #full == 0, "take at maxsize failed")
+	print("Take tests passed")
+end
+
+-- Inline size tests
+do
+	local function footprint(opts)
+		collectgarbage()
+		local before, list = collectgarbage("count"), {}
+		for i = 1, 1000 do
+			list[i] = bufflib.new(opts)
+		end
+		return collectgarbage("count") - before
+	end
+	assert(footprint({inline = 0}) + bufflib.buffersize / 2 < footprint({inline = bufflib.buffersize}), "inline option didn't shrink Buffers")
+
+	local empty = bufflib.new({inline = 0})
+	assert(#empty == 0 and tostring(empty) == "", "inline 0 empty Buffer failed")
+	empty:add("a"):add(string.rep("b", 100)):add("c")
+	assert(tostring(empty) == "a" .. string.rep("b", 100) .. "c", "inline 0 add failed")
+	empty:reset():add("again")
+	assert(tostring(empty) == "again" and tostring(empty:clone():add("!")) == "again!", "inline 0 reset failed")
+	local small = bufflib.new({inline = 4, mode = "gap"}, "abc")
+	small:insert(2, "--"):add(string.rep("x", 10))
+	assert(tostring(small) == "a--bc" .. string.rep("x", 10), "inline gap failed")
+	assert(not pcall(bufflib.new, {inline = -1}) and not pcall(bufflib.new, {inline = bufflib.buffersize + 1}), "inline range not checked")
+	print("Inline size tests passed")
+end
+
+-- Memory limit tests
+do
+	local capped = bufflib.new({maxsize = 100}, string.rep("a", 60))
+	assert(not pcall(capped.add, capped, string.rep("b", 41)), "maxsize not enforced")
+	assert(#capped == 60 and tostring(capped:add(string.rep("b", 40))) == string.rep("a", 60) .. string.rep("b", 40), "maxsize failed")
+	local ok, err = pcall(capped.add, capped, "!")
+	assert(not ok and err:find("limit"), "maxsize error failed")
+	local big = bufflib.new({maxsize = 5000})
+	for i = 1, 50 do
+		big:add(string.rep("x", 100))
+	end
+	local clone = big:clone()
+	assert(#big == 5000 and not pcall(big.add, big, "x") and not pcall(clone.add, clone, "x"), "maxsize growth failed")
+
+	collectgarbage()
+	local base = bufflib.usage()
+	local grown = bufflib.new():add(string.rep("y", 100000))
+	local used = bufflib.usage()
+	assert(used - base >= 100000, "usage not counted")
+	assert(bufflib.setlimit(used + 1000) == nil and select(2, bufflib.usage()) == used + 1000, "setlimit failed")
+	local other = bufflib.new()
+	ok, err = pcall(other.add, other, string.rep("z", 50000))
+	assert(not ok and err:find("memory limit exceeded") and #other == 0, "memory limit not enforced")
+	grown:reset()
+	other:add(string.rep("z", 50000))
+	assert(#other == 50000, "memory limit not released")
+	assert(bufflib.setlimit() == used + 1000 and select(2, bufflib.usage()) == nil, "removing the limit failed")
+	other:reset()
+	assert(bufflib.usage() == base, "usage not released")
+
+	local text = bufflib.new():add(string.rep("u", 100000))
+	used = bufflib.usage()
+	bufflib.setlimit(used + 1000)
+	ok, err = pcall(text.utf8len, text)
+	assert(not ok and err:find("memory limit exceeded"), "utf8 index not limited")
+	bufflib.setlimit()
+	assert(text:utf8len() == 100000 and bufflib.usage() >= used + 100000 / 64, "utf8 index not counted")
+	text:reset()
+	assert(bufflib.usage() == base, "utf8 index usage not released")
+	print("Memory limit tests passed")
+end
+
+-- Worker thread tests
+do
+	local function check(label)
+		local text = string.rep("Hello, wörld! ÀÉÎ 123 ", 2000) .. "needle" .. string.rep("abc€", 3000)
+		local buff = bufflib.new(text)
+		assert(tostring(buff:upper()) == text:gsub("%l", string.upper), label .. " upper failed")
+		assert(tostring(buff:lower()) == text:gsub("%u", string.lower), label .. " lower failed")
+		buff:reset():add(text):translate("lo", "01")
+		assert(tostring(buff) == text:gsub("[lo]", {l = "0", o = "1"}), label .. " translate failed")
+		buff:reset():add(text)
+		assert(buff:find("needle") == text:find("needle", 1, true) and buff:find("needle", -10) == nil, label .. " find failed")
+		assert(buff:find("Hello", 100) == text:find("Hello", 100, true) and buff:find("€", -4) == #text - 2, label .. " find failed")
+		assert(buff:find("absent") == nil and select(2, buff:find("abc€abc", #text - 14)) == #text - 3, label .. " find failed")
+		local len = buff:utf8len()
+		assert(buff:utf8valid() and buff:utf8sub(44001, 44006) == "needle", label .. " utf8 failed")
+		assert(buff:utf8sub(-4) == "abc€" and buff:utf8sub(len - 1, len - 1) == "c", label .. " utf8sub failed")
+		buff:setbyte(30001, 0xbf)
+		local valid, pos = buff:utf8valid()
+		assert(not valid and pos == 30001, label .. " invalid utf8 failed")
+		assert(select(2, bufflib.new("\128", text):utf8len()) == 1, label .. " invalid start failed")
+		return len
+	end
+
+	local serial = check("serial")
+	assert(bufflib.setthreads(4, 1000) == 1, "setthreads failed")
+	assert(check("threaded") == serial, "threaded utf8len differs")
+	assert(not pcall(bufflib.setthreads, 0) and not pcall(bufflib.setthreads, 65), "thread count not checked")
+	local n, minsize = bufflib.setthreads(1)
+	assert(n == 4 and minsize == 1000, "setthreads result failed")
+	assert(check("serial") == serial, "reset threads failed")
+	print("Worker thread tests passed")
+end
+
+-- FFI backend tests (LuaJIT only)
+if jit then
+	local bffi = require("bufflib.ffi")
+	local ffi = require("ffi")
+
+	local ffibuff = bufflib.new(teststr)
+	local ptr, len = ffibuff:ptr()
+	assert(len == #teststr and ffi.string(ptr, len) == teststr, "ffi ptr failed")
+
+	for i = 1, 2000 do
+		bffi.add(ffibuff, teststr)
+	end
+	assert(tostring(ffibuff) == teststr .. testlongstr, "ffi add failed")
+
+	local p = ffibuff:reserve(3)
+	ffi.copy(p, "xyz", 3)
+	assert(tostring(ffibuff:commit(3)):sub(-3) == "xyz", "ffi reserve/commit failed")
+	print("FFI tests passed")
+end
+
 local initialGC = collectgarbage("count")
 collectgarbage()
 local gcdiff =  initialGC - collectgarbage("count")